@@ -66,6 +66,13 @@ struct BaseMTDDriverVMT {
 	_base_mtd_driver_methods
 };
 
+/** Base MTD driver, common part of all MTD drivers and partitions
+ */
+typedef struct {
+	const struct BaseMTDDriverVMT *vmt;
+	_base_mtd_driver_data
+} BaseMTDDriver;
+
 struct mtd_partition {
 	const char *name;
 	uint32_t start_page;
@@ -82,5 +89,9 @@ struct mtd_partition {
 
 #include <inttypes.h>
 #include "sst25.h"
+#include "mtdpool.h"
+#include "mtdutil.h"
+
+/* other modules are optional: include their headers, see flash-mtd.mk */
 
 #endif /* FLASH25_H */
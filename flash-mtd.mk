@@ -1,6 +1,15 @@
-FLASH25SRC = $(FLASH25)/sst25.c
+# core: sst25 driver, buffer pool and byte I/O helpers
+# optional modules are listed before including this file, e.g.
+#   FLASH25_MODULES = mtdkv mtdfile
+# modules: mtdconcat mtdclog mtdcapture mtdfatfs mtdkv mtdfile
+FLASH25SRC = $(FLASH25)/sst25.c \
+	     $(FLASH25)/mtdpool.c \
+	     $(FLASH25)/mtdutil.c \
+	     $(foreach m,$(FLASH25_MODULES),$(FLASH25)/$(m).c)
 
 FLASH25TESTSRC = $(FLASH25)/sst25.c \
+	     $(FLASH25)/mtdpool.c \
+	     $(FLASH25)/mtdutil.c \
 	     $(FLASH25)/flash_test.c \
 	     $(CHIBIOS)/os/various/chprintf.c
 
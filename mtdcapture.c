@@ -0,0 +1,328 @@
+/**
+ * @file       mtdcapture.c
+ * @brief      FLASH25 ISR-safe event capture to partition
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Producers (threads or ISRs, any number) push fixed size records into
+ * a lock-free bounded ring (per-slot sequence numbers, D. Vyukov MPMC
+ * scheme, used here with single consumer). Flusher thread drains the
+ * ring into erase block sized batch and programs whole pages, erasing
+ * each block when write position enters it. Partition is used as
+ * circular buffer starting from its beginning on every start.
+ * Full ring drops records and counts them.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "mtdcapture.h"
+
+#define RING_MASK	(MTDCAPTURE_RING_SIZE - 1)
+
+#define cap_mtd(cap)	((cap)->config->mtdp)
+
+/*
+ * Ring
+ */
+
+/**
+ * @brief move up to @p max records from ring to batch buffer
+ * @return number of records moved
+ * @notapi
+ */
+static uint32_t cap_ring_drain(MTDCapture *cap, uint32_t max)
+{
+	uint32_t count = 0;
+
+	while (count < max && cap->batch_size - cap->batch_len >= MTDCAPTURE_RECORD_SIZE) {
+		struct mtdcapture_slot *slot = &cap->ring[cap->dequeue_pos & RING_MASK];
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != cap->dequeue_pos + 1)
+			break; /* empty or producer still writing */
+
+		memcpy(cap->batch + cap->batch_len, slot->data, MTDCAPTURE_RECORD_SIZE);
+		cap->batch_len += MTDCAPTURE_RECORD_SIZE;
+		__atomic_store_n(&slot->seq, cap->dequeue_pos + MTDCAPTURE_RING_SIZE, __ATOMIC_RELEASE);
+		cap->dequeue_pos++;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Flusher
+ */
+
+/**
+ * @brief program @p len bytes of batch, erasing blocks on entry
+ * @notapi
+ */
+static bool cap_program(MTDCapture *cap, uint32_t len)
+{
+	BaseMTDDriver *mtdp = cap_mtd(cap);
+	uint32_t es = mtdGetEraseSize(mtdp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t size = mtdGetSize(mtdp);
+	const uint8_t *p = cap->batch;
+	bool ret = HAL_SUCCESS;
+
+	while (len > 0) {
+		uint32_t seg = es - cap->write_pos % es;
+		bool seg_ret = HAL_SUCCESS;
+
+		if (seg > len)
+			seg = len;
+
+		if (cap->write_pos % es == 0 &&
+				mtdErase(mtdp, cap->write_pos / ps, es / ps) == HAL_FAILED)
+			seg_ret = HAL_FAILED;
+		else if (mtdWriteBytes(mtdp, cap->write_pos, p, seg) == HAL_FAILED)
+			seg_ret = HAL_FAILED;
+
+		if (seg_ret == HAL_FAILED) {
+			cap->stats.lost += seg / MTDCAPTURE_RECORD_SIZE;
+			ret = HAL_FAILED;
+		}
+		else
+			cap->stats.written += seg / MTDCAPTURE_RECORD_SIZE;
+
+		cap->write_pos = (cap->write_pos + seg) % size;
+		p += seg;
+		len -= seg;
+	}
+
+	return ret;
+}
+
+/**
+ * @brief drain records present at entry, program page aligned part of batch
+ * Records pushed meanwhile are left for next flush, so producers can not
+ * keep flusher (and mtdcaptureSync()) here forever.
+ *
+ * @param[in] all program partial page too
+ * @notapi
+ */
+static void cap_flush(MTDCapture *cap, bool all)
+{
+	uint32_t ps = mtdGetPageSize(cap_mtd(cap));
+	uint32_t todo = mtdcaptureGetFill(cap);
+	uint32_t len;
+
+	for (;;) {
+		todo -= cap_ring_drain(cap, todo);
+
+		/* stop on page boundary of partition, unless batch is full */
+		len = cap->batch_len;
+		if (!all && len + MTDCAPTURE_RECORD_SIZE <= cap->batch_size) {
+			uint32_t end = cap->write_pos + len;
+
+			len = (end - end % ps > cap->write_pos)? end - end % ps - cap->write_pos : 0;
+		}
+
+		if (len == 0)
+			break;
+
+		cap_program(cap, len);
+		memmove(cap->batch, cap->batch + len, cap->batch_len - len);
+		cap->batch_len -= len;
+	}
+}
+
+static THD_FUNCTION(mtdcapture_thd, arg)
+{
+	MTDCapture *cap = arg;
+
+	chRegSetThreadName("mtdcapture");
+	while (!cap->stop_req) {
+		/* woken by push at half ring, sync or stop */
+		if (!cap->sync_req && mtdcaptureGetFill(cap) < MTDCAPTURE_RING_SIZE / 2)
+			chBSemWaitTimeout(&cap->wakeup, cap->config->flush_interval);
+
+		if (cap->sync_req) {
+			cap_flush(cap, true);
+			cap->sync_req = false;
+			chBSemSignal(&cap->synced);
+		}
+		else {
+			cap_flush(cap, false);
+		}
+	}
+
+	cap_flush(cap, true);
+}
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief Initializes an instance.
+ *
+ * @init
+ */
+void mtdcaptureObjectInit(MTDCapture *cap)
+{
+	uint32_t i;
+
+	osalDbgCheck(cap != NULL);
+
+	cap->config = NULL;
+	cap->thread = NULL;
+	cap->batch = NULL;
+	cap->enqueue_pos = 0;
+	cap->dequeue_pos = 0;
+	for (i = 0; i < MTDCAPTURE_RING_SIZE; i++)
+		cap->ring[i].seq = i;
+
+	memset(&cap->stats, 0, sizeof(cap->stats));
+	chBSemObjectInit(&cap->synced, true);
+	chBSemObjectInit(&cap->wakeup, true);
+}
+
+/**
+ * @brief start flusher, capture begins at partition start
+ * @return HAL_FAILED if no pool buffer
+ * @api
+ */
+bool mtdcaptureStart(MTDCapture *cap, const MTDCaptureConfig *cfg)
+{
+	osalDbgCheck((cap != NULL) && (cfg != NULL) && (cfg->mtdp != NULL));
+	osalDbgAssert(cap->thread == NULL, "already started");
+
+	cap->config = cfg;
+	cap->batch_size = MTD_POOL_ERASE_SIZE;
+	cap->batch_is_block = true;
+	cap->batch = mtdPoolAllocBlock();
+	if (cap->batch == NULL) {
+		cap->batch_size = MTD_POOL_PAGE_SIZE;
+		cap->batch_is_block = false;
+		cap->batch = mtdPoolAllocPage();
+	}
+	if (cap->batch == NULL)
+		return HAL_FAILED;
+
+	/* whole records only */
+	cap->batch_size -= cap->batch_size % MTDCAPTURE_RECORD_SIZE;
+	cap->batch_len = 0;
+	cap->write_pos = 0;
+	cap->sync_req = false;
+	cap->stop_req = false;
+	cap->thread = chThdCreateStatic(cap->wa, sizeof(cap->wa), cfg->prio,
+			mtdcapture_thd, cap);
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief drain everything and stop flusher
+ * @api
+ */
+void mtdcaptureStop(MTDCapture *cap)
+{
+	osalDbgCheck(cap != NULL);
+
+	if (cap->thread == NULL)
+		return;
+
+	cap->stop_req = true;
+	chBSemSignal(&cap->wakeup);
+	chThdWait(cap->thread);
+	cap->thread = NULL;
+
+	if (cap->batch_is_block)
+		mtdPoolFreeBlock(cap->batch);
+	else
+		mtdPoolFreePage(cap->batch);
+	cap->batch = NULL;
+}
+
+/**
+ * @brief push record, shorter records are zero padded
+ * Lock-free, callable from ISR or thread.
+ * @return false if ring is full (record dropped)
+ * @xclass
+ */
+bool mtdcapturePush(MTDCapture *cap, const void *rec, size_t len)
+{
+	uint32_t pos = __atomic_load_n(&cap->enqueue_pos, __ATOMIC_RELAXED);
+	struct mtdcapture_slot *slot;
+	uint32_t fill;
+
+	osalDbgCheck(len <= MTDCAPTURE_RECORD_SIZE);
+
+	for (;;) {
+		int32_t dif;
+
+		slot = &cap->ring[pos & RING_MASK];
+		dif = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&cap->enqueue_pos, &pos, pos + 1,
+						true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0) {
+			__atomic_fetch_add(&cap->stats.dropped, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+		else {
+			pos = __atomic_load_n(&cap->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+
+	memcpy(slot->data, rec, len);
+	memset(slot->data + len, 0, MTDCAPTURE_RECORD_SIZE - len);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	__atomic_fetch_add(&cap->stats.pushed, 1, __ATOMIC_RELAXED);
+	fill = pos + 1 - cap->dequeue_pos;
+	if (fill > cap->stats.max_fill)
+		cap->stats.max_fill = fill; /* statistics only */
+
+	/* flush now, do not wait for flush_interval */
+	if (fill >= MTDCAPTURE_RING_SIZE / 2) {
+		syssts_t sts = chSysGetStatusAndLockX();
+
+		chBSemSignalI(&cap->wakeup);
+		chSysRestoreStatusX(sts);
+	}
+
+	return true;
+}
+
+/**
+ * @brief records waiting in ring
+ * @xclass
+ */
+uint32_t mtdcaptureGetFill(MTDCapture *cap)
+{
+	return __atomic_load_n(&cap->enqueue_pos, __ATOMIC_RELAXED) - cap->dequeue_pos;
+}
+
+/**
+ * @brief wait until pushed records are programmed, partial page included
+ * @api
+ */
+void mtdcaptureSync(MTDCapture *cap)
+{
+	osalDbgCheck(cap != NULL);
+	osalDbgAssert(cap->thread != NULL, "not started");
+
+	cap->sync_req = true;
+	chBSemSignal(&cap->wakeup);
+	chBSemWait(&cap->synced);
+}
@@ -0,0 +1,101 @@
+/**
+ * @file       mtdcapture.h
+ * @brief      FLASH25 ISR-safe event capture to partition
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDCAPTURE_H
+#define MTDCAPTURE_H
+
+#include "flash-mtd.h"
+
+#if !defined(MTDCAPTURE_RECORD_SIZE)
+#define MTDCAPTURE_RECORD_SIZE	16
+#endif
+
+#if !defined(MTDCAPTURE_RING_SIZE)
+/* records, power of two */
+#define MTDCAPTURE_RING_SIZE	256
+#endif
+
+#if !defined(MTDCAPTURE_WA_SIZE)
+#define MTDCAPTURE_WA_SIZE	512
+#endif
+
+#if (MTDCAPTURE_RING_SIZE & (MTDCAPTURE_RING_SIZE - 1)) != 0
+#error "MTDCAPTURE_RING_SIZE must be power of two"
+#endif
+
+typedef struct {
+	BaseMTDDriver *mtdp;
+	systime_t flush_interval;	/**< flusher poll period */
+	tprio_t prio;			/**< flusher priority */
+} MTDCaptureConfig;
+
+struct mtdcapture_slot {
+	volatile uint32_t seq;
+	uint8_t data[MTDCAPTURE_RECORD_SIZE];
+};
+
+struct mtdcapture_stats {
+	uint32_t pushed;
+	uint32_t dropped;	/**< ring full */
+	uint32_t written;	/**< records programmed */
+	uint32_t lost;		/**< records lost on flash errors */
+	uint32_t max_fill;	/**< ring high watermark */
+};
+
+typedef struct {
+	const MTDCaptureConfig *config;
+	volatile uint32_t enqueue_pos;
+	uint32_t dequeue_pos;
+	struct mtdcapture_slot ring[MTDCAPTURE_RING_SIZE];
+
+	uint8_t *batch;		/**< pool block (or page) */
+	bool batch_is_block;	/**< batch is pool erase block */
+	uint32_t batch_size;
+	uint32_t batch_len;
+	uint32_t write_pos;	/**< byte in partition */
+
+	volatile bool sync_req;
+	volatile bool stop_req;
+	binary_semaphore_t synced;
+	binary_semaphore_t wakeup;	/**< flusher wakeup */
+	thread_t *thread;
+	struct mtdcapture_stats stats;
+	THD_WORKING_AREA(wa, MTDCAPTURE_WA_SIZE);
+} MTDCapture;
+
+#define mtdcaptureGetStats(cap)	(&(cap)->stats)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	void mtdcaptureObjectInit(MTDCapture *cap);
+	bool mtdcaptureStart(MTDCapture *cap, const MTDCaptureConfig *config);
+	void mtdcaptureStop(MTDCapture *cap);
+	bool mtdcapturePush(MTDCapture *cap, const void *rec, size_t len);
+	uint32_t mtdcaptureGetFill(MTDCapture *cap);
+	void mtdcaptureSync(MTDCapture *cap);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDCAPTURE_H */
@@ -0,0 +1,782 @@
+/**
+ * @file       mtdclog.c
+ * @brief      FLASH25 compressed log over partition
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Appended data is cut into chunks of MTDCLOG_CHUNK_SIZE bytes, each chunk
+ * is compressed and packed into erase blocks:
+ *
+ *   block: [block hdr: magic, seq, first logical offset] [chunk] [chunk] ...
+ *   chunk: [chunk hdr: magic, codec, clen, rlen, crc16] [clen bytes payload]
+ *
+ * Chunks never cross erase blocks. Block headers are the index: a read
+ * binary searches blocks by first logical offset, then walks chunk headers
+ * of that block. When the partition is full the oldest block is erased.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "mtdclog.h"
+
+#define CLOG_MAGIC		0x474f4c43UL	/* "CLOG" */
+#define CHUNK_MAGIC		0xc5
+
+/* LZ4 block format limits */
+#define LZ_MINMATCH		4
+#define LZ_MFLIMIT		12
+#define LZ_LASTLITERALS		5
+#define LZ_HASH_BITS		7
+#define LZ_HASH_SIZE		(1 << LZ_HASH_BITS)
+
+#if MTD_POOL_PAGE_SIZE < LZ_HASH_SIZE * 2
+#error "pool page too small for LZ hash table"
+#endif
+
+struct clog_block_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t first_off;
+	uint16_t crc;
+	uint16_t reserved;
+};
+
+struct clog_chunk_hdr {
+	uint8_t magic;
+	uint8_t codec;
+	uint16_t clen;
+	uint16_t rlen;
+	uint16_t crc;
+};
+
+#define clog_mtd(clp)		((clp)->config->mtdp)
+#define clog_es(clp)		mtdGetEraseSize(clog_mtd(clp))
+#define clog_block_end(clp)	(((clp)->head_blk + 1) * clog_es(clp))
+
+/*
+ * Codecs
+ */
+
+static uint32_t clog_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @brief emit LZ4 length extension bytes
+ * @notapi
+ */
+static uint8_t *clog_lz_putlen(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * @brief emit LZ4 sequence, match with mlen == 0 is last literals
+ * @return NULL if output does not fit
+ * @notapi
+ */
+static uint8_t *clog_lz_emit(uint8_t *op, const uint8_t *oend,
+		const uint8_t *lit, size_t nlit, uint16_t offset, size_t mlen)
+{
+	size_t need = 1 + nlit + nlit / 255 + 1 + ((mlen)? 2 + mlen / 255 + 1 : 0);
+	uint8_t *token = op++;
+
+	if (need > (size_t)(oend - token))
+		return NULL;
+
+	*token = ((nlit >= 15)? 15 : nlit) << 4;
+	if (nlit >= 15)
+		op = clog_lz_putlen(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (mlen == 0)
+		return op;
+
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	mlen -= LZ_MINMATCH;
+	*token |= (mlen >= 15)? 15 : mlen;
+	if (mlen >= 15)
+		op = clog_lz_putlen(op, mlen - 15);
+
+	return op;
+}
+
+/**
+ * @brief greedy LZ4 block compressor
+ * @return compressed size, 0 if it does not fit @p cap
+ * @notapi
+ */
+static size_t clog_lz_encode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap,
+		uint16_t *table)
+{
+	const uint8_t *ip = src, *anchor = src, *end = src + n;
+	const uint8_t *mflimit = (n > LZ_MFLIMIT)? end - LZ_MFLIMIT : src;
+	uint8_t *op = dst;
+
+	memset(table, 0, LZ_HASH_SIZE * sizeof(uint16_t));
+	while (ip < mflimit) {
+		uint32_t seq = clog_get32(ip);
+		uint32_t h = (uint32_t)(seq * 2654435761UL) >> (32 - LZ_HASH_BITS);
+		uint16_t ref = table[h];
+		const uint8_t *match = src + ref - 1;
+		size_t mlen = LZ_MINMATCH;
+
+		/* table holds position + 1, 0 - empty */
+		table[h] = ip - src + 1;
+		if (ref == 0 || clog_get32(match) != seq) {
+			ip++;
+			continue;
+		}
+
+		while (ip + mlen < end - LZ_LASTLITERALS && ip[mlen] == match[mlen])
+			mlen++;
+
+		op = clog_lz_emit(op, dst + cap, anchor, ip - anchor, ip - match, mlen);
+		if (op == NULL)
+			return 0;
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	op = clog_lz_emit(op, dst + cap, anchor, end - anchor, 0, 0);
+	return (op != NULL)? (size_t)(op - dst) : 0;
+}
+
+/**
+ * @brief LZ4 block decompressor
+ * @return decompressed size, 0 on malformed input
+ * @notapi
+ */
+static size_t clog_lz_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = src + n;
+	uint8_t *op = dst, *oend = dst + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t len = token >> 4;
+		uint16_t offset;
+		const uint8_t *match;
+		uint8_t b;
+
+		if (len == 15)
+			do {
+				if (ip >= iend)
+					return 0;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return 0;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip == iend)
+			break; /* last literals */
+
+		if (iend - ip < 2)
+			return 0;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - dst)
+			return 0;
+
+		len = token & 15;
+		if (len == 15)
+			do {
+				if (ip >= iend)
+					return 0;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+
+		len += LZ_MINMATCH;
+		if (len > (size_t)(oend - op))
+			return 0;
+		for (match = op - offset; len > 0; len--)
+			*op++ = *match++;
+	}
+
+	return op - dst;
+}
+
+/**
+ * @brief zigzag delta + varint encoder for @p width byte LE samples
+ * Trailing bytes which do not form sample are stored as is.
+ * @return encoded size, 0 if it does not fit @p cap
+ * @notapi
+ */
+static size_t clog_delta_encode(const uint8_t *src, size_t n, uint8_t *dst, size_t cap,
+		unsigned width)
+{
+	size_t body = n - n % width;
+	size_t i, o = 0;
+	uint32_t prev = 0;
+
+	for (i = 0; i < body; i += width) {
+		uint32_t v = (width == 2)?
+			(uint32_t)(int16_t)(src[i] | (src[i + 1] << 8)) : clog_get32(src + i);
+		int32_t d = v - prev;
+		uint32_t zz = ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+
+		prev = v;
+		do {
+			if (o >= cap)
+				return 0;
+			dst[o] = zz & 0x7f;
+			zz >>= 7;
+			dst[o++] |= (zz)? 0x80 : 0;
+		} while (zz);
+	}
+
+	if (o + (n - body) > cap)
+		return 0;
+	memcpy(dst + o, src + body, n - body);
+	return o + (n - body);
+}
+
+/**
+ * @brief zigzag delta + varint decoder
+ * @return @p rlen, 0 on malformed input
+ * @notapi
+ */
+static size_t clog_delta_decode(const uint8_t *src, size_t n, uint8_t *dst, size_t rlen,
+		unsigned width)
+{
+	size_t body = rlen - rlen % width;
+	size_t i = 0, o, k;
+	uint32_t prev = 0;
+
+	for (o = 0; o < body; o += width) {
+		uint32_t zz = 0;
+		unsigned shift = 0;
+		uint8_t b;
+
+		do {
+			if (i >= n || shift > 28)
+				return 0;
+			b = src[i++];
+			zz |= (uint32_t)(b & 0x7f) << shift;
+			shift += 7;
+		} while (b & 0x80);
+
+		prev += (zz >> 1) ^ -(zz & 1);
+		for (k = 0; k < width; k++)
+			dst[o + k] = prev >> (8 * k);
+	}
+
+	if (n - i != rlen - body)
+		return 0;
+	memcpy(dst + body, src + i, rlen - body);
+	return rlen;
+}
+
+/**
+ * @brief compress chunk
+ * @return payload size, 0 if codec gives no gain
+ * @notapi
+ */
+static size_t clog_encode(mtdclog_codec_t codec, const uint8_t *src, size_t n,
+		uint8_t *dst)
+{
+	uint8_t *table;
+	size_t clen = 0;
+
+	switch (codec) {
+	case MTDCLOG_CODEC_LZ:
+		table = mtdPoolAllocPage();
+		if (table == NULL)
+			break;
+		clen = clog_lz_encode(src, n, dst, n - 1, (uint16_t *)table);
+		mtdPoolFreePage(table);
+		break;
+	case MTDCLOG_CODEC_DELTA16:
+		clen = clog_delta_encode(src, n, dst, n - 1, 2);
+		break;
+	case MTDCLOG_CODEC_DELTA32:
+		clen = clog_delta_encode(src, n, dst, n - 1, 4);
+		break;
+	default:
+		break;
+	}
+
+	return clen;
+}
+
+/**
+ * @brief decompress chunk
+ * @return HAL_FAILED if payload malformed
+ * @notapi
+ */
+static bool clog_decode(uint8_t codec, const uint8_t *src, size_t clen,
+		uint8_t *dst, size_t rlen)
+{
+	size_t len = 0;
+
+	switch (codec) {
+	case MTDCLOG_CODEC_RAW:
+		if (clen == rlen)
+			memcpy(dst, src, (len = rlen));
+		break;
+	case MTDCLOG_CODEC_LZ:
+		len = clog_lz_decode(src, clen, dst, rlen);
+		break;
+	case MTDCLOG_CODEC_DELTA16:
+		len = clog_delta_decode(src, clen, dst, rlen, 2);
+		break;
+	case MTDCLOG_CODEC_DELTA32:
+		len = clog_delta_decode(src, clen, dst, rlen, 4);
+		break;
+	}
+
+	return (len == rlen)? HAL_SUCCESS : HAL_FAILED;
+}
+
+/*
+ * On-flash structures
+ */
+
+/**
+ * @brief read block header
+ * @return HAL_FAILED if header is not valid
+ * @notapi
+ */
+static bool clog_read_block_hdr(MTDCLog *clp, uint32_t blk, struct clog_block_hdr *hdr)
+{
+	if (mtdReadBytes(clog_mtd(clp), blk * clog_es(clp), (uint8_t *)hdr, sizeof(*hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (hdr->magic != CLOG_MAGIC ||
+			hdr->crc != mtdCrc16(0xffff, (uint8_t *)hdr, offsetof(struct clog_block_hdr, crc)))
+		return HAL_FAILED;
+
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief read chunk header and payload (into @p payload, pool page)
+ * @return HAL_FAILED if chunk is not valid
+ * @notapi
+ */
+static bool clog_read_chunk(MTDCLog *clp, uint32_t pos, struct clog_chunk_hdr *hdr,
+		uint8_t *payload)
+{
+	if (mtdReadBytes(clog_mtd(clp), pos, (uint8_t *)hdr, sizeof(*hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (hdr->magic != CHUNK_MAGIC || hdr->clen > MTDCLOG_CHUNK_SIZE ||
+			hdr->rlen > MTDCLOG_CHUNK_SIZE ||
+			pos + sizeof(*hdr) + hdr->clen > (pos / clog_es(clp) + 1) * clog_es(clp))
+		return HAL_FAILED;
+
+	if (payload == NULL)
+		return HAL_SUCCESS;
+
+	if (mtdReadBytes(clog_mtd(clp), pos + sizeof(*hdr), payload, hdr->clen) == HAL_FAILED)
+		return HAL_FAILED;
+
+	return (hdr->crc == mtdCrc16(0xffff, payload, hdr->clen))? HAL_SUCCESS : HAL_FAILED;
+}
+
+/**
+ * @brief check that chunk header area is not programmed
+ * @notapi
+ */
+static bool clog_hdr_is_free(const struct clog_chunk_hdr *hdr)
+{
+	const uint8_t *p = (const uint8_t *)hdr;
+	size_t i;
+
+	for (i = 0; i < sizeof(*hdr); i++)
+		if (p[i] != 0xff)
+			return false;
+
+	return true;
+}
+
+/**
+ * @brief erase next block and write its header
+ * Oldest block is dropped when partition is full.
+ * @notapi
+ */
+static bool clog_open_block(MTDCLog *clp)
+{
+	BaseMTDDriver *mtdp = clog_mtd(clp);
+	struct clog_block_hdr hdr;
+	uint32_t blk = 0;
+	uint32_t pages = clog_es(clp) / mtdGetPageSize(mtdp);
+
+	if (clp->seq != 0) {
+		blk = (clp->head_blk + 1) % clp->nr_blocks;
+		if (blk == clp->tail_blk) {
+			clp->tail_blk = (clp->tail_blk + 1) % clp->nr_blocks;
+			if (clog_read_block_hdr(clp, clp->tail_blk, &hdr) == HAL_SUCCESS)
+				clp->start_off = hdr.first_off;
+			else
+				clp->start_off = clp->end_off;
+
+			if (clp->rcache_off < clp->start_off)
+				clp->rcache_len = 0;
+		}
+	}
+
+	clp->write_pos = 0;
+	if (mtdErase(mtdp, blk * pages, pages) == HAL_FAILED)
+		return HAL_FAILED;
+
+	hdr.magic = CLOG_MAGIC;
+	hdr.seq = clp->seq + 1;
+	hdr.first_off = clp->end_off;
+	hdr.crc = mtdCrc16(0xffff, (uint8_t *)&hdr, offsetof(struct clog_block_hdr, crc));
+	hdr.reserved = 0xffff;
+	if (mtdWriteBytes(mtdp, blk * clog_es(clp), (uint8_t *)&hdr, sizeof(hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (clp->seq == 0)
+		clp->tail_blk = blk;
+	clp->head_blk = blk;
+	clp->seq = hdr.seq;
+	clp->write_pos = blk * clog_es(clp) + sizeof(hdr);
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief find head and tail blocks and write position
+ * @notapi
+ */
+static bool clog_mount(MTDCLog *clp)
+{
+	struct clog_block_hdr hdr;
+	struct clog_chunk_hdr chdr;
+	uint32_t blk, min_seq = 0, pos;
+	uint8_t *payload;
+
+	clp->seq = 0;
+	clp->write_pos = 0;
+	clp->start_off = 0;
+	clp->end_off = 0;
+	clp->raw_len = 0;
+	clp->rcache_len = 0;
+
+	for (blk = 0; blk < clp->nr_blocks; blk++) {
+		if (clog_read_block_hdr(clp, blk, &hdr) == HAL_FAILED)
+			continue;
+
+		if (clp->seq == 0 || hdr.seq > clp->seq) {
+			clp->seq = hdr.seq;
+			clp->head_blk = blk;
+			clp->end_off = hdr.first_off;
+		}
+		if (min_seq == 0 || hdr.seq < min_seq) {
+			min_seq = hdr.seq;
+			clp->tail_blk = blk;
+			clp->start_off = hdr.first_off;
+		}
+	}
+
+	if (clp->seq == 0)
+		return HAL_SUCCESS; /* empty log */
+
+	payload = mtdPoolAllocPage();
+	if (payload == NULL)
+		return HAL_FAILED;
+
+	/* find end of head block, torn chunk closes the block */
+	for (pos = clp->head_blk * clog_es(clp) + sizeof(hdr);
+			pos + sizeof(chdr) <= clog_block_end(clp);
+			pos += sizeof(chdr) + chdr.clen) {
+		if (clog_read_chunk(clp, pos, &chdr, payload) == HAL_FAILED) {
+			if (!clog_hdr_is_free(&chdr))
+				pos = 0;
+			break;
+		}
+
+		clp->end_off += chdr.rlen;
+	}
+
+	mtdPoolFreePage(payload);
+	clp->write_pos = (pos + sizeof(chdr) <= clog_block_end(clp))? pos : 0;
+	MTD_INFO("clog: %s: [%" PRIu32 "..%" PRIu32 "), head %" PRIu32 ", tail %" PRIu32,
+			mtdGetName(clog_mtd(clp)), clp->start_off, clp->end_off,
+			clp->head_blk, clp->tail_blk);
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief decode chunk containing logical @p offset into read cache
+ * @notapi
+ */
+static bool clog_load_chunk(MTDCLog *clp, uint32_t offset)
+{
+	struct clog_block_hdr hdr;
+	struct clog_chunk_hdr chdr;
+	uint32_t count = (clp->head_blk + clp->nr_blocks - clp->tail_blk) % clp->nr_blocks + 1;
+	uint32_t lo = 0, hi = count - 1, blk, pos, end, cur;
+	uint8_t *payload;
+	bool ret = HAL_FAILED;
+
+	/* last block with first_off <= offset */
+	while (lo < hi) {
+		uint32_t mid = (lo + hi + 1) / 2;
+
+		if (clog_read_block_hdr(clp, (clp->tail_blk + mid) % clp->nr_blocks, &hdr) == HAL_FAILED)
+			return HAL_FAILED;
+
+		if (hdr.first_off <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	blk = (clp->tail_blk + lo) % clp->nr_blocks;
+	if (clog_read_block_hdr(clp, blk, &hdr) == HAL_FAILED)
+		return HAL_FAILED;
+
+	payload = mtdPoolAllocPage();
+	if (payload == NULL)
+		return HAL_FAILED;
+
+	cur = hdr.first_off;
+	end = (blk + 1) * clog_es(clp);
+	for (pos = blk * clog_es(clp) + sizeof(hdr); pos + sizeof(chdr) <= end;
+			pos += sizeof(chdr) + chdr.clen) {
+		bool hit;
+
+		if (clog_read_chunk(clp, pos, &chdr, NULL) == HAL_FAILED)
+			break;
+
+		hit = (offset < cur + chdr.rlen);
+		if (hit) {
+			if (clog_read_chunk(clp, pos, &chdr, payload) == HAL_SUCCESS &&
+					clog_decode(chdr.codec, payload, chdr.clen,
+						clp->rcache, chdr.rlen) == HAL_SUCCESS) {
+				clp->rcache_off = cur;
+				clp->rcache_len = chdr.rlen;
+				ret = HAL_SUCCESS;
+			}
+			break;
+		}
+
+		cur += chdr.rlen;
+	}
+
+	mtdPoolFreePage(payload);
+	if (ret == HAL_FAILED)
+		MTD_DEBUG("clog: %s: chunk at %" PRIu32 " not readable", mtdGetName(clog_mtd(clp)), offset);
+	return ret;
+}
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief Initializes an instance.
+ *
+ * @init
+ */
+void mtdclogObjectInit(MTDCLog *clp)
+{
+	osalDbgCheck(clp != NULL);
+
+	memset(clp, 0, sizeof(*clp));
+}
+
+/**
+ * @brief mount log on partition
+ * Partition should be formatted by mtdclogFormat() first time.
+ * @api
+ */
+bool mtdclogStart(MTDCLog *clp, const MTDCLogConfig *cfg)
+{
+	osalDbgCheck((clp != NULL) && (cfg != NULL) && (cfg->mtdp != NULL));
+
+	clp->config = cfg;
+	clp->nr_blocks = mtdGetSize(cfg->mtdp) / mtdGetEraseSize(cfg->mtdp);
+	osalDbgAssert(clp->nr_blocks >= 2, "partition too small");
+	osalDbgAssert(mtdGetEraseSize(cfg->mtdp) >= 2 * (MTDCLOG_CHUNK_SIZE + sizeof(struct clog_chunk_hdr)),
+			"erase block too small");
+
+	return clog_mount(clp);
+}
+
+/**
+ * @brief erase partition and reset log
+ * @api
+ */
+bool mtdclogFormat(MTDCLog *clp)
+{
+	BaseMTDDriver *mtdp = clog_mtd(clp);
+
+	osalDbgCheck(clp != NULL);
+
+	if (mtdErase(mtdp, 0, mtdp->nr_pages) == HAL_FAILED)
+		return HAL_FAILED;
+
+	clp->raw_bytes = 0;
+	clp->stored_bytes = 0;
+	return clog_mount(clp);
+}
+
+/**
+ * @brief compress and program buffered data
+ * @api
+ */
+bool mtdclogFlush(MTDCLog *clp)
+{
+	BaseMTDDriver *mtdp = clog_mtd(clp);
+	struct clog_chunk_hdr chdr;
+	const uint8_t *payload = clp->raw;
+	uint8_t *cbuf;
+	size_t clen;
+	bool ret;
+
+	osalDbgCheck(clp != NULL);
+
+	if (clp->raw_len == 0)
+		return HAL_SUCCESS;
+
+	cbuf = mtdPoolAllocPage();
+	if (cbuf == NULL)
+		return HAL_FAILED;
+
+	chdr.codec = clp->config->codec;
+	clen = clog_encode(chdr.codec, clp->raw, clp->raw_len, cbuf);
+	if (clen == 0) {
+		chdr.codec = MTDCLOG_CODEC_RAW;
+		clen = clp->raw_len;
+	}
+	else {
+		payload = cbuf;
+	}
+
+	chdr.magic = CHUNK_MAGIC;
+	chdr.clen = clen;
+	chdr.rlen = clp->raw_len;
+	chdr.crc = mtdCrc16(0xffff, payload, clen);
+
+	ret = HAL_SUCCESS;
+	if (clp->write_pos == 0 || clp->write_pos + sizeof(chdr) + clen > clog_block_end(clp))
+		ret = clog_open_block(clp);
+
+	if (ret == HAL_SUCCESS)
+		ret = mtdWriteBytes(mtdp, clp->write_pos, (uint8_t *)&chdr, sizeof(chdr));
+	if (ret == HAL_SUCCESS)
+		ret = mtdWriteBytes(mtdp, clp->write_pos + sizeof(chdr), payload, clen);
+
+	mtdPoolFreePage(cbuf);
+	if (ret == HAL_FAILED) {
+		/* do not append after damaged chunk, data stays buffered */
+		clp->write_pos = 0;
+		return HAL_FAILED;
+	}
+
+	clp->write_pos += sizeof(chdr) + clen;
+	clp->end_off += clp->raw_len;
+	clp->raw_bytes += clp->raw_len;
+	clp->stored_bytes += sizeof(chdr) + clen;
+	clp->raw_len = 0;
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief append data, full chunks are flushed
+ * @return number of bytes accepted; when a flush fails, bytes up to the
+ *         chunk which failed (rest stays for the caller to retry)
+ * @api
+ */
+size_t mtdclogWrite(MTDCLog *clp, const uint8_t *data, size_t n)
+{
+	size_t done = 0;
+
+	osalDbgCheck(clp != NULL);
+
+	while (done < n) {
+		size_t len = MTDCLOG_CHUNK_SIZE - clp->raw_len;
+
+		if (len > n - done)
+			len = n - done;
+
+		memcpy(clp->raw + clp->raw_len, data + done, len);
+		clp->raw_len += len;
+		done += len;
+
+		if (clp->raw_len == MTDCLOG_CHUNK_SIZE &&
+				mtdclogFlush(clp) == HAL_FAILED) {
+			/* bytes of this call are not accepted, caller passes them again */
+			clp->raw_len -= len;
+			return done - len;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * @brief read data at logical @p offset
+ * Offsets before mtdclogGetStart() are lost (erased on wrap).
+ * @return number of bytes read
+ * @api
+ */
+size_t mtdclogRead(MTDCLog *clp, uint32_t offset, uint8_t *buf, size_t n)
+{
+	size_t done = 0;
+
+	osalDbgCheck(clp != NULL);
+
+	if (offset < clp->start_off)
+		return 0;
+
+	while (done < n) {
+		const uint8_t *src;
+		size_t avail;
+
+		if (clp->rcache_len > 0 && offset >= clp->rcache_off &&
+				offset < clp->rcache_off + clp->rcache_len) {
+			src = clp->rcache + (offset - clp->rcache_off);
+			avail = clp->rcache_off + clp->rcache_len - offset;
+		}
+		else if (offset >= clp->end_off) {
+			if (offset - clp->end_off >= clp->raw_len)
+				break;
+			src = clp->raw + (offset - clp->end_off);
+			avail = clp->raw_len - (offset - clp->end_off);
+		}
+		else if (clog_load_chunk(clp, offset) == HAL_FAILED) {
+			break;
+		}
+		else {
+			continue;
+		}
+
+		if (avail > n - done)
+			avail = n - done;
+		memcpy(buf + done, src, avail);
+		done += avail;
+		offset += avail;
+	}
+
+	return done;
+}
@@ -0,0 +1,84 @@
+/**
+ * @file       mtdclog.h
+ * @brief      FLASH25 compressed log over partition
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDCLOG_H
+#define MTDCLOG_H
+
+#include "flash-mtd.h"
+
+#if !defined(MTDCLOG_CHUNK_SIZE)
+/* uncompressed bytes per chunk, compression unit */
+#define MTDCLOG_CHUNK_SIZE	256
+#endif
+
+#if MTDCLOG_CHUNK_SIZE > MTD_POOL_PAGE_SIZE
+#error "MTDCLOG_CHUNK_SIZE must fit pool page"
+#endif
+
+typedef enum {
+	MTDCLOG_CODEC_RAW = 0,	/**< stored, used when codec does not gain */
+	MTDCLOG_CODEC_LZ,	/**< LZ4 block format */
+	MTDCLOG_CODEC_DELTA16,	/**< int16 LE samples: zigzag delta + varint */
+	MTDCLOG_CODEC_DELTA32	/**< int32 LE samples: zigzag delta + varint */
+} mtdclog_codec_t;
+
+typedef struct {
+	BaseMTDDriver *mtdp;
+	mtdclog_codec_t codec;
+} MTDCLogConfig;
+
+typedef struct {
+	const MTDCLogConfig *config;
+	uint32_t nr_blocks;
+	uint32_t seq;		/**< head block sequence */
+	uint32_t head_blk;
+	uint32_t tail_blk;
+	uint32_t write_pos;	/**< byte position in partition, 0 - block must be opened */
+	uint32_t start_off;	/**< oldest logical offset still stored */
+	uint32_t end_off;	/**< logical offset after last flushed chunk */
+	uint64_t raw_bytes;	/**< statistics: bytes flushed */
+	uint64_t stored_bytes;	/**< statistics: bytes programmed, headers included */
+	uint32_t rcache_off;
+	uint16_t rcache_len;
+	uint16_t raw_len;
+	uint8_t rcache[MTDCLOG_CHUNK_SIZE];
+	uint8_t raw[MTDCLOG_CHUNK_SIZE];
+} MTDCLog;
+
+#define mtdclogGetStart(clp)	((clp)->start_off)
+#define mtdclogGetEnd(clp)	((clp)->end_off + (clp)->raw_len)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	void mtdclogObjectInit(MTDCLog *clp);
+	bool mtdclogStart(MTDCLog *clp, const MTDCLogConfig *config);
+	bool mtdclogFormat(MTDCLog *clp);
+	size_t mtdclogWrite(MTDCLog *clp, const uint8_t *data, size_t n);
+	bool mtdclogFlush(MTDCLog *clp);
+	size_t mtdclogRead(MTDCLog *clp, uint32_t offset, uint8_t *buf, size_t n);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDCLOG_H */
@@ -0,0 +1,515 @@
+/**
+ * @file       mtdconcat.c
+ * @brief      FLASH25 concatenation/striping MTD driver
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Presents several MTD devices as one. Requests spanning several devices
+ * are issued in parallel, one worker thread per member device.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "mtdconcat.h"
+
+/* job operations */
+#define JOB_READ		0
+#define JOB_WRITE		1
+#define JOB_ERASE		2
+#define JOB_CHIP_ERASE		3
+#define JOB_EXIT		4
+
+/*
+ * Address mapping
+ */
+
+/**
+ * @brief get composite root of partition
+ * @notapi
+ */
+static MTDConcatDriver *mtdconcat_root(BaseMTDDriver *inst)
+{
+	return (inst->parent != NULL)? inst->parent : (MTDConcatDriver *)inst;
+}
+
+/**
+ * @brief map composite page to member device
+ * @param[out] idx member index
+ * @param[out] dpage page on member device
+ * @return number of pages contiguous on that device starting from @p page
+ * @notapi
+ */
+static uint32_t mtdconcat_map(MTDConcatDriver *catp, uint32_t page,
+		uint8_t *idx, uint32_t *dpage)
+{
+	const MTDConcatConfig *cfg = catp->config;
+
+	if (cfg->mode == MTDCONCAT_STRIPE) {
+		uint32_t unit = page / catp->stripe_pages;
+		uint32_t off = page % catp->stripe_pages;
+
+		*idx = unit % cfg->nr_devices;
+		*dpage = (unit / cfg->nr_devices) * catp->stripe_pages + off;
+		return catp->stripe_pages - off;
+	}
+	else {
+		uint8_t i;
+
+		for (i = 0; i < cfg->nr_devices - 1 && page >= cfg->devices[i]->nr_pages; i++)
+			page -= cfg->devices[i]->nr_pages;
+
+		*idx = i;
+		*dpage = page;
+		return cfg->devices[i]->nr_pages - page;
+	}
+}
+
+/**
+ * @brief bitmask of member devices touched by current job
+ * @notapi
+ */
+static uint32_t mtdconcat_job_devices(MTDConcatDriver *catp)
+{
+	const struct mtdconcat_job *jp = &catp->job;
+	uint32_t page, run, end = jp->startblk + jp->n;
+	uint32_t mask = 0, all = (1UL << catp->config->nr_devices) - 1;
+	uint32_t dpage;
+	uint8_t idx;
+
+	if (jp->op == JOB_CHIP_ERASE)
+		return all;
+
+	for (page = jp->startblk; page < end && mask != all; page += run) {
+		run = mtdconcat_map(catp, page, &idx, &dpage);
+		mask |= 1UL << idx;
+	}
+
+	return mask;
+}
+
+/**
+ * @brief execute part of current job belonging to member @p me
+ * @notapi
+ */
+static bool mtdconcat_job_run(MTDConcatDriver *catp, uint8_t me)
+{
+	const struct mtdconcat_job *jp = &catp->job;
+	BaseMTDDriver *dev = catp->config->devices[me];
+	uint32_t page, run, end = jp->startblk + jp->n;
+	uint32_t dpage, off;
+	uint8_t idx;
+	bool ret = HAL_SUCCESS;
+
+	if (jp->op == JOB_CHIP_ERASE)
+		return mtdErase(dev, 0, UINT32_MAX);
+
+	for (page = jp->startblk; page < end && ret == HAL_SUCCESS; page += run) {
+		run = mtdconcat_map(catp, page, &idx, &dpage);
+		if (run > end - page)
+			run = end - page;
+		if (idx != me)
+			continue;
+
+		off = (page - jp->startblk) * catp->page_size;
+		switch (jp->op) {
+		case JOB_READ:
+			ret = blkRead(dev, dpage, jp->rbuf + off, run);
+			break;
+		case JOB_WRITE:
+			ret = blkWrite(dev, dpage, jp->wbuf + off, run);
+			break;
+		case JOB_ERASE:
+			ret = mtdErase(dev, dpage, run);
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief member device worker
+ * @notapi
+ */
+static THD_FUNCTION(mtdconcat_worker_thd, arg)
+{
+	struct mtdconcat_worker *wp = arg;
+	MTDConcatDriver *catp = wp->owner;
+
+	chRegSetThreadName("mtdconcat");
+	while (true) {
+		chBSemWait(&wp->request);
+		if (catp->job.op == JOB_EXIT)
+			break;
+
+		wp->result = mtdconcat_job_run(catp, wp->idx);
+		chBSemSignal(&wp->done);
+	}
+}
+
+/**
+ * @brief run job prepared in catp->job on all involved members
+ * Single-device jobs run in caller thread.
+ * @notapi
+ */
+static bool mtdconcat_job_submit(MTDConcatDriver *catp)
+{
+	uint32_t mask = mtdconcat_job_devices(catp);
+	uint8_t i;
+	bool ret = HAL_SUCCESS;
+
+	if ((mask & (mask - 1)) == 0) {
+		for (i = 0; (mask & (1UL << i)) == 0; i++);
+		return mtdconcat_job_run(catp, i);
+	}
+
+	for (i = 0; i < catp->config->nr_devices; i++)
+		if (mask & (1UL << i))
+			chBSemSignal(&catp->workers[i].request);
+
+	for (i = 0; i < catp->config->nr_devices; i++)
+		if (mask & (1UL << i)) {
+			chBSemWait(&catp->workers[i].done);
+			if (catp->workers[i].result == HAL_FAILED)
+				ret = HAL_FAILED;
+		}
+
+	return ret;
+}
+
+/*
+ * VMT functions
+ */
+
+/**
+ * @brief for unused fields of VMT
+ * @notapi
+ */
+static bool mtdconcat_vmt_nop(void *instance __attribute__((unused)))
+{
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief connect member devices and compute geometry
+ * @api
+ */
+static bool mtdconcat_connect(MTDConcatDriver *inst)
+{
+	const MTDConcatConfig *cfg = inst->config;
+	uint32_t min_pages = UINT32_MAX;
+	uint32_t total_pages = 0;
+	uint8_t i;
+
+	inst->state = BLK_CONNECTING;
+	for (i = 0; i < cfg->nr_devices; i++) {
+		BaseMTDDriver *dev = cfg->devices[i];
+
+		if (blkConnect(dev) == HAL_FAILED)
+			goto fail;
+
+		if (i > 0 && (dev->page_size != inst->page_size ||
+					dev->erase_size != inst->erase_size)) {
+			MTD_DEBUG("mtdconcat: %s: geometry mismatch", mtdGetName(dev));
+			goto fail;
+		}
+
+		inst->page_size = dev->page_size;
+		inst->erase_size = dev->erase_size;
+		total_pages += dev->nr_pages;
+		if (dev->nr_pages < min_pages)
+			min_pages = dev->nr_pages;
+	}
+
+	inst->stripe_pages = inst->erase_size / inst->page_size;
+	if (cfg->mode == MTDCONCAT_STRIPE)
+		inst->nr_pages = (min_pages - min_pages % inst->stripe_pages) * cfg->nr_devices;
+	else
+		inst->nr_pages = total_pages;
+
+	inst->state = BLK_ACTIVE;
+	MTD_INFO("mtdconcat: %s: %" PRIu8 " devices, %s, total %lu kB",
+			mtdGetName(inst), cfg->nr_devices,
+			(cfg->mode == MTDCONCAT_STRIPE)? "striped" : "linear",
+			mtdGetSize(inst) / 1024);
+	return HAL_SUCCESS;
+
+fail:
+	inst->state = BLK_STOP;
+	MTD_DEBUG("mtdconcat: %s: connection failed", mtdGetName(inst));
+	return HAL_FAILED;
+}
+
+/**
+ * @brief prepare and submit job
+ * @notapi
+ */
+static bool mtdconcat_io(BaseMTDDriver *inst, uint8_t op, uint32_t startblk,
+		uint8_t *rbuf, const uint8_t *wbuf, uint32_t n)
+{
+	MTDConcatDriver *catp = mtdconcat_root(inst);
+	bool ret;
+
+	osalDbgCheck(inst->state == BLK_ACTIVE);
+	if (startblk > inst->nr_pages || n > inst->nr_pages - startblk) {
+		MTD_DEBUG("mtdconcat: %s: oversize (%" PRIu32 ")", mtdGetName(inst), n);
+		return HAL_FAILED;
+	}
+
+	osalMutexLock(&catp->lock);
+	catp->job.op = op;
+	catp->job.startblk = startblk + inst->start_page;
+	catp->job.n = n;
+	catp->job.rbuf = rbuf;
+	catp->job.wbuf = wbuf;
+	ret = mtdconcat_job_submit(catp);
+	osalMutexUnlock(&catp->lock);
+
+	return ret;
+}
+
+/**
+ * @brief read blocks
+ * @api
+ */
+static bool mtdconcat_read(BaseMTDDriver *inst, uint32_t startblk,
+		uint8_t *buffer, uint32_t n)
+{
+	return mtdconcat_io(inst, JOB_READ, startblk, buffer, NULL, n);
+}
+
+/**
+ * @brief write blocks
+ * @api
+ */
+static bool mtdconcat_write(BaseMTDDriver *inst, uint32_t startblk,
+		const uint8_t *buffer, uint32_t n)
+{
+	return mtdconcat_io(inst, JOB_WRITE, startblk, NULL, buffer, n);
+}
+
+/**
+ * @brief erase blocks
+ * If startblk is 0 and n more than capacity then erases all member chips.
+ * @api
+ */
+static bool mtdconcat_erase(BaseMTDDriver *inst, uint32_t startblk, uint32_t n)
+{
+	osalDbgCheck(inst->state == BLK_ACTIVE);
+
+	if (startblk == 0 && n >= inst->nr_pages && inst->parent == NULL)
+		return mtdconcat_io(inst, JOB_CHIP_ERASE, 0, NULL, NULL, inst->nr_pages);
+
+	/* for partition erase */
+	if (startblk < inst->nr_pages && n > inst->nr_pages - startblk)
+		n = inst->nr_pages - startblk;
+
+	osalDbgAssert((n % (inst->erase_size / inst->page_size)) == 0,
+			"invalid size");
+	return mtdconcat_io(inst, JOB_ERASE, startblk, NULL, NULL, n);
+}
+
+/**
+ * @brief sync all member devices
+ * @api
+ */
+static bool mtdconcat_sync(BaseMTDDriver *inst)
+{
+	MTDConcatDriver *catp = mtdconcat_root(inst);
+	bool ret = HAL_SUCCESS;
+	uint8_t i;
+
+	for (i = 0; i < catp->config->nr_devices; i++)
+		if (blkSync(catp->config->devices[i]) == HAL_FAILED)
+			ret = HAL_FAILED;
+
+	return ret;
+}
+
+/**
+ * @brief Get block device info (page size and noumber of pages)
+ * @api
+ */
+static bool mtdconcat_get_info(BaseMTDDriver *inst, BlockDeviceInfo *bdip)
+{
+	if (inst->state != BLK_ACTIVE)
+		return HAL_FAILED;
+
+	bdip->blk_size = inst->page_size;
+	bdip->blk_num = inst->nr_pages;
+	return HAL_SUCCESS;
+}
+
+static const struct BaseMTDDriverVMT mtdconcat_vmt = {
+	.is_inserted = mtdconcat_vmt_nop,
+	.is_protected = mtdconcat_vmt_nop,
+	.connect = (bool (*)(void*)) mtdconcat_connect,
+	.disconnect = mtdconcat_vmt_nop,
+	.read = (bool (*)(void*, uint32_t, uint8_t*, uint32_t)) mtdconcat_read,
+	.write = (bool (*)(void*, uint32_t, const uint8_t*, uint32_t)) mtdconcat_write,
+	.sync = (bool (*)(void*)) mtdconcat_sync,
+	.get_info = (bool (*)(void*, BlockDeviceInfo*)) mtdconcat_get_info,
+	.erase = (bool (*)(void*, uint32_t, uint32_t)) mtdconcat_erase
+};
+
+/* partition is plain BaseMTDDriver, connected with composite device */
+static const struct BaseMTDDriverVMT mtdconcat_part_vmt = {
+	.is_inserted = mtdconcat_vmt_nop,
+	.is_protected = mtdconcat_vmt_nop,
+	.connect = mtdconcat_vmt_nop,
+	.disconnect = mtdconcat_vmt_nop,
+	.read = (bool (*)(void*, uint32_t, uint8_t*, uint32_t)) mtdconcat_read,
+	.write = (bool (*)(void*, uint32_t, const uint8_t*, uint32_t)) mtdconcat_write,
+	.sync = (bool (*)(void*)) mtdconcat_sync,
+	.get_info = (bool (*)(void*, BlockDeviceInfo*)) mtdconcat_get_info,
+	.erase = (bool (*)(void*, uint32_t, uint32_t)) mtdconcat_erase
+};
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief Initializes an instance.
+ *
+ * @init
+ */
+void mtdconcatObjectInit(MTDConcatDriver *catp)
+{
+	uint8_t i;
+
+	osalDbgCheck(catp != NULL);
+
+	catp->vmt = &mtdconcat_vmt;
+	catp->config = NULL;
+	catp->name = "concat";
+	catp->parent = NULL;
+	catp->state = BLK_STOP;
+	catp->page_size = 0;
+	catp->erase_size = 0;
+	catp->nr_pages = 0;
+	catp->start_page = 0;
+	catp->stripe_pages = 0;
+	osalMutexObjectInit(&catp->lock);
+
+	for (i = 0; i < MTDCONCAT_MAX_DEVICES; i++) {
+		catp->workers[i].owner = catp;
+		catp->workers[i].idx = i;
+		catp->workers[i].thread = NULL;
+		chBSemObjectInit(&catp->workers[i].request, true);
+		chBSemObjectInit(&catp->workers[i].done, true);
+	}
+}
+
+/**
+ * @brief start composite device, spawns member workers
+ * Member devices must be started.
+ * @api
+ */
+void mtdconcatStart(MTDConcatDriver *catp, const MTDConcatConfig *cfg)
+{
+	uint8_t i;
+
+	osalDbgCheck((catp != NULL) && (cfg != NULL));
+	osalDbgCheck((cfg->nr_devices > 0) && (cfg->nr_devices <= MTDCONCAT_MAX_DEVICES));
+	osalDbgAssert((catp->state == BLK_STOP) || (catp->state == BLK_ACTIVE),
+			"invalid state");
+
+	catp->config = cfg;
+	for (i = 0; i < cfg->nr_devices; i++)
+		if (catp->workers[i].thread == NULL)
+			catp->workers[i].thread = chThdCreateStatic(catp->workers[i].wa,
+					sizeof(catp->workers[i].wa),
+					MTDCONCAT_WORKER_PRIO, mtdconcat_worker_thd,
+					&catp->workers[i]);
+}
+
+/**
+ * @brief stops composite device workers
+ * Member devices are not stopped.
+ * @api
+ */
+void mtdconcatStop(MTDConcatDriver *catp)
+{
+	uint8_t i;
+
+	osalDbgCheck(catp != NULL);
+	osalDbgAssert((catp->state == BLK_STOP) || (catp->state == BLK_ACTIVE),
+			"invalid state");
+
+	osalMutexLock(&catp->lock);
+	catp->job.op = JOB_EXIT;
+	for (i = 0; i < MTDCONCAT_MAX_DEVICES; i++)
+		if (catp->workers[i].thread != NULL) {
+			chBSemSignal(&catp->workers[i].request);
+			chThdWait(catp->workers[i].thread);
+			catp->workers[i].thread = NULL;
+		}
+	osalMutexUnlock(&catp->lock);
+
+	catp->state = BLK_STOP;
+}
+
+/**
+ * @brief init partition
+ * @api
+ */
+void mtdconcatInitPartition(MTDConcatDriver *catp, BaseMTDDriver *part_flp, const struct mtd_partition *part_def)
+{
+	osalDbgCheck(catp != NULL);
+	osalDbgCheck(part_flp != NULL);
+	osalDbgAssert((catp->state == BLK_ACTIVE),
+			"invalid state");
+	osalDbgAssert(part_def->start_page <= catp->nr_pages, "partition out of device");
+
+	part_flp->vmt = &mtdconcat_part_vmt;
+	part_flp->state = catp->state;
+	part_flp->page_size = catp->page_size;
+	part_flp->erase_size = catp->erase_size;
+
+	part_flp->name = part_def->name;
+	part_flp->parent = catp;
+	part_flp->start_page = part_def->start_page;
+
+	part_flp->nr_pages = part_def->nr_pages;
+	if (part_def->start_page > catp->nr_pages)
+		part_flp->nr_pages = 0;
+	else if (part_flp->nr_pages > catp->nr_pages - part_def->start_page)
+		part_flp->nr_pages = catp->nr_pages - part_def->start_page;
+
+	MTD_INFO("mtdconcat: %s/%s: [%" PRIu32 "..%" PRIu32 "] %" PRIu32 " pages, total %lu kB",
+			mtdGetName(catp), mtdGetName(part_flp),
+			part_flp->start_page,
+			part_flp->start_page + part_flp->nr_pages,
+			part_flp->nr_pages,
+			mtdGetSize(part_flp) / 1024);
+}
+
+/**
+ * @brief init partitons from table
+ * @api
+ */
+void mtdconcatInitPartitionTable(MTDConcatDriver *catp, const struct mtdconcat_partition *part_defs)
+{
+	const struct mtdconcat_partition *ptbl = NULL;
+
+	osalDbgCheck(catp != NULL);
+	osalDbgCheck(part_defs != NULL);
+
+	for (ptbl = part_defs; ptbl->partp != NULL; ptbl++)
+		mtdconcatInitPartition(catp, ptbl->partp, &(ptbl->definition));
+}
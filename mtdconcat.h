@@ -0,0 +1,109 @@
+/**
+ * @file       mtdconcat.h
+ * @brief      FLASH25 concatenation/striping MTD driver
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDCONCAT_H
+#define MTDCONCAT_H
+
+#include "flash-mtd.h"
+
+#if !defined(MTDCONCAT_MAX_DEVICES)
+#define MTDCONCAT_MAX_DEVICES		2
+#endif
+
+/*
+ * Worker stack holds the member driver call chain (sst25: read/program
+ * loop, SPI transfer, MTD_DEBUG() formatting) plus the port interrupt
+ * frame. Members stacked on other layers need more.
+ */
+#if !defined(MTDCONCAT_WORKER_WA_SIZE)
+#define MTDCONCAT_WORKER_WA_SIZE	1024
+#endif
+
+#if !defined(MTDCONCAT_WORKER_PRIO)
+#define MTDCONCAT_WORKER_PRIO		NORMALPRIO
+#endif
+
+#if MTDCONCAT_MAX_DEVICES > 32
+#error "MTDCONCAT_MAX_DEVICES too big"
+#endif
+
+typedef enum {
+	MTDCONCAT_LINEAR = 0,	/**< devices follow one another */
+	MTDCONCAT_STRIPE	/**< erase blocks interleaved between devices */
+} mtdconcat_mode_t;
+
+typedef struct {
+	BaseMTDDriver * const *devices;
+	uint8_t nr_devices;
+	mtdconcat_mode_t mode;
+} MTDConcatConfig;
+
+struct mtdconcat_job {
+	uint8_t op;
+	uint32_t startblk;
+	uint32_t n;
+	uint8_t *rbuf;
+	const uint8_t *wbuf;
+};
+
+struct mtdconcat_worker {
+	void *owner;
+	uint8_t idx;
+	bool result;
+	thread_t *thread;
+	binary_semaphore_t request;
+	binary_semaphore_t done;
+	THD_WORKING_AREA(wa, MTDCONCAT_WORKER_WA_SIZE);
+};
+
+#define _mtdconcat_driver_data						\
+	_base_mtd_driver_data						\
+	uint32_t stripe_pages;						\
+	mutex_t lock;							\
+	struct mtdconcat_job job;					\
+	struct mtdconcat_worker workers[MTDCONCAT_MAX_DEVICES];
+
+typedef struct {
+	const struct BaseMTDDriverVMT *vmt;
+	_mtdconcat_driver_data
+	const MTDConcatConfig *config;
+} MTDConcatDriver;
+
+struct mtdconcat_partition {
+	BaseMTDDriver *partp;
+	struct mtd_partition definition;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	void mtdconcatObjectInit(MTDConcatDriver *catp);
+	void mtdconcatStart(MTDConcatDriver *catp, const MTDConcatConfig *config);
+	void mtdconcatStop(MTDConcatDriver *catp);
+	void mtdconcatInitPartition(MTDConcatDriver *catp, BaseMTDDriver *part_flp, const struct mtd_partition *part_def);
+	void mtdconcatInitPartitionTable(MTDConcatDriver *catp, const struct mtdconcat_partition *part_defs);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDCONCAT_H */
@@ -0,0 +1,508 @@
+/**
+ * @file       mtdfatfs.c
+ * @brief      FLASH25 FatFS disk backend
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Presents partition as 512 byte sector disk. Sector writes are merged
+ * in one cached erase block and written back when other block is
+ * touched or on sync. Write back programs changed pages only and erases
+ * the block just when some bit has to go 0 -> 1.
+ * Trimmed (freed) blocks are remembered and erased by
+ * mtdfatfsEraseTrimmed(), e.g. from idle thread.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "mtdfatfs.h"
+
+#define SECTOR_SIZE		MTDFATFS_SECTOR_SIZE
+
+#define fat_mtd(fsp)		((fsp)->config->mtdp)
+/* sectors per erase block */
+#define fat_bps(fsp)		(mtdGetEraseSize(fat_mtd(fsp)) / SECTOR_SIZE)
+/* pages per sector */
+#define fat_pps(fsp)		(SECTOR_SIZE / mtdGetPageSize(fat_mtd(fsp)))
+
+/*
+ * Trim bitmap
+ */
+
+static bool fat_is_trimmed(MTDFatFS *fsp, uint32_t blk)
+{
+	return blk < MTDFATFS_MAX_BLOCKS && (fsp->trim[blk / 32] & (1UL << (blk % 32)));
+}
+
+static void fat_set_trimmed(MTDFatFS *fsp, uint32_t blk, bool trimmed)
+{
+	if (blk >= MTDFATFS_MAX_BLOCKS)
+		return; /* not tracked, never erased in background */
+
+	if (trimmed)
+		fsp->trim[blk / 32] |= 1UL << (blk % 32);
+	else
+		fsp->trim[blk / 32] &= ~(1UL << (blk % 32));
+}
+
+/*
+ * Block cache
+ */
+
+/**
+ * @brief compare written sectors with flash
+ * @param[out] pagesp pages which differ from flash
+ * @return true if some page needs erase
+ * @notapi
+ */
+static bool fat_need_erase(MTDFatFS *fsp, uint8_t *tmp, uint32_t *pagesp, bool *errp)
+{
+	BaseMTDDriver *mtdp = fat_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t ppb = mtdGetEraseSize(mtdp) / ps;
+	uint32_t blk_page = fsp->cache_blk * ppb;
+	uint32_t p, i;
+
+	for (p = 0; p < ppb; p++) {
+		const uint8_t *data = fsp->cache + p * ps;
+
+		if (!(fsp->written & (1UL << (p / fat_pps(fsp)))))
+			continue;
+
+		if (blkRead(mtdp, blk_page + p, tmp, 1) == HAL_FAILED) {
+			*errp = true;
+			return true;
+		}
+
+		if (memcmp(tmp, data, ps) == 0)
+			continue;
+
+		for (i = 0; i < ps; i++)
+			if ((tmp[i] & data[i]) != data[i])
+				return true;
+
+		*pagesp |= 1UL << p;
+	}
+
+	return false;
+}
+
+/**
+ * @brief write back cached block
+ * @notapi
+ */
+static bool fat_flush(MTDFatFS *fsp)
+{
+	BaseMTDDriver *mtdp = fat_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t ppb = mtdGetEraseSize(mtdp) / ps;
+	uint32_t blk_page = fsp->cache_blk * ppb;
+	uint32_t pages = 0;
+	uint32_t s, p;
+	bool trimmed = fat_is_trimmed(fsp, fsp->cache_blk);
+	bool err = false;
+	uint8_t *tmp;
+
+	if (fsp->cache_blk == MTDFATFS_NO_BLOCK || fsp->written == 0)
+		return HAL_SUCCESS;
+
+	tmp = mtdPoolAllocPage();
+	if (tmp == NULL) {
+		MTD_DEBUG("fatfs: %s: no pool page", mtdGetName(mtdp));
+		return HAL_FAILED;
+	}
+
+	/* trimmed block holds garbage, always erase */
+	if (trimmed || fat_need_erase(fsp, tmp, &pages, &err)) {
+		if (err)
+			goto fail;
+
+		/* merge sectors not written */
+		for (s = 0; s < fat_bps(fsp); s++) {
+			uint8_t *sp = fsp->cache + s * SECTOR_SIZE;
+
+			if (fsp->written & (1UL << s))
+				continue;
+			if (trimmed)
+				memset(sp, 0xff, SECTOR_SIZE);
+			else if (blkRead(mtdp, blk_page + s * fat_pps(fsp), sp, fat_pps(fsp)) == HAL_FAILED)
+				goto fail;
+		}
+
+		if (mtdErase(mtdp, blk_page, ppb) == HAL_FAILED)
+			goto fail;
+		fsp->stats.erases++;
+
+		pages = 0;
+		for (p = 0; p < ppb; p++) {
+			const uint8_t *data = fsp->cache + p * ps;
+			uint32_t i;
+
+			for (i = 0; i < ps && data[i] == 0xff; i++)
+				;
+			if (i < ps)
+				pages |= 1UL << p;
+		}
+	}
+	else {
+		fsp->stats.erases_avoided++;
+	}
+
+	/* program runs of changed pages */
+	for (p = 0; p < ppb; p++) {
+		uint32_t n;
+
+		if (!(pages & (1UL << p)))
+			continue;
+		for (n = 1; p + n < ppb && (pages & (1UL << (p + n))); n++)
+			;
+		if (blkWrite(mtdp, blk_page + p, fsp->cache + p * ps, n) == HAL_FAILED)
+			goto fail;
+		p += n - 1;
+	}
+
+	mtdPoolFreePage(tmp);
+	fat_set_trimmed(fsp, fsp->cache_blk, false);
+	fsp->written = 0;
+	fsp->stats.flushes++;
+	return HAL_SUCCESS;
+
+fail:
+	MTD_DEBUG("fatfs: %s: write back of block %" PRIu32 " failed",
+			mtdGetName(mtdp), fsp->cache_blk);
+	mtdPoolFreePage(tmp);
+	return HAL_FAILED;
+}
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief Initializes an instance.
+ *
+ * @init
+ */
+void mtdfatfsObjectInit(MTDFatFS *fsp)
+{
+	osalDbgCheck(fsp != NULL);
+
+	memset(fsp, 0, sizeof(*fsp));
+	fsp->cache_blk = MTDFATFS_NO_BLOCK;
+	osalMutexObjectInit(&fsp->lock);
+}
+
+/**
+ * @brief bind to partition, takes erase block from pool
+ * @return HAL_FAILED if no pool buffer
+ * @api
+ */
+bool mtdfatfsStart(MTDFatFS *fsp, const MTDFatFSConfig *cfg)
+{
+	BaseMTDDriver *mtdp;
+
+	osalDbgCheck((fsp != NULL) && (cfg != NULL) && (cfg->mtdp != NULL));
+	mtdp = cfg->mtdp;
+	osalDbgAssert(mtdGetEraseSize(mtdp) <= MTD_POOL_ERASE_SIZE, "pool block too small");
+	osalDbgAssert(mtdGetEraseSize(mtdp) / SECTOR_SIZE <= 32 &&
+			mtdGetEraseSize(mtdp) / mtdGetPageSize(mtdp) <= 32, "erase block too big");
+	osalDbgAssert(SECTOR_SIZE % mtdGetPageSize(mtdp) == 0, "page size");
+
+	fsp->config = cfg;
+	fsp->cache = mtdPoolAllocBlock();
+	if (fsp->cache == NULL)
+		return HAL_FAILED;
+
+	fsp->cache_blk = MTDFATFS_NO_BLOCK;
+	fsp->written = 0;
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief write back cache and release pool block
+ * @api
+ */
+void mtdfatfsStop(MTDFatFS *fsp)
+{
+	osalDbgCheck(fsp != NULL);
+
+	if (fsp->cache == NULL)
+		return;
+
+	mtdfatfsSync(fsp);
+	mtdPoolFreeBlock(fsp->cache);
+	fsp->cache = NULL;
+}
+
+/**
+ * @brief read sectors, cached block included
+ * @api
+ */
+bool mtdfatfsRead(MTDFatFS *fsp, uint32_t sector, uint8_t *buf, uint32_t n)
+{
+	BaseMTDDriver *mtdp = fat_mtd(fsp);
+	uint32_t bps = fat_bps(fsp);
+	bool ret = HAL_SUCCESS;
+
+	if (sector + n > mtdfatfsGetSectorCount(fsp))
+		return HAL_FAILED;
+
+	osalMutexLock(&fsp->lock);
+	while (n > 0 && ret == HAL_SUCCESS) {
+		uint32_t run;
+
+		if (sector / bps == fsp->cache_blk && (fsp->written & (1UL << (sector % bps)))) {
+			memcpy(buf, fsp->cache + (sector % bps) * SECTOR_SIZE, SECTOR_SIZE);
+			run = 1;
+		}
+		else {
+			/* sectors not in cache go to flash in one request */
+			for (run = 1; run < n; run++) {
+				uint32_t s = sector + run;
+
+				if (s / bps == fsp->cache_blk && (fsp->written & (1UL << (s % bps))))
+					break;
+			}
+			ret = blkRead(mtdp, sector * fat_pps(fsp), buf, run * fat_pps(fsp));
+		}
+
+		sector += run;
+		buf += run * SECTOR_SIZE;
+		n -= run;
+	}
+	osalMutexUnlock(&fsp->lock);
+
+	return ret;
+}
+
+/**
+ * @brief write sectors into block cache
+ * Switching to other erase block writes back the cached one.
+ * @api
+ */
+bool mtdfatfsWrite(MTDFatFS *fsp, uint32_t sector, const uint8_t *buf, uint32_t n)
+{
+	uint32_t bps = fat_bps(fsp);
+	bool ret = HAL_SUCCESS;
+
+	if (sector + n > mtdfatfsGetSectorCount(fsp))
+		return HAL_FAILED;
+
+	osalMutexLock(&fsp->lock);
+	for (; n > 0; n--, sector++, buf += SECTOR_SIZE) {
+		if (sector / bps != fsp->cache_blk) {
+			ret = fat_flush(fsp);
+			if (ret == HAL_FAILED)
+				break;
+			fsp->cache_blk = sector / bps;
+		}
+
+		memcpy(fsp->cache + (sector % bps) * SECTOR_SIZE, buf, SECTOR_SIZE);
+		fsp->written |= 1UL << (sector % bps);
+		fsp->stats.sector_writes++;
+	}
+	osalMutexUnlock(&fsp->lock);
+
+	return ret;
+}
+
+/**
+ * @brief write back cached block
+ * @api
+ */
+bool mtdfatfsSync(MTDFatFS *fsp)
+{
+	bool ret;
+
+	osalDbgCheck(fsp != NULL);
+
+	osalMutexLock(&fsp->lock);
+	ret = fat_flush(fsp);
+	if (ret == HAL_SUCCESS)
+		ret = blkSync(fat_mtd(fsp));
+	osalMutexUnlock(&fsp->lock);
+
+	return ret;
+}
+
+/**
+ * @brief mark sectors unused
+ * Only erase blocks covered completely are remembered for erase.
+ *
+ * @param[in] start first sector
+ * @param[in] end last sector (inclusive)
+ * @api
+ */
+void mtdfatfsTrim(MTDFatFS *fsp, uint32_t start, uint32_t end)
+{
+	uint32_t bps = fat_bps(fsp);
+	uint32_t blk;
+
+	osalDbgCheck(fsp != NULL);
+
+	if (end >= mtdfatfsGetSectorCount(fsp))
+		end = mtdfatfsGetSectorCount(fsp) - 1;
+
+	osalMutexLock(&fsp->lock);
+	for (blk = (start + bps - 1) / bps; blk < (end + 1) / bps; blk++) {
+		if (blk == fsp->cache_blk) {
+			/* freed data need not be written back */
+			fsp->written = 0;
+			fsp->cache_blk = MTDFATFS_NO_BLOCK;
+		}
+
+		if (!fat_is_trimmed(fsp, blk) && blk < MTDFATFS_MAX_BLOCKS) {
+			fat_set_trimmed(fsp, blk, true);
+			fsp->stats.trimmed++;
+		}
+	}
+	osalMutexUnlock(&fsp->lock);
+}
+
+/**
+ * @brief erase trimmed blocks
+ * Call from low priority thread, lock is dropped between blocks.
+ *
+ * @param[in] max erase at most this many blocks
+ * @return number of blocks erased
+ * @api
+ */
+uint32_t mtdfatfsEraseTrimmed(MTDFatFS *fsp, uint32_t max)
+{
+	BaseMTDDriver *mtdp = fat_mtd(fsp);
+	uint32_t ppb = mtdGetEraseSize(mtdp) / mtdGetPageSize(mtdp);
+	uint32_t nr_blocks = mtdGetSize(mtdp) / mtdGetEraseSize(mtdp);
+	uint32_t done = 0;
+	uint32_t blk;
+
+	for (blk = 0; blk < nr_blocks && blk < MTDFATFS_MAX_BLOCKS && done < max; blk++) {
+		if (fsp->trim[blk / 32] == 0) {
+			blk += 31 - blk % 32;
+			continue;
+		}
+
+		osalMutexLock(&fsp->lock);
+		if (fat_is_trimmed(fsp, blk) && mtdErase(mtdp, blk * ppb, ppb) == HAL_SUCCESS) {
+			fat_set_trimmed(fsp, blk, false);
+			fsp->stats.erases++;
+			done++;
+		}
+		osalMutexUnlock(&fsp->lock);
+	}
+
+	return done;
+}
+
+/*
+ * FatFS diskio binding
+ */
+
+#if MTDFATFS_USE_DISKIO
+#include "ff.h"
+#include "diskio.h"
+
+static MTDFatFS *mtdfatfs_drives[MTDFATFS_MAX_DRIVES];
+
+/**
+ * @brief bind FatFS physical drive number to started backend
+ * @api
+ */
+void mtdfatfsAttach(uint8_t pdrv, MTDFatFS *fsp)
+{
+	osalDbgCheck(pdrv < MTDFATFS_MAX_DRIVES);
+
+	mtdfatfs_drives[pdrv] = fsp;
+}
+
+static MTDFatFS *mtdfatfs_get(BYTE pdrv)
+{
+	if (pdrv >= MTDFATFS_MAX_DRIVES || mtdfatfs_drives[pdrv] == NULL ||
+			mtdfatfs_drives[pdrv]->cache == NULL)
+		return NULL;
+
+	return mtdfatfs_drives[pdrv];
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+	return disk_status(pdrv);
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+	return (mtdfatfs_get(pdrv) == NULL)? STA_NOINIT : 0;
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+	MTDFatFS *fsp = mtdfatfs_get(pdrv);
+
+	if (fsp == NULL)
+		return RES_NOTRDY;
+
+	return (mtdfatfsRead(fsp, sector, buff, count) == HAL_SUCCESS)? RES_OK : RES_ERROR;
+}
+
+#if _USE_WRITE
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+	MTDFatFS *fsp = mtdfatfs_get(pdrv);
+
+	if (fsp == NULL)
+		return RES_NOTRDY;
+
+	return (mtdfatfsWrite(fsp, sector, buff, count) == HAL_SUCCESS)? RES_OK : RES_ERROR;
+}
+#endif /* _USE_WRITE */
+
+#if _USE_IOCTL
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+	MTDFatFS *fsp = mtdfatfs_get(pdrv);
+
+	if (fsp == NULL)
+		return RES_NOTRDY;
+
+	switch (cmd) {
+	case CTRL_SYNC:
+		return (mtdfatfsSync(fsp) == HAL_SUCCESS)? RES_OK : RES_ERROR;
+
+	case GET_SECTOR_COUNT:
+		*((DWORD *)buff) = mtdfatfsGetSectorCount(fsp);
+		return RES_OK;
+
+	case GET_SECTOR_SIZE:
+		*((WORD *)buff) = MTDFATFS_SECTOR_SIZE;
+		return RES_OK;
+
+	case GET_BLOCK_SIZE:
+		*((DWORD *)buff) = mtdfatfsGetBlockSize(fsp);
+		return RES_OK;
+
+#if defined(CTRL_TRIM)
+	case CTRL_TRIM:
+#else
+	case CTRL_ERASE_SECTOR:
+#endif
+		mtdfatfsTrim(fsp, ((DWORD *)buff)[0], ((DWORD *)buff)[1]);
+		return RES_OK;
+
+	default:
+		return RES_PARERR;
+	}
+}
+#endif /* _USE_IOCTL */
+#endif /* MTDFATFS_USE_DISKIO */
@@ -0,0 +1,90 @@
+/**
+ * @file       mtdfatfs.h
+ * @brief      FLASH25 FatFS disk backend
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDFATFS_H
+#define MTDFATFS_H
+
+#include "flash-mtd.h"
+
+#define MTDFATFS_SECTOR_SIZE	512
+
+#if !defined(MTDFATFS_USE_DISKIO)
+/* define disk_read() and friends of FatFS diskio.h */
+#define MTDFATFS_USE_DISKIO	FALSE
+#endif
+
+#if !defined(MTDFATFS_MAX_DRIVES)
+#define MTDFATFS_MAX_DRIVES	1
+#endif
+
+#if !defined(MTDFATFS_MAX_BLOCKS)
+/* erase blocks per volume, size of trim bitmap */
+#define MTDFATFS_MAX_BLOCKS	1024
+#endif
+
+typedef struct {
+	BaseMTDDriver *mtdp;
+} MTDFatFSConfig;
+
+struct mtdfatfs_stats {
+	uint32_t sector_writes;
+	uint32_t flushes;	/**< cached blocks written back */
+	uint32_t erases;
+	uint32_t erases_avoided;	/**< flush programmed over erased bits only */
+	uint32_t trimmed;	/**< erase blocks freed by trim */
+};
+
+typedef struct {
+	const MTDFatFSConfig *config;
+	mutex_t lock;
+	uint8_t *cache;		/**< pool erase block */
+	uint32_t cache_blk;	/**< erase block in cache, MTDFATFS_NO_BLOCK if none */
+	uint32_t written;	/**< sectors of cache_blk changed (bitmap) */
+	uint32_t trim[(MTDFATFS_MAX_BLOCKS + 31) / 32];	/**< freed blocks waiting erase */
+	struct mtdfatfs_stats stats;
+} MTDFatFS;
+
+#define MTDFATFS_NO_BLOCK	0xffffffffUL
+
+#define mtdfatfsGetSectorCount(fsp)	(mtdGetSize((fsp)->config->mtdp) / MTDFATFS_SECTOR_SIZE)
+#define mtdfatfsGetBlockSize(fsp)	(mtdGetEraseSize((fsp)->config->mtdp) / MTDFATFS_SECTOR_SIZE)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	void mtdfatfsObjectInit(MTDFatFS *fsp);
+	bool mtdfatfsStart(MTDFatFS *fsp, const MTDFatFSConfig *config);
+	void mtdfatfsStop(MTDFatFS *fsp);
+	bool mtdfatfsRead(MTDFatFS *fsp, uint32_t sector, uint8_t *buf, uint32_t n);
+	bool mtdfatfsWrite(MTDFatFS *fsp, uint32_t sector, const uint8_t *buf, uint32_t n);
+	bool mtdfatfsSync(MTDFatFS *fsp);
+	void mtdfatfsTrim(MTDFatFS *fsp, uint32_t start, uint32_t end);
+	uint32_t mtdfatfsEraseTrimmed(MTDFatFS *fsp, uint32_t max);
+#if MTDFATFS_USE_DISKIO
+	void mtdfatfsAttach(uint8_t pdrv, MTDFatFS *fsp);
+#endif
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDFATFS_H */
@@ -0,0 +1,472 @@
+/**
+ * @file       mtdfile.c
+ * @brief      FLASH25 file stream over partition
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Implements BaseFileStream, so chprintf() and other stream code can write
+ * a partition. Small writes and reads go through one pool page: data is
+ * programmed when the stream moves to another page or on mtdfileSync().
+ *
+ * Flash is not erased here: written range must be erased (or only clear
+ * bits), otherwise write stops with FILE_ERROR.
+ *
+ * Last erase block of partition is size journal: mtdfileSync() appends
+ * (size, ~size) entry when size changed, the block is erased only when
+ * it is full. Data written after last sync is found at start as end of
+ * programmed data after committed size; this guess is also used when the
+ * journal is empty (erase of full journal interrupted).
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "mtdfile.h"
+
+#define file_mtd(fsp)		((fsp)->config->mtdp)
+/* data area end, size journal follows */
+#define file_data_end(fsp)	(mtdGetSize(file_mtd(fsp)) - mtdGetEraseSize(file_mtd(fsp)))
+
+struct file_size_entry {
+	uint32_t size;
+	uint32_t check;		/**< ~size */
+};
+
+/*
+ * Page buffer
+ */
+
+/**
+ * @brief program changed bytes of buffered page
+ * @notapi
+ */
+static bool file_flush(MTDFileStream *fsp)
+{
+	bool ret;
+
+	if (fsp->page_addr == MTDFILE_NO_PAGE || fsp->dirty_end <= fsp->dirty_start)
+		return HAL_SUCCESS;
+
+	ret = mtdWriteBytes(file_mtd(fsp), fsp->page_addr + fsp->dirty_start,
+			fsp->page + fsp->dirty_start, fsp->dirty_end - fsp->dirty_start);
+	fsp->stats.page_flushes++;
+	fsp->dirty_start = fsp->dirty_end = 0;
+
+	if (ret == HAL_FAILED) {
+		MTD_DEBUG("mtdfile: %s: flush failed at %" PRIu32, mtdGetName(file_mtd(fsp)),
+				fsp->page_addr);
+		fsp->page_addr = MTDFILE_NO_PAGE;
+		fsp->error = FILE_ERROR;
+	}
+	return ret;
+}
+
+/**
+ * @brief make page at @p addr buffered, previous one is flushed
+ * @notapi
+ */
+static bool file_load(MTDFileStream *fsp, uint32_t addr)
+{
+	BaseMTDDriver *mtdp = file_mtd(fsp);
+
+	if (fsp->page_addr == addr)
+		return HAL_SUCCESS;
+
+	if (file_flush(fsp) == HAL_FAILED)
+		return HAL_FAILED;
+
+	fsp->page_addr = MTDFILE_NO_PAGE;
+	if (blkRead(mtdp, addr / mtdGetPageSize(mtdp), fsp->page, 1) == HAL_FAILED) {
+		fsp->error = FILE_ERROR;
+		return HAL_FAILED;
+	}
+
+	fsp->page_addr = addr;
+	fsp->stats.page_loads++;
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief find end of programmed data from page @p lo
+ * Binary search for first erased page, then last programmed byte before it.
+ * @notapi
+ */
+static bool file_find_end(MTDFileStream *fsp, uint32_t lo, uint32_t *endp)
+{
+	BaseMTDDriver *mtdp = file_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t hi = file_data_end(fsp) / ps;
+	uint32_t first = lo;
+	uint32_t i;
+
+	/* pages below lo are used, pages from hi are erased */
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (blkRead(mtdp, mid, fsp->page, 1) == HAL_FAILED)
+			return HAL_FAILED;
+
+		for (i = 0; i < ps && fsp->page[i] == 0xff; i++)
+			;
+		if (i == ps)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	*endp = first * ps;
+	if (lo == first)
+		return HAL_SUCCESS;
+
+	if (blkRead(mtdp, lo - 1, fsp->page, 1) == HAL_FAILED)
+		return HAL_FAILED;
+
+	for (i = ps; i > 0 && fsp->page[i - 1] == 0xff; i--)
+		;
+	*endp = (lo - 1) * ps + i;
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief load size from journal, then find data written after it
+ * @notapi
+ */
+static bool file_load_size(MTDFileStream *fsp)
+{
+	BaseMTDDriver *mtdp = file_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t es = mtdGetEraseSize(mtdp);
+	const struct file_size_entry *ep = (const struct file_size_entry *)fsp->page;
+	uint32_t pos, i, end;
+	bool found = false;
+
+	fsp->size = 0;
+	fsp->journal_pos = es;
+	for (pos = 0; pos < es && fsp->journal_pos == es; pos += ps) {
+		if (blkRead(mtdp, (file_data_end(fsp) + pos) / ps, fsp->page, 1) == HAL_FAILED)
+			return HAL_FAILED;
+
+		for (i = 0; i < ps / sizeof(*ep); i++) {
+			if (ep[i].size == 0xffffffffUL && ep[i].check == 0xffffffffUL) {
+				fsp->journal_pos = pos + i * sizeof(*ep);
+				break;
+			}
+			/* torn entry is skipped */
+			if (ep[i].check == ~ep[i].size && ep[i].size <= file_data_end(fsp)) {
+				fsp->size = ep[i].size;
+				found = true;
+			}
+		}
+	}
+	fsp->committed = found? fsp->size : MTDFILE_NO_PAGE;
+
+	/* data after committed size: not synced before reset */
+	if (file_find_end(fsp, fsp->size / ps, &end) == HAL_FAILED)
+		return HAL_FAILED;
+	if (end > fsp->size)
+		fsp->size = end;
+
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief append size to journal, erase it if full
+ * @notapi
+ */
+static bool file_commit_size(MTDFileStream *fsp)
+{
+	BaseMTDDriver *mtdp = file_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t es = mtdGetEraseSize(mtdp);
+	struct file_size_entry e;
+
+	if (fsp->size == fsp->committed)
+		return HAL_SUCCESS;
+
+	if (fsp->journal_pos + sizeof(e) > es) {
+		if (mtdErase(mtdp, file_data_end(fsp) / ps, es / ps) == HAL_FAILED)
+			return HAL_FAILED;
+		fsp->journal_pos = 0;
+	}
+
+	e.size = fsp->size;
+	e.check = ~fsp->size;
+	/* position is used even if program fails */
+	fsp->journal_pos += sizeof(e);
+	if (mtdWriteBytes(mtdp, file_data_end(fsp) + fsp->journal_pos - sizeof(e),
+				(const uint8_t *)&e, sizeof(e)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	fsp->committed = fsp->size;
+	fsp->stats.size_commits++;
+	return HAL_SUCCESS;
+}
+
+/*
+ * Stream methods
+ */
+
+static size_t file_write(MTDFileStream *fsp, const uint8_t *bp, size_t n)
+{
+	BaseMTDDriver *mtdp = file_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t end = file_data_end(fsp);
+	size_t done = 0;
+
+	osalMutexLock(&fsp->lock);
+	while (n > 0 && fsp->pos < end) {
+		uint32_t poff = fsp->pos % ps;
+		uint32_t len = ps - poff;
+		uint32_t i;
+
+		if (len > n)
+			len = n;
+
+		if (file_load(fsp, fsp->pos - poff) == HAL_FAILED)
+			break;
+
+		for (i = 0; i < len; i++) {
+			uint8_t *p = fsp->page + poff + i;
+
+			if (*p == bp[i])
+				continue;
+
+			if ((*p & bp[i]) != bp[i]) {
+				MTD_DEBUG("mtdfile: %s: not erased at %" PRIu32, mtdGetName(mtdp),
+						fsp->pos + i);
+				fsp->error = FILE_ERROR;
+				break;
+			}
+
+			*p = bp[i];
+			if (fsp->dirty_end <= fsp->dirty_start) {
+				fsp->dirty_start = poff + i;
+				fsp->dirty_end = poff + i + 1;
+			}
+			else if (poff + i < fsp->dirty_start)
+				fsp->dirty_start = poff + i;
+			else if (poff + i >= fsp->dirty_end)
+				fsp->dirty_end = poff + i + 1;
+		}
+
+		fsp->pos += i;
+		bp += i;
+		n -= i;
+		done += i;
+		if (fsp->pos > fsp->size)
+			fsp->size = fsp->pos;
+
+		if (i < len)
+			break;
+	}
+	osalMutexUnlock(&fsp->lock);
+
+	return done;
+}
+
+static size_t file_read(MTDFileStream *fsp, uint8_t *bp, size_t n)
+{
+	BaseMTDDriver *mtdp = file_mtd(fsp);
+	uint32_t ps = mtdGetPageSize(mtdp);
+	size_t done = 0;
+
+	osalMutexLock(&fsp->lock);
+	if (fsp->pos >= fsp->size)
+		n = 0;
+	else if (n > fsp->size - fsp->pos)
+		n = fsp->size - fsp->pos;
+
+	while (n > 0) {
+		uint32_t poff = fsp->pos % ps;
+		uint32_t len = ps - poff;
+
+		if (poff == 0 && n >= ps && fsp->pos != fsp->page_addr) {
+			/* whole pages straight to caller, up to buffered one */
+			len = n - n % ps;
+			if (fsp->page_addr != MTDFILE_NO_PAGE &&
+					fsp->page_addr > fsp->pos && fsp->page_addr < fsp->pos + len)
+				len = fsp->page_addr - fsp->pos;
+
+			if (blkRead(mtdp, fsp->pos / ps, bp, len / ps) == HAL_FAILED) {
+				fsp->error = FILE_ERROR;
+				break;
+			}
+			fsp->stats.direct_reads++;
+		}
+		else {
+			if (len > n)
+				len = n;
+			if (file_load(fsp, fsp->pos - poff) == HAL_FAILED)
+				break;
+			memcpy(bp, fsp->page + poff, len);
+		}
+
+		fsp->pos += len;
+		bp += len;
+		n -= len;
+		done += len;
+	}
+	osalMutexUnlock(&fsp->lock);
+
+	return done;
+}
+
+static msg_t file_put(MTDFileStream *fsp, uint8_t b)
+{
+	return (file_write(fsp, &b, 1) == 1)? STM_OK : STM_RESET;
+}
+
+static msg_t file_get(MTDFileStream *fsp)
+{
+	uint8_t b;
+
+	return (file_read(fsp, &b, 1) == 1)? b : STM_RESET;
+}
+
+static uint32_t file_close(MTDFileStream *fsp)
+{
+	return (mtdfileStop(fsp) == HAL_SUCCESS)? FILE_OK : FILE_ERROR;
+}
+
+static int file_geterror(MTDFileStream *fsp)
+{
+	return fsp->error;
+}
+
+static fileoffset_t file_getsize(MTDFileStream *fsp)
+{
+	return fsp->size;
+}
+
+static fileoffset_t file_getposition(MTDFileStream *fsp)
+{
+	return fsp->pos;
+}
+
+static uint32_t file_lseek(MTDFileStream *fsp, fileoffset_t offset)
+{
+	if (offset > file_data_end(fsp))
+		return FILE_ERROR;
+
+	osalMutexLock(&fsp->lock);
+	fsp->pos = offset;
+	osalMutexUnlock(&fsp->lock);
+	return FILE_OK;
+}
+
+static const struct BaseFileStreamVMT mtdfile_vmt = {
+	.write = (size_t (*)(void*, const uint8_t*, size_t)) file_write,
+	.read = (size_t (*)(void*, uint8_t*, size_t)) file_read,
+	.put = (msg_t (*)(void*, uint8_t)) file_put,
+	.get = (msg_t (*)(void*)) file_get,
+	.close = (uint32_t (*)(void*)) file_close,
+	.geterror = (int (*)(void*)) file_geterror,
+	.getsize = (fileoffset_t (*)(void*)) file_getsize,
+	.getposition = (fileoffset_t (*)(void*)) file_getposition,
+	.lseek = (uint32_t (*)(void*, fileoffset_t)) file_lseek
+};
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief Initializes an instance.
+ * @init
+ */
+void mtdfileObjectInit(MTDFileStream *fsp)
+{
+	osalDbgCheck(fsp != NULL);
+
+	memset(fsp, 0, sizeof(*fsp));
+	fsp->vmt = &mtdfile_vmt;
+	fsp->page_addr = MTDFILE_NO_PAGE;
+	osalMutexObjectInit(&fsp->lock);
+}
+
+/**
+ * @brief open stream on partition, takes page from pool
+ * Position is set to 0, seek to fileStreamGetSize() to append.
+ *
+ * @return HAL_FAILED if no pool buffer or read error
+ * @api
+ */
+bool mtdfileStart(MTDFileStream *fsp, const MTDFileConfig *cfg)
+{
+	osalDbgCheck((fsp != NULL) && (cfg != NULL) && (cfg->mtdp != NULL));
+	osalDbgAssert(mtdGetPageSize(cfg->mtdp) <= MTD_POOL_PAGE_SIZE, "pool page too small");
+	osalDbgAssert(mtdGetSize(cfg->mtdp) >= 2 * mtdGetEraseSize(cfg->mtdp), "partition too small");
+
+	fsp->config = cfg;
+	fsp->page = mtdPoolAllocPage();
+	if (fsp->page == NULL)
+		return HAL_FAILED;
+
+	fsp->page_addr = MTDFILE_NO_PAGE;
+	fsp->dirty_start = fsp->dirty_end = 0;
+	fsp->pos = 0;
+	fsp->error = FILE_OK;
+
+	if (file_load_size(fsp) == HAL_FAILED) {
+		mtdPoolFreePage(fsp->page);
+		fsp->page = NULL;
+		return HAL_FAILED;
+	}
+
+	MTD_DEBUG("mtdfile: %s: size %" PRIu32, mtdGetName(cfg->mtdp), fsp->size);
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief program buffered data and size, wait for flash
+ * @api
+ */
+bool mtdfileSync(MTDFileStream *fsp)
+{
+	bool ret;
+
+	osalDbgCheck(fsp != NULL);
+
+	osalMutexLock(&fsp->lock);
+	ret = file_flush(fsp);
+	if (ret == HAL_SUCCESS)
+		ret = file_commit_size(fsp);
+	if (ret == HAL_SUCCESS)
+		ret = blkSync(file_mtd(fsp));
+	osalMutexUnlock(&fsp->lock);
+
+	return ret;
+}
+
+/**
+ * @brief sync and release pool page
+ * @api
+ */
+bool mtdfileStop(MTDFileStream *fsp)
+{
+	bool ret;
+
+	osalDbgCheck(fsp != NULL);
+
+	if (fsp->page == NULL)
+		return HAL_SUCCESS;
+
+	ret = mtdfileSync(fsp);
+	mtdPoolFreePage(fsp->page);
+	fsp->page = NULL;
+	fsp->page_addr = MTDFILE_NO_PAGE;
+	return ret;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file       mtdfile.h
+ * @brief      FLASH25 file stream over partition
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDFILE_H
+#define MTDFILE_H
+
+#include "flash-mtd.h"
+
+typedef struct {
+	BaseMTDDriver *mtdp;
+} MTDFileConfig;
+
+struct mtdfile_stats {
+	uint32_t page_loads;	/**< pages read into buffer */
+	uint32_t page_flushes;	/**< buffered pages programmed */
+	uint32_t direct_reads;	/**< reads bypassing buffer */
+	uint32_t size_commits;	/**< size journal entries */
+};
+
+/**
+ * @brief BaseFileStream on partition
+ * File starts at partition start, last erase block keeps its size.
+ */
+typedef struct {
+	const struct BaseFileStreamVMT *vmt;
+	_file_stream_data
+	const MTDFileConfig *config;
+	mutex_t lock;
+	uint8_t *page;		/**< pool page */
+	uint32_t page_addr;	/**< offset of buffered page, MTDFILE_NO_PAGE if none */
+	uint16_t dirty_start;	/**< changed bytes of page [start, end) */
+	uint16_t dirty_end;
+	uint32_t pos;
+	uint32_t size;
+	uint32_t committed;	/**< size in journal, MTDFILE_NO_PAGE if none */
+	uint32_t journal_pos;	/**< next entry in journal block */
+	int error;
+	struct mtdfile_stats stats;
+} MTDFileStream;
+
+#define MTDFILE_NO_PAGE		0xffffffffUL
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	void mtdfileObjectInit(MTDFileStream *fsp);
+	bool mtdfileStart(MTDFileStream *fsp, const MTDFileConfig *config);
+	bool mtdfileStop(MTDFileStream *fsp);
+	bool mtdfileSync(MTDFileStream *fsp);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDFILE_H */
@@ -0,0 +1,981 @@
+/**
+ * @file       mtdkv.c
+ * @brief      FLASH25 log-structured key-value store
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Partition layout: two checkpoint slots (one erase block each), then
+ * log blocks used as a ring. Log block starts with header (magic, seq),
+ * records follow: header (type, key length, value length, crc16), key,
+ * value. Update appends new record, delete appends tombstone.
+ *
+ * RAM index is open-addressing hash table (linear probing) of key hash
+ * to record offset; keys are compared on flash, so hash collisions are
+ * harmless. When log runs out of free blocks, live records of the
+ * oldest block are copied to the head and the block is erased.
+ *
+ * Index checkpoint holds the index with log position. Checkpoints are
+ * appended in one slot (page aligned) until it is full, then the other
+ * slot is erased and used. Checkpoint is written after
+ * MTDKV_CHECKPOINT_INTERVAL records, and not before records appended
+ * since last one take checkpoint size times log blocks per slot, so
+ * slots wear no faster than log blocks.
+ * Header is programmed first, entries next, commit mark last. Mount
+ * loads newest committed checkpoint and scans only the records appended
+ * after it. Compaction since the checkpoint is fine as long as its head
+ * block is still in the log: entries of reclaimed blocks are dropped,
+ * their live records were copied to the head after the checkpoint.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "mtdkv.h"
+
+#define KV_BLOCK_MAGIC		0x424c564bUL	/* "KVLB" */
+#define KV_CP_MAGIC		0x5043564bUL	/* "KVCP" */
+#define KV_CP_SLOTS		2
+
+#define REC_SET			0x5a
+#define REC_DELETE		0x5b
+
+#define INDEX_MASK		(MTDKV_INDEX_SIZE - 1)
+
+struct kv_block_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint16_t crc;
+	uint16_t reserved;
+};
+
+struct kv_rec_hdr {
+	uint8_t type;
+	uint8_t klen;
+	uint16_t vlen;
+	uint16_t crc;		/**< header fields, key and value */
+};
+
+struct kv_cp_hdr {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t tail_seq;
+	uint32_t head_seq;
+	uint32_t write_pos;
+	uint32_t live_bytes;
+	uint32_t count;
+	uint32_t entries_crc;	/**< mtdCrc32() of entries */
+	uint16_t tail_blk;
+	uint16_t head_blk;
+	uint16_t crc;		/**< fields above */
+	uint16_t commit;	/**< 0 when entries are programmed */
+};
+
+#define kv_mtd(kvp)		((kvp)->config->mtdp)
+#define kv_es(kvp)		mtdGetEraseSize(kv_mtd(kvp))
+#define kv_block_start(kvp, blk)	(((blk) + KV_CP_SLOTS) * kv_es(kvp))
+#define kv_cp_len(kvp, count)	((sizeof(struct kv_cp_hdr) + (count) * sizeof(struct mtdkv_entry) + \
+					mtdGetPageSize(kv_mtd(kvp)) - 1) / mtdGetPageSize(kv_mtd(kvp)) * \
+					mtdGetPageSize(kv_mtd(kvp)))
+#define kv_rec_len(hdr)		(sizeof(struct kv_rec_hdr) + (hdr)->klen + \
+					(((hdr)->type == REC_SET)? (hdr)->vlen : 0))
+
+/*
+ * Records
+ */
+
+static uint32_t kv_hash(const uint8_t *key, size_t klen)
+{
+	uint32_t h = 2166136261UL;	/* FNV-1a */
+
+	while (klen--)
+		h = (h ^ *key++) * 16777619UL;
+
+	return h;
+}
+
+static uint16_t kv_rec_crc(const struct kv_rec_hdr *hdr, const uint8_t *data)
+{
+	uint16_t crc = mtdCrc16(0xffff, (const uint8_t *)hdr, offsetof(struct kv_rec_hdr, crc));
+
+	return mtdCrc16(crc, data, kv_rec_len(hdr) - sizeof(*hdr));
+}
+
+static void kv_build_rec(uint8_t *buf, uint8_t type, const char *key, size_t klen,
+		const void *value, size_t len)
+{
+	struct kv_rec_hdr *hdr = (struct kv_rec_hdr *)buf;
+
+	hdr->type = type;
+	hdr->klen = klen;
+	hdr->vlen = len;
+	memcpy(buf + sizeof(*hdr), key, klen);
+	if (len > 0)
+		memcpy(buf + sizeof(*hdr) + klen, value, len);
+	hdr->crc = kv_rec_crc(hdr, buf + sizeof(*hdr));
+}
+
+/**
+ * @brief read record at @p pos into @p buf (pool page)
+ * @return HAL_FAILED on erased space, torn record or read error
+ * @notapi
+ */
+static bool kv_read_rec(MTDKV *kvp, uint32_t pos, uint8_t *buf)
+{
+	struct kv_rec_hdr *hdr = (struct kv_rec_hdr *)buf;
+	uint32_t end = (pos / kv_es(kvp) + 1) * kv_es(kvp);
+
+	if (pos + sizeof(*hdr) > end ||
+			mtdReadBytes(kv_mtd(kvp), pos, buf, sizeof(*hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if ((hdr->type != REC_SET && hdr->type != REC_DELETE) ||
+			hdr->klen == 0 || hdr->klen > MTDKV_MAX_KEY ||
+			(hdr->type == REC_SET && hdr->vlen > MTDKV_MAX_VALUE) ||
+			pos + kv_rec_len(hdr) > end)
+		return HAL_FAILED;
+
+	if (mtdReadBytes(kv_mtd(kvp), pos + sizeof(*hdr), buf + sizeof(*hdr),
+				kv_rec_len(hdr) - sizeof(*hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	return (kv_rec_crc(hdr, buf + sizeof(*hdr)) == hdr->crc)? HAL_SUCCESS : HAL_FAILED;
+}
+
+/*
+ * Index
+ */
+
+/**
+ * @brief find slot of @p key
+ * @param[out] hdrp header of indexed record
+ * @return slot or -1
+ * @notapi
+ */
+static int32_t kv_lookup(MTDKV *kvp, uint32_t hash, const uint8_t *key, size_t klen,
+		struct kv_rec_hdr *hdrp)
+{
+	uint8_t buf[sizeof(struct kv_rec_hdr) + MTDKV_MAX_KEY];
+	uint32_t i;
+
+	for (i = hash & INDEX_MASK; kvp->index[i].offset != MTDKV_NONE; i = (i + 1) & INDEX_MASK) {
+		if (kvp->index[i].hash != hash)
+			continue;
+
+		if (mtdReadBytes(kv_mtd(kvp), kvp->index[i].offset, buf,
+					sizeof(*hdrp) + klen) == HAL_FAILED)
+			continue;
+
+		memcpy(hdrp, buf, sizeof(*hdrp));
+		if (hdrp->klen == klen && memcmp(buf + sizeof(*hdrp), key, klen) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+static void kv_index_insert(MTDKV *kvp, uint32_t hash, uint32_t offset)
+{
+	uint32_t i;
+
+	for (i = hash & INDEX_MASK; kvp->index[i].offset != MTDKV_NONE; i = (i + 1) & INDEX_MASK)
+		;
+
+	kvp->index[i].hash = hash;
+	kvp->index[i].offset = offset;
+	kvp->count++;
+}
+
+/**
+ * @brief remove slot, shift following entries back (no tombstones)
+ * @notapi
+ */
+static void kv_index_remove(MTDKV *kvp, uint32_t i)
+{
+	uint32_t j = i;
+
+	for (;;) {
+		uint32_t k;
+
+		j = (j + 1) & INDEX_MASK;
+		if (kvp->index[j].offset == MTDKV_NONE)
+			break;
+
+		/* entry at j may fill the hole if its home is not in (i, j] */
+		k = kvp->index[j].hash & INDEX_MASK;
+		if ((i <= j)? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		kvp->index[i] = kvp->index[j];
+		i = j;
+	}
+
+	kvp->index[i].offset = MTDKV_NONE;
+	kvp->count--;
+}
+
+static void kv_index_reset(MTDKV *kvp)
+{
+	uint32_t i;
+
+	for (i = 0; i < MTDKV_INDEX_SIZE; i++)
+		kvp->index[i].offset = MTDKV_NONE;
+
+	kvp->count = 0;
+	kvp->live_bytes = 0;
+}
+
+/**
+ * @brief update index by record at @p pos (mount and append)
+ * @notapi
+ */
+static void kv_apply(MTDKV *kvp, const uint8_t *rec, uint32_t pos)
+{
+	const struct kv_rec_hdr *hdr = (const struct kv_rec_hdr *)rec;
+	const uint8_t *key = rec + sizeof(*hdr);
+	uint32_t hash = kv_hash(key, hdr->klen);
+	struct kv_rec_hdr old;
+	int32_t slot = kv_lookup(kvp, hash, key, hdr->klen, &old);
+
+	if (slot >= 0)
+		kvp->live_bytes -= kv_rec_len(&old);
+
+	if (hdr->type == REC_DELETE) {
+		if (slot >= 0)
+			kv_index_remove(kvp, slot);
+		return;
+	}
+
+	if (slot >= 0)
+		kvp->index[slot].offset = pos;
+	else
+		kv_index_insert(kvp, hash, pos);
+	kvp->live_bytes += kv_rec_len(hdr);
+}
+
+/*
+ * Log
+ */
+
+static bool kv_read_block_hdr(MTDKV *kvp, uint32_t blk, struct kv_block_hdr *hdr)
+{
+	if (mtdReadBytes(kv_mtd(kvp), kv_block_start(kvp, blk), (uint8_t *)hdr, sizeof(*hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (hdr->magic != KV_BLOCK_MAGIC ||
+			hdr->crc != mtdCrc16(0xffff, (const uint8_t *)hdr, offsetof(struct kv_block_hdr, crc)))
+		return HAL_FAILED;
+
+	return HAL_SUCCESS;
+}
+
+static uint32_t kv_free_blocks(MTDKV *kvp)
+{
+	if (kvp->head_blk == MTDKV_NONE)
+		return kvp->nr_blocks;
+
+	return kvp->nr_blocks - 1 -
+		(kvp->head_blk + kvp->nr_blocks - kvp->tail_blk) % kvp->nr_blocks;
+}
+
+/**
+ * @brief erase next free block and make it head
+ * @notapi
+ */
+static bool kv_open_block(MTDKV *kvp)
+{
+	BaseMTDDriver *mtdp = kv_mtd(kvp);
+	uint32_t ppb = kv_es(kvp) / mtdGetPageSize(mtdp);
+	uint32_t blk = (kvp->head_blk == MTDKV_NONE)? 0 : (kvp->head_blk + 1) % kvp->nr_blocks;
+	struct kv_block_hdr hdr;
+
+	osalDbgAssert(kv_free_blocks(kvp) > 0, "log full");
+
+	hdr.magic = KV_BLOCK_MAGIC;
+	hdr.seq = kvp->head_seq + 1;
+	hdr.crc = mtdCrc16(0xffff, (const uint8_t *)&hdr, offsetof(struct kv_block_hdr, crc));
+	hdr.reserved = 0xffff;
+
+	if (mtdErase(mtdp, (blk + KV_CP_SLOTS) * ppb, ppb) == HAL_FAILED ||
+			mtdWriteBytes(mtdp, kv_block_start(kvp, blk), (const uint8_t *)&hdr, sizeof(hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (kvp->head_blk == MTDKV_NONE)
+		kvp->tail_blk = blk;
+	kvp->head_blk = blk;
+	kvp->head_seq = hdr.seq;
+	kvp->write_pos = kv_block_start(kvp, blk) + sizeof(hdr);
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief program record at head, opens new block if needed
+ * @param[out] posp record offset
+ * @notapi
+ */
+static bool kv_append(MTDKV *kvp, const uint8_t *rec, uint32_t len, uint32_t *posp)
+{
+	if (kvp->head_blk == MTDKV_NONE || kvp->write_pos == 0 ||
+			kvp->write_pos + len > kv_block_start(kvp, kvp->head_blk + 1)) {
+		if (kv_free_blocks(kvp) == 0 || kv_open_block(kvp) == HAL_FAILED)
+			return HAL_FAILED;
+	}
+
+	if (mtdWriteBytes(kv_mtd(kvp), kvp->write_pos, rec, len) == HAL_FAILED) {
+		kvp->write_pos = 0; /* do not program over failed record */
+		return HAL_FAILED;
+	}
+
+	*posp = kvp->write_pos;
+	kvp->write_pos += len;
+	kvp->since_cp++;
+	kvp->since_cp_bytes += len;
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief copy live records of tail block to head, erase tail
+ * @notapi
+ */
+static bool kv_compact_tail(MTDKV *kvp, uint8_t *buf)
+{
+	const struct kv_rec_hdr *hdr = (const struct kv_rec_hdr *)buf;
+	uint32_t blk = kvp->tail_blk;
+	uint32_t pos = kv_block_start(kvp, blk) + sizeof(struct kv_block_hdr);
+	uint32_t ppb = kv_es(kvp) / mtdGetPageSize(kv_mtd(kvp));
+
+	osalDbgAssert(blk != kvp->head_blk, "compacting head");
+
+	/* tombstones are dropped: older records of the key are here too */
+	for (; kv_read_rec(kvp, pos, buf) == HAL_SUCCESS; pos += kv_rec_len(hdr)) {
+		const uint8_t *key = buf + sizeof(*hdr);
+		struct kv_rec_hdr cur;
+		int32_t slot;
+		uint32_t npos;
+
+		if (hdr->type != REC_SET)
+			continue;
+
+		slot = kv_lookup(kvp, kv_hash(key, hdr->klen), key, hdr->klen, &cur);
+		if (slot < 0 || kvp->index[slot].offset != pos)
+			continue;
+
+		if (kv_append(kvp, buf, kv_rec_len(hdr), &npos) == HAL_FAILED)
+			return HAL_FAILED;
+		kvp->index[slot].offset = npos;
+	}
+
+	if (mtdErase(kv_mtd(kvp), (blk + KV_CP_SLOTS) * ppb, ppb) == HAL_FAILED)
+		return HAL_FAILED;
+
+	kvp->tail_blk = (blk + 1) % kvp->nr_blocks;
+	kvp->stats.compactions++;
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief make sure @p len bytes can be appended, compact if needed
+ * One free block is kept in reserve for compaction.
+ * @notapi
+ */
+static bool kv_make_room(MTDKV *kvp, uint32_t len, uint8_t *buf)
+{
+	uint32_t i;
+
+	if (kvp->head_blk != MTDKV_NONE && kvp->write_pos != 0 &&
+			kvp->write_pos + len <= kv_block_start(kvp, kvp->head_blk + 1))
+		return HAL_SUCCESS;
+
+	for (i = 0; i < kvp->nr_blocks && kv_free_blocks(kvp) < 2; i++)
+		if (kv_compact_tail(kvp, buf) == HAL_FAILED)
+			return HAL_FAILED;
+
+	return (kv_free_blocks(kvp) > 0)? HAL_SUCCESS : HAL_FAILED;
+}
+
+/*
+ * Checkpoint
+ */
+
+/**
+ * @brief checkpoint is due
+ * @notapi
+ */
+static bool kv_cp_due(MTDKV *kvp)
+{
+	return kvp->since_cp >= MTDKV_CHECKPOINT_INTERVAL &&
+		kvp->since_cp_bytes * KV_CP_SLOTS >= kv_cp_len(kvp, kvp->count) * kvp->nr_blocks;
+}
+
+static bool kv_read_cp_hdr(MTDKV *kvp, uint32_t pos, struct kv_cp_hdr *hdr)
+{
+	if (mtdReadBytes(kv_mtd(kvp), pos, (uint8_t *)hdr, sizeof(*hdr)) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (hdr->magic != KV_CP_MAGIC || hdr->count > MTDKV_MAX_KEYS ||
+			hdr->crc != mtdCrc16(0xffff, (const uint8_t *)hdr, offsetof(struct kv_cp_hdr, crc)))
+		return HAL_FAILED;
+
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief CRC of index entries in checkpoint order
+ * @notapi
+ */
+static uint32_t kv_index_crc(MTDKV *kvp)
+{
+	uint32_t crc = 0;
+	uint32_t i;
+
+	for (i = 0; i < MTDKV_INDEX_SIZE; i++)
+		if (kvp->index[i].offset != MTDKV_NONE)
+			crc = mtdCrc32(crc, (const uint8_t *)&kvp->index[i], sizeof(kvp->index[i]));
+
+	return crc;
+}
+
+/**
+ * @brief append checkpoint of index and log position
+ * Goes after last checkpoint of current slot; when it does not fit, the
+ * other slot is erased. Entries are programmed after header, commit mark
+ * last, so torn checkpoint is skipped by mount.
+ * @notapi
+ */
+static bool kv_write_cp(MTDKV *kvp, uint8_t *buf)
+{
+	BaseMTDDriver *mtdp = kv_mtd(kvp);
+	uint32_t es = kv_es(kvp);
+	uint32_t len = kv_cp_len(kvp, kvp->count);
+	uint32_t per_buf = MTD_POOL_PAGE_SIZE / sizeof(struct mtdkv_entry);
+	struct mtdkv_entry *ep = (struct mtdkv_entry *)buf;
+	struct kv_block_hdr bhdr;
+	struct kv_cp_hdr hdr;
+	uint32_t slot, start, pos, i, n = 0;
+	uint16_t commit = 0;
+
+	if (kvp->head_blk == MTDKV_NONE)
+		return HAL_SUCCESS; /* nothing to index */
+
+	if (len > es) {
+		MTD_DEBUG("kv: %s: index does not fit checkpoint", mtdGetName(mtdp));
+		return HAL_FAILED;
+	}
+
+	if (kv_read_block_hdr(kvp, kvp->tail_blk, &bhdr) == HAL_FAILED)
+		return HAL_FAILED;
+
+	slot = kvp->cp_slot;
+	start = kvp->cp_pos;
+	if (start == MTDKV_NONE || start + len > (slot + 1) * es) {
+		slot = (slot + 1) % KV_CP_SLOTS;
+		start = slot * es;
+		kvp->cp_pos = MTDKV_NONE;
+		if (mtdErase(mtdp, slot * es / mtdGetPageSize(mtdp), es / mtdGetPageSize(mtdp)) == HAL_FAILED)
+			return HAL_FAILED;
+		kvp->stats.cp_erases++;
+	}
+
+	hdr.magic = KV_CP_MAGIC;
+	hdr.seq = kvp->cp_seq + 1;
+	hdr.tail_seq = bhdr.seq;
+	hdr.head_seq = kvp->head_seq;
+	hdr.write_pos = kvp->write_pos;
+	hdr.live_bytes = kvp->live_bytes;
+	hdr.count = kvp->count;
+	hdr.entries_crc = kv_index_crc(kvp);
+	hdr.tail_blk = kvp->tail_blk;
+	hdr.head_blk = kvp->head_blk;
+	hdr.crc = mtdCrc16(0xffff, (const uint8_t *)&hdr, offsetof(struct kv_cp_hdr, crc));
+	hdr.commit = 0xffff;
+
+	/* space is used from here on, even if rest fails */
+	kvp->cp_seq = hdr.seq;
+	if (mtdWriteBytes(mtdp, start, (const uint8_t *)&hdr, sizeof(hdr)) == HAL_FAILED)
+		goto fail;
+
+	pos = start + sizeof(hdr);
+	for (i = 0; i <= MTDKV_INDEX_SIZE; i++) {
+		if (n == per_buf || (i == MTDKV_INDEX_SIZE && n > 0)) {
+			if (mtdWriteBytes(mtdp, pos, buf, n * sizeof(*ep)) == HAL_FAILED)
+				goto fail;
+			pos += n * sizeof(*ep);
+			n = 0;
+		}
+
+		if (i < MTDKV_INDEX_SIZE && kvp->index[i].offset != MTDKV_NONE)
+			ep[n++] = kvp->index[i];
+	}
+
+	if (mtdWriteBytes(mtdp, start + offsetof(struct kv_cp_hdr, commit),
+				(const uint8_t *)&commit, sizeof(commit)) == HAL_FAILED)
+		goto fail;
+
+	kvp->cp_slot = slot;
+	kvp->cp_pos = start + len;
+	kvp->since_cp = 0;
+	kvp->since_cp_bytes = 0;
+	kvp->stats.checkpoints++;
+	return HAL_SUCCESS;
+
+fail:
+	/* next checkpoint erases slot other than one of last good checkpoint */
+	kvp->cp_pos = MTDKV_NONE;
+	return HAL_FAILED;
+}
+
+/**
+ * @brief find newest committed checkpoint which matches the log
+ * Also finds where next checkpoint is appended: after newest header,
+ * if the space there is still erased.
+ *
+ * @param[out] cpp checkpoint header
+ * @param[out] posp checkpoint offset
+ * @notapi
+ */
+static bool kv_find_cp(MTDKV *kvp, struct kv_cp_hdr *cpp, uint32_t *posp)
+{
+	uint32_t es = kv_es(kvp);
+	struct kv_block_hdr bhdr;
+	struct kv_cp_hdr hdr;
+	uint32_t slot, pos, i;
+	bool found = false;
+
+	kvp->cp_slot = KV_CP_SLOTS - 1;
+	kvp->cp_pos = MTDKV_NONE;
+
+	for (slot = 0; slot < KV_CP_SLOTS; slot++) {
+		for (pos = slot * es; pos + sizeof(hdr) <= (slot + 1) * es;
+				pos += kv_cp_len(kvp, hdr.count)) {
+			if (kv_read_cp_hdr(kvp, pos, &hdr) == HAL_FAILED)
+				break;
+
+			if (hdr.seq >= kvp->cp_seq) {
+				kvp->cp_seq = hdr.seq;
+				kvp->cp_slot = slot;
+				kvp->cp_pos = pos + kv_cp_len(kvp, hdr.count);
+			}
+
+			if (hdr.commit != 0 || (found && hdr.seq < cpp->seq))
+				continue;
+
+			/* tail may be compacted since, head block must be the same */
+			if (hdr.head_blk >= kvp->nr_blocks ||
+					kv_read_block_hdr(kvp, hdr.head_blk, &bhdr) == HAL_FAILED ||
+					bhdr.seq != hdr.head_seq)
+				continue;
+
+			*cpp = hdr;
+			*posp = pos;
+			found = true;
+		}
+	}
+
+	/* torn header after newest one: slot is not appended any more */
+	pos = kvp->cp_pos;
+	if (pos != MTDKV_NONE && pos + sizeof(hdr) <= (kvp->cp_slot + 1) * es) {
+		if (mtdReadBytes(kv_mtd(kvp), pos, (uint8_t *)&hdr, sizeof(hdr)) == HAL_FAILED)
+			kvp->cp_pos = MTDKV_NONE;
+		for (i = 0; i < sizeof(hdr); i++)
+			if (((const uint8_t *)&hdr)[i] != 0xff)
+				kvp->cp_pos = MTDKV_NONE;
+	}
+
+	return found? HAL_SUCCESS : HAL_FAILED;
+}
+
+/**
+ * @brief sum of indexed record lengths
+ * @notapi
+ */
+static bool kv_count_live(MTDKV *kvp)
+{
+	struct kv_rec_hdr hdr;
+	uint32_t i;
+
+	kvp->live_bytes = 0;
+	for (i = 0; i < MTDKV_INDEX_SIZE; i++) {
+		if (kvp->index[i].offset == MTDKV_NONE)
+			continue;
+		if (mtdReadBytes(kv_mtd(kvp), kvp->index[i].offset, (uint8_t *)&hdr,
+					sizeof(hdr)) == HAL_FAILED)
+			return HAL_FAILED;
+		kvp->live_bytes += kv_rec_len(&hdr);
+	}
+
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief load newest checkpoint which matches the log
+ * Entries in blocks compacted after the checkpoint (not between current
+ * tail and checkpoint head) are dropped, live size is counted again then.
+ *
+ * @param[out] cpp loaded checkpoint header
+ * @notapi
+ */
+static bool kv_load_cp(MTDKV *kvp, uint8_t *buf, struct kv_cp_hdr *cpp)
+{
+	uint32_t per_buf = MTD_POOL_PAGE_SIZE / sizeof(struct mtdkv_entry);
+	const struct mtdkv_entry *ep = (const struct mtdkv_entry *)buf;
+	uint32_t pos = 0, left, span, crc = 0, dropped = 0;
+
+	if (kv_find_cp(kvp, cpp, &pos) == HAL_FAILED)
+		return HAL_FAILED;
+
+	span = (cpp->head_blk + kvp->nr_blocks - kvp->tail_blk) % kvp->nr_blocks;
+	pos += sizeof(*cpp);
+	for (left = cpp->count; left > 0; ) {
+		uint32_t n = (left < per_buf)? left : per_buf;
+		uint32_t i;
+
+		if (mtdReadBytes(kv_mtd(kvp), pos, buf, n * sizeof(*ep)) == HAL_FAILED)
+			break;
+		crc = mtdCrc32(crc, buf, n * sizeof(*ep));
+		for (i = 0; i < n; i++) {
+			uint32_t blk = ep[i].offset / kv_es(kvp) - KV_CP_SLOTS;
+
+			if ((blk + kvp->nr_blocks - kvp->tail_blk) % kvp->nr_blocks > span)
+				dropped++;
+			else
+				kv_index_insert(kvp, ep[i].hash, ep[i].offset);
+		}
+
+		pos += n * sizeof(*ep);
+		left -= n;
+	}
+
+	if (left > 0 || crc != cpp->entries_crc ||
+			(dropped > 0 && kv_count_live(kvp) == HAL_FAILED)) {
+		kv_index_reset(kvp);
+		return HAL_FAILED;
+	}
+
+	if (dropped == 0)
+		kvp->live_bytes = cpp->live_bytes;
+	return HAL_SUCCESS;
+}
+
+/*
+ * Mount
+ */
+
+/**
+ * @brief apply records of block from @p pos
+ * @return end of valid records, 0 if block is closed (full or torn)
+ * @notapi
+ */
+static uint32_t kv_scan_block(MTDKV *kvp, uint32_t blk, uint32_t pos, uint8_t *buf)
+{
+	const struct kv_rec_hdr *hdr = (const struct kv_rec_hdr *)buf;
+	uint32_t end = kv_block_start(kvp, blk + 1);
+
+	for (; kv_read_rec(kvp, pos, buf) == HAL_SUCCESS; pos += kv_rec_len(hdr)) {
+		kv_apply(kvp, buf, pos);
+		kvp->stats.mount_records++;
+		kvp->since_cp_bytes += kv_rec_len(hdr);
+	}
+
+	/* erased header - free space follows */
+	if (pos + sizeof(*hdr) <= end && hdr->type == 0xff && hdr->klen == 0xff)
+		return pos;
+
+	return 0;
+}
+
+static bool kv_mount(MTDKV *kvp)
+{
+	struct kv_block_hdr hdr;
+	struct kv_cp_hdr cp;
+	uint32_t blk, min_seq = 0, start_blk, pos;
+	uint8_t *buf;
+
+	kv_index_reset(kvp);
+	kvp->head_blk = MTDKV_NONE;
+	kvp->head_seq = 0;
+	kvp->write_pos = 0;
+	kvp->cp_seq = 0;
+	kvp->since_cp = 0;
+	kvp->since_cp_bytes = 0;
+	kvp->stats.mount_records = 0;
+	kvp->stats.mount_checkpoint = false;
+
+	for (blk = 0; blk < kvp->nr_blocks; blk++) {
+		if (kv_read_block_hdr(kvp, blk, &hdr) == HAL_FAILED)
+			continue;
+
+		if (kvp->head_blk == MTDKV_NONE || hdr.seq > kvp->head_seq) {
+			kvp->head_seq = hdr.seq;
+			kvp->head_blk = blk;
+		}
+		if (min_seq == 0 || hdr.seq < min_seq) {
+			min_seq = hdr.seq;
+			kvp->tail_blk = blk;
+		}
+	}
+
+	buf = mtdPoolAllocPage();
+	if (buf == NULL)
+		return HAL_FAILED;
+
+	if (kvp->head_blk == MTDKV_NONE) {
+		/* empty log, still learn checkpoint sequence */
+		kv_load_cp(kvp, buf, &cp);
+		kv_index_reset(kvp);
+		mtdPoolFreePage(buf);
+		return HAL_SUCCESS;
+	}
+
+	if (kv_load_cp(kvp, buf, &cp) == HAL_SUCCESS) {
+		kvp->stats.mount_checkpoint = true;
+		start_blk = cp.head_blk;
+		pos = cp.write_pos;
+		if (pos == 0 && start_blk != kvp->head_blk) {
+			start_blk = (start_blk + 1) % kvp->nr_blocks;
+			pos = kv_block_start(kvp, start_blk) + sizeof(hdr);
+		}
+	}
+	else {
+		start_blk = kvp->tail_blk;
+		pos = kv_block_start(kvp, start_blk) + sizeof(hdr);
+	}
+
+	for (blk = start_blk; ; blk = (blk + 1) % kvp->nr_blocks) {
+		if (blk != start_blk)
+			pos = kv_block_start(kvp, blk) + sizeof(hdr);
+		if (pos != 0)
+			pos = kv_scan_block(kvp, blk, pos, buf);
+		if (blk == kvp->head_blk)
+			break;
+	}
+	kvp->write_pos = pos;
+	kvp->since_cp = kvp->stats.mount_records;
+
+	MTD_INFO("kv: %s: %" PRIu32 " keys, %" PRIu32 " records scanned%s",
+			mtdGetName(kv_mtd(kvp)), kvp->count, kvp->stats.mount_records,
+			(kvp->stats.mount_checkpoint)? " after checkpoint" : "");
+
+	if (!kvp->stats.mount_checkpoint || kv_cp_due(kvp))
+		kv_write_cp(kvp, buf);
+
+	mtdPoolFreePage(buf);
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief append record, update index
+ * @notapi
+ */
+static bool kv_put(MTDKV *kvp, uint8_t type, const char *key, const void *value, size_t len)
+{
+	size_t klen = strlen(key);
+	struct kv_rec_hdr *hdr;
+	struct kv_rec_hdr old;
+	int32_t slot;
+	uint32_t pos;
+	uint8_t *buf;
+	bool ret = HAL_FAILED;
+
+	osalDbgCheck((kvp != NULL) && (key != NULL) && (value != NULL || len == 0));
+	if (klen == 0 || klen > MTDKV_MAX_KEY || len > MTDKV_MAX_VALUE)
+		return HAL_FAILED;
+
+	buf = mtdPoolAllocPage();
+	if (buf == NULL)
+		return HAL_FAILED;
+
+	osalMutexLock(&kvp->lock);
+	slot = kv_lookup(kvp, kv_hash((const uint8_t *)key, klen), (const uint8_t *)key, klen, &old);
+	if (type == REC_DELETE && slot < 0) {
+		ret = HAL_SUCCESS; /* nothing to delete */
+		goto out;
+	}
+	if (type == REC_SET && slot < 0 && kvp->count >= MTDKV_MAX_KEYS)
+		goto out; /* index full */
+
+	/* unchanged value is not written again */
+	if (type == REC_SET && slot >= 0 && old.vlen == len &&
+			kv_read_rec(kvp, kvp->index[slot].offset, buf) == HAL_SUCCESS &&
+			memcmp(buf + sizeof(old) + klen, value, len) == 0) {
+		ret = HAL_SUCCESS;
+		goto out;
+	}
+
+	hdr = (struct kv_rec_hdr *)buf;
+	kv_build_rec(buf, type, key, klen, value, len);
+
+	/* keep space for compaction to make progress */
+	if (type == REC_SET &&
+			kvp->live_bytes - ((slot >= 0)? kv_rec_len(&old) : 0) + kv_rec_len(hdr) >
+			(kvp->nr_blocks - 2) * (kv_es(kvp) - sizeof(struct kv_block_hdr) -
+				sizeof(*hdr) - MTDKV_MAX_KEY - MTDKV_MAX_VALUE)) {
+		MTD_DEBUG("kv: %s: store full", mtdGetName(kv_mtd(kvp)));
+		goto out;
+	}
+
+	/* compaction reuses pool page, record is rebuilt after it */
+	if (kv_make_room(kvp, kv_rec_len(hdr), buf) == HAL_FAILED)
+		goto out;
+
+	kv_build_rec(buf, type, key, klen, value, len);
+	if (kv_append(kvp, buf, kv_rec_len(hdr), &pos) == HAL_FAILED)
+		goto out;
+
+	kv_apply(kvp, buf, pos);
+	ret = HAL_SUCCESS;
+
+	if (kv_cp_due(kvp))
+		kv_write_cp(kvp, buf);
+
+out:
+	osalMutexUnlock(&kvp->lock);
+	mtdPoolFreePage(buf);
+	return ret;
+}
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief Initializes an instance.
+ *
+ * @init
+ */
+void mtdkvObjectInit(MTDKV *kvp)
+{
+	osalDbgCheck(kvp != NULL);
+
+	memset(kvp, 0, sizeof(*kvp));
+	kvp->head_blk = MTDKV_NONE;
+	osalMutexObjectInit(&kvp->lock);
+}
+
+/**
+ * @brief mount store, blank partition is empty store
+ * @api
+ */
+bool mtdkvStart(MTDKV *kvp, const MTDKVConfig *cfg)
+{
+	bool ret;
+
+	osalDbgCheck((kvp != NULL) && (cfg != NULL) && (cfg->mtdp != NULL));
+
+	kvp->config = cfg;
+	kvp->nr_blocks = mtdGetSize(cfg->mtdp) / mtdGetEraseSize(cfg->mtdp) - KV_CP_SLOTS;
+	osalDbgAssert(mtdGetSize(cfg->mtdp) / mtdGetEraseSize(cfg->mtdp) >= KV_CP_SLOTS + 3,
+			"partition too small");
+
+	osalMutexLock(&kvp->lock);
+	ret = kv_mount(kvp);
+	osalMutexUnlock(&kvp->lock);
+	return ret;
+}
+
+/**
+ * @brief erase partition, drop all keys
+ * @api
+ */
+bool mtdkvFormat(MTDKV *kvp)
+{
+	BaseMTDDriver *mtdp = kv_mtd(kvp);
+	bool ret;
+
+	osalDbgCheck(kvp != NULL);
+
+	osalMutexLock(&kvp->lock);
+	ret = mtdErase(mtdp, 0, mtdp->nr_pages);
+	if (ret == HAL_SUCCESS)
+		ret = kv_mount(kvp);
+	osalMutexUnlock(&kvp->lock);
+	return ret;
+}
+
+/**
+ * @brief get value
+ * @param[in,out] lenp buffer size in, value length out
+ * @return HAL_FAILED if key not found
+ * @api
+ */
+bool mtdkvGet(MTDKV *kvp, const char *key, void *buf, size_t *lenp)
+{
+	size_t klen = strlen(key);
+	struct kv_rec_hdr hdr;
+	int32_t slot;
+	uint8_t *rec;
+	bool ret = HAL_FAILED;
+
+	osalDbgCheck((kvp != NULL) && (key != NULL) && (lenp != NULL));
+	if (klen == 0 || klen > MTDKV_MAX_KEY)
+		return HAL_FAILED;
+
+	rec = mtdPoolAllocPage();
+	if (rec == NULL)
+		return HAL_FAILED;
+
+	osalMutexLock(&kvp->lock);
+	slot = kv_lookup(kvp, kv_hash((const uint8_t *)key, klen), (const uint8_t *)key, klen, &hdr);
+	if (slot >= 0 && kv_read_rec(kvp, kvp->index[slot].offset, rec) == HAL_SUCCESS) {
+		memcpy(buf, rec + sizeof(hdr) + klen, (*lenp < hdr.vlen)? *lenp : hdr.vlen);
+		*lenp = hdr.vlen;
+		ret = HAL_SUCCESS;
+	}
+	osalMutexUnlock(&kvp->lock);
+
+	mtdPoolFreePage(rec);
+	return ret;
+}
+
+/**
+ * @brief set value (up to MTDKV_MAX_VALUE bytes)
+ * @return HAL_FAILED if store or index is full, or on flash error
+ * @api
+ */
+bool mtdkvSet(MTDKV *kvp, const char *key, const void *value, size_t len)
+{
+	return kv_put(kvp, REC_SET, key, value, len);
+}
+
+/**
+ * @brief remove key
+ * @api
+ */
+bool mtdkvDelete(MTDKV *kvp, const char *key)
+{
+	return kv_put(kvp, REC_DELETE, key, NULL, 0);
+}
+
+/**
+ * @brief write index checkpoint now (e.g. before planned power off)
+ * @api
+ */
+bool mtdkvCheckpoint(MTDKV *kvp)
+{
+	uint8_t *buf;
+	bool ret;
+
+	osalDbgCheck(kvp != NULL);
+
+	buf = mtdPoolAllocPage();
+	if (buf == NULL)
+		return HAL_FAILED;
+
+	osalMutexLock(&kvp->lock);
+	ret = kv_write_cp(kvp, buf);
+	osalMutexUnlock(&kvp->lock);
+
+	mtdPoolFreePage(buf);
+	return ret;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file       mtdkv.h
+ * @brief      FLASH25 log-structured key-value store
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDKV_H
+#define MTDKV_H
+
+#include "flash-mtd.h"
+
+#if !defined(MTDKV_INDEX_SIZE)
+/* hash index slots, power of two, keys up to 3/4 of it */
+#define MTDKV_INDEX_SIZE	512
+#endif
+
+#if !defined(MTDKV_MAX_KEY)
+#define MTDKV_MAX_KEY		32
+#endif
+
+#if !defined(MTDKV_MAX_VALUE)
+#define MTDKV_MAX_VALUE		128
+#endif
+
+#if !defined(MTDKV_CHECKPOINT_INTERVAL)
+/* records appended between index checkpoints (at least) */
+#define MTDKV_CHECKPOINT_INTERVAL	64
+#endif
+
+#if (MTDKV_INDEX_SIZE & (MTDKV_INDEX_SIZE - 1)) != 0
+#error "MTDKV_INDEX_SIZE must be power of two"
+#endif
+
+#if 6 + MTDKV_MAX_KEY + MTDKV_MAX_VALUE > MTD_POOL_PAGE_SIZE
+#error "MTDKV record does not fit pool page"
+#endif
+
+#define MTDKV_MAX_KEYS		(MTDKV_INDEX_SIZE * 3 / 4)
+
+typedef struct {
+	BaseMTDDriver *mtdp;
+} MTDKVConfig;
+
+struct mtdkv_entry {
+	uint32_t hash;
+	uint32_t offset;	/**< record in partition, MTDKV_NONE if free */
+};
+
+struct mtdkv_stats {
+	uint32_t mount_records;	/**< records scanned by last mount */
+	bool mount_checkpoint;	/**< last mount started from checkpoint */
+	uint32_t compactions;	/**< log blocks reclaimed */
+	uint32_t checkpoints;
+	uint32_t cp_erases;	/**< checkpoint slot erases */
+};
+
+typedef struct {
+	const MTDKVConfig *config;
+	mutex_t lock;
+	uint32_t nr_blocks;	/**< log blocks */
+	uint32_t head_blk;	/**< MTDKV_NONE if log is empty */
+	uint32_t tail_blk;
+	uint32_t head_seq;
+	uint32_t write_pos;	/**< byte in partition, 0 - block must be opened */
+	uint32_t live_bytes;
+	uint32_t cp_seq;
+	uint32_t cp_slot;	/**< slot of newest checkpoint */
+	uint32_t cp_pos;	/**< next checkpoint offset, MTDKV_NONE - erase other slot */
+	uint32_t since_cp;	/**< records since last checkpoint */
+	uint32_t since_cp_bytes;	/**< bytes of them */
+	uint32_t count;
+	struct mtdkv_entry index[MTDKV_INDEX_SIZE];
+	struct mtdkv_stats stats;
+} MTDKV;
+
+#define MTDKV_NONE		0xffffffffUL
+
+#define mtdkvGetCount(kvp)	((kvp)->count)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	void mtdkvObjectInit(MTDKV *kvp);
+	bool mtdkvStart(MTDKV *kvp, const MTDKVConfig *config);
+	bool mtdkvFormat(MTDKV *kvp);
+	bool mtdkvGet(MTDKV *kvp, const char *key, void *buf, size_t *lenp);
+	bool mtdkvSet(MTDKV *kvp, const char *key, const void *value, size_t len);
+	bool mtdkvDelete(MTDKV *kvp, const char *key);
+	bool mtdkvCheckpoint(MTDKV *kvp);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDKV_H */
@@ -0,0 +1,163 @@
+/**
+ * @file       mtdpool.c
+ * @brief      FLASH25 I/O buffer pool
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Fixed set of page and erase block sized buffers, statically allocated
+ * and aligned for DMA. Allocation is lock-free (atomic bitmap), so it
+ * may be used from any thread or ISR. Empty pool returns NULL.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "flash-mtd.h"
+
+#if defined(MTD_POOL_SECTION)
+#define POOL_ATTR	__attribute__((aligned(MTD_POOL_ALIGN), section(MTD_POOL_SECTION)))
+#else
+#define POOL_ATTR	__attribute__((aligned(MTD_POOL_ALIGN)))
+#endif
+
+#define POOL_MASK(n)	((n) >= 32 ? 0xffffffffUL : (1UL << (n)) - 1)
+
+struct mtd_pool {
+	uint8_t *base;
+	size_t size;
+	uint32_t nr;
+	volatile uint32_t used;	/* bitmap */
+	volatile uint8_t min_free;
+};
+
+static uint8_t mtd_pool_pages[MTD_POOL_NR_PAGES][MTD_POOL_PAGE_SIZE] POOL_ATTR;
+static struct mtd_pool mtd_pool_page = {
+	(uint8_t *)mtd_pool_pages, MTD_POOL_PAGE_SIZE, MTD_POOL_NR_PAGES, 0, MTD_POOL_NR_PAGES
+};
+
+#if MTD_POOL_NR_BLOCKS > 0
+static uint8_t mtd_pool_blocks[MTD_POOL_NR_BLOCKS][MTD_POOL_ERASE_SIZE] POOL_ATTR;
+static struct mtd_pool mtd_pool_block = {
+	(uint8_t *)mtd_pool_blocks, MTD_POOL_ERASE_SIZE, MTD_POOL_NR_BLOCKS, 0, MTD_POOL_NR_BLOCKS
+};
+#else
+static struct mtd_pool mtd_pool_block = { NULL, MTD_POOL_ERASE_SIZE, 0, 0, 0 };
+#endif
+
+static volatile uint32_t mtd_pool_failures;
+
+/**
+ * @brief take first free buffer
+ * @notapi
+ */
+static uint8_t *mtd_pool_alloc(struct mtd_pool *pp)
+{
+	uint32_t used = __atomic_load_n(&pp->used, __ATOMIC_RELAXED);
+	uint32_t bit;
+	uint8_t nfree;
+
+	do {
+		uint32_t avail = ~used & POOL_MASK(pp->nr);
+
+		if (avail == 0) {
+			__atomic_fetch_add(&mtd_pool_failures, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+
+		bit = avail & -avail;
+	} while (!__atomic_compare_exchange_n(&pp->used, &used, used | bit,
+				true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	/* low watermark is statistics only, races are harmless */
+	nfree = pp->nr - __builtin_popcount(used | bit);
+	if (nfree < pp->min_free)
+		pp->min_free = nfree;
+
+	return pp->base + __builtin_ctz(bit) * pp->size;
+}
+
+/**
+ * @brief return buffer to pool
+ * @notapi
+ */
+static void mtd_pool_free(struct mtd_pool *pp, uint8_t *buf)
+{
+	uint32_t idx = (buf - pp->base) / pp->size;
+
+	osalDbgCheck(buf != NULL);
+	osalDbgAssert(buf >= pp->base && idx < pp->nr &&
+			buf == pp->base + idx * pp->size, "not pool buffer");
+	osalDbgAssert(pp->used & (1UL << idx), "double free");
+
+	__atomic_fetch_and(&pp->used, ~(1UL << idx), __ATOMIC_RELEASE);
+}
+
+/*
+ * public interface
+ */
+
+/**
+ * @brief borrow page buffer (MTD_POOL_PAGE_SIZE bytes)
+ * @return NULL if pool is empty
+ * @xclass
+ */
+uint8_t *mtdPoolAllocPage(void)
+{
+	return mtd_pool_alloc(&mtd_pool_page);
+}
+
+/**
+ * @brief return page buffer
+ * @xclass
+ */
+void mtdPoolFreePage(uint8_t *buf)
+{
+	mtd_pool_free(&mtd_pool_page, buf);
+}
+
+/**
+ * @brief borrow erase block buffer (MTD_POOL_ERASE_SIZE bytes)
+ * @return NULL if pool is empty
+ * @xclass
+ */
+uint8_t *mtdPoolAllocBlock(void)
+{
+	return mtd_pool_alloc(&mtd_pool_block);
+}
+
+/**
+ * @brief return erase block buffer
+ * @xclass
+ */
+void mtdPoolFreeBlock(uint8_t *buf)
+{
+	mtd_pool_free(&mtd_pool_block, buf);
+}
+
+/**
+ * @brief get pool usage
+ * @api
+ */
+void mtdPoolGetStats(struct mtd_pool_stats *stp)
+{
+	osalDbgCheck(stp != NULL);
+
+	stp->pages_free = mtd_pool_page.nr - __builtin_popcount(mtd_pool_page.used);
+	stp->pages_min_free = mtd_pool_page.min_free;
+	stp->blocks_free = mtd_pool_block.nr - __builtin_popcount(mtd_pool_block.used);
+	stp->blocks_min_free = mtd_pool_block.min_free;
+	stp->failures = mtd_pool_failures;
+}
@@ -0,0 +1,82 @@
+/**
+ * @file       mtdpool.h
+ * @brief      FLASH25 I/O buffer pool
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDPOOL_H
+#define MTDPOOL_H
+
+#include "flash-mtd.h"
+
+/* -*- configuration -*- */
+
+#if !defined(MTD_POOL_PAGE_SIZE)
+#define MTD_POOL_PAGE_SIZE	256
+#endif
+
+#if !defined(MTD_POOL_NR_PAGES)
+#define MTD_POOL_NR_PAGES	4
+#endif
+
+#if !defined(MTD_POOL_ERASE_SIZE)
+#define MTD_POOL_ERASE_SIZE	4096
+#endif
+
+#if !defined(MTD_POOL_NR_BLOCKS)
+#define MTD_POOL_NR_BLOCKS	1
+#endif
+
+#if !defined(MTD_POOL_ALIGN)
+/* DMA/cache line alignment of every buffer */
+#define MTD_POOL_ALIGN		32
+#endif
+
+/* MTD_POOL_SECTION: optional linker section, e.g. for DMA capable RAM */
+
+#if MTD_POOL_NR_PAGES > 32 || MTD_POOL_NR_BLOCKS > 32
+#error "MTD pool: at most 32 buffers of each size"
+#endif
+
+#if (MTD_POOL_PAGE_SIZE % MTD_POOL_ALIGN) || (MTD_POOL_ERASE_SIZE % MTD_POOL_ALIGN)
+#error "MTD pool: buffer size must be multiple of alignment"
+#endif
+
+struct mtd_pool_stats {
+	uint8_t pages_free;
+	uint8_t pages_min_free;	/**< low watermark */
+	uint8_t blocks_free;
+	uint8_t blocks_min_free;
+	uint32_t failures;	/**< allocations failed, pool empty */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	uint8_t *mtdPoolAllocPage(void);
+	void mtdPoolFreePage(uint8_t *buf);
+	uint8_t *mtdPoolAllocBlock(void);
+	void mtdPoolFreeBlock(uint8_t *buf);
+	void mtdPoolGetStats(struct mtd_pool_stats *stp);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDPOOL_H */
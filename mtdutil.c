@@ -0,0 +1,349 @@
+/**
+ * @file       mtdutil.c
+ * @brief      FLASH25 byte granular I/O and checksum helpers
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include "flash-mtd.h"
+
+/**
+ * @brief read bytes from any offset
+ * Unaligned head and tail go through pool page, whole pages read directly.
+ * @api
+ */
+bool mtdReadBytes(BaseMTDDriver *mtdp, uint32_t offset, uint8_t *buf, uint32_t n)
+{
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint8_t *page = NULL;
+	bool ret = HAL_SUCCESS;
+
+	osalDbgAssert(ps <= MTD_POOL_PAGE_SIZE, "pool page too small");
+
+	while (n > 0 && ret == HAL_SUCCESS) {
+		uint32_t poff = offset % ps;
+		uint32_t len = ps - poff;
+
+		if (poff == 0 && n >= ps) {
+			len = n - n % ps;
+			ret = blkRead(mtdp, offset / ps, buf, len / ps);
+		}
+		else {
+			if (len > n)
+				len = n;
+			if (page == NULL && (page = mtdPoolAllocPage()) == NULL) {
+				MTD_DEBUG("mtd: %s: no pool page", mtdGetName(mtdp));
+				return HAL_FAILED;
+			}
+			ret = blkRead(mtdp, offset / ps, page, 1);
+			memcpy(buf, page + poff, len);
+		}
+
+		offset += len;
+		buf += len;
+		n -= len;
+	}
+
+	if (page != NULL)
+		mtdPoolFreePage(page);
+	return ret;
+}
+
+/**
+ * @brief program bytes at any offset
+ * Other bytes of partial pages are padded with 0xff (left unchanged).
+ * Target range must be erased.
+ * @api
+ */
+bool mtdWriteBytes(BaseMTDDriver *mtdp, uint32_t offset, const uint8_t *buf, uint32_t n)
+{
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint8_t *page = NULL;
+	bool ret = HAL_SUCCESS;
+
+	osalDbgAssert(ps <= MTD_POOL_PAGE_SIZE, "pool page too small");
+
+	while (n > 0 && ret == HAL_SUCCESS) {
+		uint32_t poff = offset % ps;
+		uint32_t len = ps - poff;
+
+		if (poff == 0 && n >= ps) {
+			len = n - n % ps;
+			ret = blkWrite(mtdp, offset / ps, buf, len / ps);
+		}
+		else {
+			if (len > n)
+				len = n;
+			if (page == NULL && (page = mtdPoolAllocPage()) == NULL) {
+				MTD_DEBUG("mtd: %s: no pool page", mtdGetName(mtdp));
+				return HAL_FAILED;
+			}
+			memset(page, 0xff, ps);
+			memcpy(page + poff, buf, len);
+			ret = blkWrite(mtdp, offset / ps, page, 1);
+		}
+
+		offset += len;
+		buf += len;
+		n -= len;
+	}
+
+	if (page != NULL)
+		mtdPoolFreePage(page);
+	return ret;
+}
+
+/**
+ * @brief CRC-16/CCITT (poly 0x1021), start with 0xffff
+ * @api
+ */
+uint16_t mtdCrc16(uint16_t crc, const uint8_t *buf, size_t n)
+{
+	int i;
+
+	while (n--) {
+		crc ^= (uint16_t)*buf++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x8000)? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+/**
+ * @brief CRC-32 (IEEE 802.3, zlib crc32() compatible), start with 0
+ * @api
+ */
+uint32_t mtdCrc32(uint32_t crc, const uint8_t *buf, size_t n)
+{
+	static const uint32_t nibble_tbl[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+
+	crc = ~crc;
+	while (n--) {
+		crc ^= *buf++;
+		crc = (crc >> 4) ^ nibble_tbl[crc & 0x0f];
+		crc = (crc >> 4) ^ nibble_tbl[crc & 0x0f];
+	}
+
+	return ~crc;
+}
+
+/**
+ * @brief CRC-32 of flash range, read page by page
+ * @param[out] crcp mtdCrc32() of @p n bytes at @p offset
+ * @api
+ */
+bool mtdCalcCrc32(BaseMTDDriver *mtdp, uint32_t offset, uint32_t n, uint32_t *crcp)
+{
+	uint8_t *page = mtdPoolAllocPage();
+	uint32_t crc = 0;
+	bool ret = HAL_SUCCESS;
+
+	osalDbgCheck(crcp != NULL);
+
+	if (page == NULL) {
+		MTD_DEBUG("mtd: %s: no pool page", mtdGetName(mtdp));
+		return HAL_FAILED;
+	}
+
+	while (n > 0 && ret == HAL_SUCCESS) {
+		uint32_t len = (n < MTD_POOL_PAGE_SIZE)? n : MTD_POOL_PAGE_SIZE;
+
+		ret = mtdReadBytes(mtdp, offset, page, len);
+		crc = mtdCrc32(crc, page, len);
+		offset += len;
+		n -= len;
+	}
+
+	mtdPoolFreePage(page);
+	*crcp = crc;
+	return ret;
+}
+
+/*
+ * Flash to flash copy
+ */
+
+/**
+ * @brief true if buffer is in erased state
+ * @notapi
+ */
+static bool mtd_is_erased(const uint8_t *buf, uint32_t n)
+{
+	while (n--)
+		if (*buf++ != 0xff)
+			return false;
+
+	return true;
+}
+
+/**
+ * @brief erase block @p blk of @p mtdp unless it is already blank
+ * @p page is used for blank check reads.
+ * @notapi
+ */
+static bool mtd_copy_prepare(BaseMTDDriver *mtdp, uint32_t blk, uint8_t *page,
+		uint32_t *erasedp)
+{
+	uint32_t ps = mtdGetPageSize(mtdp);
+	uint32_t ppb = mtdGetEraseSize(mtdp) / ps;
+	uint32_t i;
+
+	for (i = 0; i < ppb; i++) {
+		if (blkRead(mtdp, blk * ppb + i, page, 1) == HAL_FAILED)
+			return HAL_FAILED;
+		if (!mtd_is_erased(page, ps))
+			break;
+	}
+
+	if (i == ppb)
+		return HAL_SUCCESS;
+
+	(*erasedp)++;
+	return mtdErase(mtdp, blk * ppb, ppb);
+}
+
+/**
+ * @brief copy @p n bytes from @p src to @p dst partition
+ *
+ * Data moves a destination page at a time through one pool page, padded
+ * with 0xff and programmed whole. When source and destination offsets
+ * differ in page alignment, mtdReadBytes() borrows a second page for
+ * the split source pages. Destination erase blocks that lie whole in
+ * the range are erased when copy enters them, only if they are not
+ * blank. Erased (all 0xff) source pages are not programmed.
+ *
+ * @pre Destination bytes in partial head and tail erase blocks are
+ *      erased; copy fails before programming them otherwise.
+ * Ranges may not overlap on the same chip.
+ *
+ * @param[in] verify    compare CRC-32 of written range with source data
+ * @return HAL_FAILED on bad range, no pool pages, I/O or verify error
+ * @api
+ */
+bool mtdCopy(BaseMTDDriver *src, uint32_t src_off, BaseMTDDriver *dst,
+		uint32_t dst_off, uint32_t n, bool verify)
+{
+	uint32_t ps = mtdGetPageSize(dst);
+	uint32_t es = mtdGetEraseSize(dst);
+	uint32_t blk_start = (dst_off + es - 1) / es;
+	uint32_t blk_end = (dst_off + n) / es;
+	uint32_t next_blk = blk_start;
+	uint32_t erased = 0, skipped = 0;
+	uint32_t crc = 0;
+	uint32_t done, len;
+	uint8_t *page;
+	bool ret = HAL_SUCCESS;
+
+	osalDbgCheck((src != NULL) && (dst != NULL));
+	osalDbgAssert(ps <= MTD_POOL_PAGE_SIZE, "pool page too small");
+
+	if (n == 0)
+		return HAL_SUCCESS;
+
+	if (src_off > mtdGetSize(src) || n > mtdGetSize(src) - src_off ||
+			dst_off > mtdGetSize(dst) || n > mtdGetSize(dst) - dst_off) {
+		MTD_DEBUG("mtd: copy %s -> %s: out of range", mtdGetName(src), mtdGetName(dst));
+		return HAL_FAILED;
+	}
+
+	/* partitions are one level below chip */
+	if ((src->parent != NULL? src->parent : src) == (dst->parent != NULL? dst->parent : dst)) {
+		uint32_t sa = src->start_page * mtdGetPageSize(src) + src_off;
+		uint32_t da = dst->start_page * ps + dst_off;
+
+		if (sa < da + n && da < sa + n) {
+			MTD_DEBUG("mtd: copy %s -> %s: ranges overlap", mtdGetName(src), mtdGetName(dst));
+			return HAL_FAILED;
+		}
+	}
+
+	page = mtdPoolAllocPage();
+	if (page == NULL) {
+		MTD_DEBUG("mtd: copy %s -> %s: no pool page", mtdGetName(src), mtdGetName(dst));
+		return HAL_FAILED;
+	}
+
+	for (done = 0; done < n && ret == HAL_SUCCESS; done += len) {
+		uint32_t d = dst_off + done;
+		uint32_t poff = d % ps;
+
+		len = ps - poff;
+		if (len > n - done)
+			len = n - done;
+
+		/* erase ahead: whole blocks starting in this chunk */
+		while (ret == HAL_SUCCESS && next_blk < blk_end && next_blk * es < d + len) {
+			ret = mtd_copy_prepare(dst, next_blk, page, &erased);
+			next_blk++;
+		}
+		if (ret == HAL_FAILED)
+			break;
+
+		/* partial head or tail block: caller erased it, check */
+		if (d < blk_start * es || d >= blk_end * es) {
+			ret = blkRead(dst, d / ps, page, 1);
+			if (ret == HAL_SUCCESS && !mtd_is_erased(page + poff, len)) {
+				MTD_DEBUG("mtd: copy %s -> %s: destination %" PRIu32 " not erased",
+						mtdGetName(src), mtdGetName(dst), d);
+				ret = HAL_FAILED;
+			}
+			if (ret == HAL_FAILED)
+				break;
+		}
+
+		memset(page, 0xff, ps);
+		ret = mtdReadBytes(src, src_off + done, page + poff, len);
+		if (ret == HAL_FAILED)
+			break;
+
+		if (verify)
+			crc = mtdCrc32(crc, page + poff, len);
+
+		if (mtd_is_erased(page + poff, len))
+			skipped++;
+		else
+			ret = blkWrite(dst, d / ps, page, 1);
+	}
+
+	mtdPoolFreePage(page);
+
+	if (ret == HAL_SUCCESS)
+		ret = blkSync(dst);
+
+	if (ret == HAL_SUCCESS && verify) {
+		uint32_t dst_crc;
+
+		ret = mtdCalcCrc32(dst, dst_off, n, &dst_crc);
+		if (ret == HAL_SUCCESS && dst_crc != crc) {
+			MTD_DEBUG("mtd: copy %s -> %s: verify failed", mtdGetName(src), mtdGetName(dst));
+			ret = HAL_FAILED;
+		}
+	}
+
+	MTD_DEBUG("mtd: copy %s:%" PRIu32 " -> %s:%" PRIu32 " %" PRIu32 ": %s, erased %" PRIu32
+			", skipped %" PRIu32, mtdGetName(src), src_off, mtdGetName(dst), dst_off, n,
+			(ret == HAL_SUCCESS)? "ok" : "failed", erased, skipped);
+	return ret;
+}
@@ -0,0 +1,43 @@
+/**
+ * @file       mtdutil.h
+ * @brief      FLASH25 byte granular I/O and checksum helpers
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef MTDUTIL_H
+#define MTDUTIL_H
+
+#include "flash-mtd.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	bool mtdReadBytes(BaseMTDDriver *mtdp, uint32_t offset, uint8_t *buf, uint32_t n);
+	bool mtdWriteBytes(BaseMTDDriver *mtdp, uint32_t offset, const uint8_t *buf, uint32_t n);
+	uint16_t mtdCrc16(uint16_t crc, const uint8_t *buf, size_t n);
+	uint32_t mtdCrc32(uint32_t crc, const uint8_t *buf, size_t n);
+	bool mtdCalcCrc32(BaseMTDDriver *mtdp, uint32_t offset, uint32_t n, uint32_t *crcp);
+	bool mtdCopy(BaseMTDDriver *src, uint32_t src_off, BaseMTDDriver *dst,
+			uint32_t dst_off, uint32_t n, bool verify);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MTDUTIL_H */
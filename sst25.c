@@ -48,6 +48,56 @@
 #error "Please select only one write method: FAST (AAI) or SLOW"
 #endif
 
+#if !defined(SST25_TIMEOUT_MARGIN)
+/* timeout = max operation time from device table * margin */
+#define SST25_TIMEOUT_MARGIN	4
+#endif
+
+#if !defined(SST25_POLL_MIN_US)
+/* first backoff step after expected time elapsed */
+#define SST25_POLL_MIN_US	2
+#endif
+
+/*
+ * SST25_POLLED_DELAY_US(us): platform sub-tick delay. Without it delays
+ * shorter than system tick yield instead, so program waits poll status
+ * back to back and only erase waits sleep whole ticks.
+ */
+
+#if !defined(SST25_WAIT_TIMESTAMP)
+/* completion time measurement; realtime counter gives sub-tick accuracy */
+#define SST25_WAIT_TIMESTAMP()	((uint32_t)osalOsGetSystemTimeX())
+#define SST25_WAIT_CLOCK_HZ	CH_CFG_ST_FREQUENCY
+#endif
+
+/*
+ * SST25_DEFERRED_COMPLETION: program/erase return while chip is busy,
+ * completion is checked before next command on chip or by blkSync().
+ */
+
+#if !defined(SST25_AAI_MIN_GAP)
+/* erased words which end AAI stream in sst25ProgramErased() */
+#define SST25_AAI_MIN_GAP	4
+#endif
+
+#if defined(SST25_USE_HOLD_STATS) && !defined(SST25_HOLD_TIMESTAMP)
+/* realtime counter (DWT cycle counter on Cortex-M) */
+#define SST25_HOLD_TIMESTAMP()	chSysGetRealtimeCounterX()
+#endif
+
+#if defined(SST25_USE_TRACE)
+#if !defined(SST25_TRACE_TIMESTAMP)
+/* realtime counter (DWT cycle counter on Cortex-M) */
+#define SST25_TRACE_TIMESTAMP()	chSysGetRealtimeCounterX()
+#endif
+#if !defined(SST25_TRACE_CLOCK_HZ)
+#error "SST25_TRACE_CLOCK_HZ must be set to SST25_TRACE_TIMESTAMP() frequency"
+#endif
+#if (SST25_TRACE_SIZE & (SST25_TRACE_SIZE - 1)) != 0
+#error "SST25_TRACE_SIZE must be power of two"
+#endif
+#endif /* SST25_USE_TRACE */
+
 /* Defines */
 
 #if !SPI_USE_MUTUAL_EXCLUSION
@@ -73,6 +123,8 @@
 #define CMD_JDEC_ID		0x9f
 #define CMD_EBSY		0x70
 #define CMD_DBSY		0x80
+#define CMD_ERASE_SUSPEND	0x75 /* Winbond/Macronix */
+#define CMD_ERASE_RESUME	0x7a
 
 /* SST25 status register bits */
 #define STAT_BUSY		(1<<0)
@@ -84,41 +136,201 @@
 #define STAT_AAI		(1<<6)
 #define STAT_BPL		(1<<7)
 
-#define FLASH_TIMEOUT	MS2ST(10)
-#define ERASE_TIMEOUT	MS2ST(100)
 #define SST25_PAGESZ	256
+#define SST25_TICK_US	(1000000UL / CH_CFG_ST_FREQUENCY)
 
 /*
  * Supported device table
  */
 
-#define INFO(name_, id_, ps_, es_, nr_)		{ name_, id_, ps_, es_, nr_ }
+#define INFO(name_, id_, ps_, es_, nr_, tm_, fl_, sus_, res_)	\
+	{ name_, id_, ps_, es_, nr_, tm_, fl_, sus_, res_ }
+#define TIMING(typ_, max_)			{ typ_, max_ }
+
+/* device capabilities */
+#define LL_AAI			(1<<0) /* AAI word program (SST) */
+#define LL_ERASE_SUSPEND	(1<<1) /* sector erase suspend/resume */
+
+struct sst25_ll_timing {
+	uint32_t typ_us;
+	uint32_t max_us;
+};
+
 struct sst25_ll_info {
 	const char *name;
 	uint32_t jdec_id;
 	uint16_t page_size;
 	uint16_t erase_size;
 	uint32_t nr_pages;
+	const struct sst25_ll_timing *timing; /* indexed by enum sst25_op */
+	uint8_t flags;
+	uint16_t suspend_us;	/* suspend latency (max) */
+	uint16_t resume_us;	/* resume to next suspend (min) */
+};
+
+/* SST25VF016B/032B: Tbp 10 us, Tse/Tbe 25 ms, Tsce 50 ms */
+static const struct sst25_ll_timing sst25vf_timing[SST25_OP_NR] = {
+	[SST25_OP_PROGRAM] = TIMING(7, 10),
+	[SST25_OP_ERASE_SECTOR] = TIMING(18000, 25000),
+	[SST25_OP_ERASE_CHIP] = TIMING(35000, 50000)
+};
+
+/* W25Q32JV/64JV: tBP1 50 us, tSE 400 ms, tCE 50/100 s, tSUS 20 us */
+static const struct sst25_ll_timing w25q32_timing[SST25_OP_NR] = {
+	[SST25_OP_PROGRAM] = TIMING(30, 50),
+	[SST25_OP_ERASE_SECTOR] = TIMING(45000, 400000),
+	[SST25_OP_ERASE_CHIP] = TIMING(10000000, 50000000)
+};
+
+static const struct sst25_ll_timing w25q64_timing[SST25_OP_NR] = {
+	[SST25_OP_PROGRAM] = TIMING(30, 50),
+	[SST25_OP_ERASE_SECTOR] = TIMING(45000, 400000),
+	[SST25_OP_ERASE_CHIP] = TIMING(20000000, 100000000)
 };
 
+/* MX25L3233F: tBP 30 us, tSE 200 ms, tCE 50 s, tESL 20 us */
+static const struct sst25_ll_timing mx25l32_timing[SST25_OP_NR] = {
+	[SST25_OP_PROGRAM] = TIMING(12, 30),
+	[SST25_OP_ERASE_SECTOR] = TIMING(40000, 200000),
+	[SST25_OP_ERASE_CHIP] = TIMING(25000000, 50000000)
+};
+
+/* resume to next suspend: conservative 100 us for erase to progress */
 static const struct sst25_ll_info sst25_ll_info_table[] = {
-	INFO("sst25vf016b", 0xbf2541, SST25_PAGESZ, 4096, 16*1024*1024/8/SST25_PAGESZ),
-	INFO("sst25vf032b", 0xbf254a, SST25_PAGESZ, 4096, 32*1024*1024/8/SST25_PAGESZ)
+	INFO("sst25vf016b", 0xbf2541, SST25_PAGESZ, 4096, 16*1024*1024/8/SST25_PAGESZ, sst25vf_timing,
+			LL_AAI, 0, 0),
+	INFO("sst25vf032b", 0xbf254a, SST25_PAGESZ, 4096, 32*1024*1024/8/SST25_PAGESZ, sst25vf_timing,
+			LL_AAI, 0, 0),
+	INFO("w25q32", 0xef4016, SST25_PAGESZ, 4096, 32*1024*1024/8/SST25_PAGESZ, w25q32_timing,
+			LL_ERASE_SUSPEND, 20, 100),
+	INFO("w25q64", 0xef4017, SST25_PAGESZ, 4096, 64*1024*1024/8/SST25_PAGESZ, w25q64_timing,
+			LL_ERASE_SUSPEND, 20, 100),
+	INFO("mx25l3233f", 0xc22016, SST25_PAGESZ, 4096, 32*1024*1024/8/SST25_PAGESZ, mx25l32_timing,
+			LL_ERASE_SUSPEND, 20, 100)
 };
 
+/*
+ * Transaction trace
+ */
+
+#if defined(SST25_USE_TRACE)
+#define TRACE_MAX_DEV		8
+
+static struct sst25_trace_buffer sst25_trace = {
+	.magic = SST25_TRACE_MAGIC,
+	.clock_hz = SST25_TRACE_CLOCK_HZ,
+	.size = SST25_TRACE_SIZE
+};
+
+static SPIDriver *sst25_trace_devs[TRACE_MAX_DEV];
+
+/**
+ * @brief record trace entry, ends now
+ * @notapi
+ */
+static void sst25_trace_add(SPIDriver *spip, uint8_t op, uint32_t addr,
+		uint32_t len, uint32_t start)
+{
+	uint32_t end = SST25_TRACE_TIMESTAMP();
+	uint32_t idx = __atomic_fetch_add(&sst25_trace.head, 1, __ATOMIC_RELAXED);
+	struct sst25_trace_entry *ep = &sst25_trace.entry[idx & (SST25_TRACE_SIZE - 1)];
+	uint8_t dev;
+
+	for (dev = 0; dev < TRACE_MAX_DEV - 1; dev++) {
+		if (sst25_trace_devs[dev] == spip)
+			break;
+		if (sst25_trace_devs[dev] == NULL) {
+			sst25_trace_devs[dev] = spip;
+			break;
+		}
+	}
+
+	ep->start = start;
+	ep->end = end;
+	ep->addr = addr;
+	ep->len = len;
+	ep->op = op;
+	ep->dev = dev;
+	ep->reserved = 0;
+}
+
+#define TRACE_START()					SST25_TRACE_TIMESTAMP()
+#define TRACE(spip, op, addr, len, start)		sst25_trace_add(spip, op, addr, len, start)
+#else
+#define TRACE_START()					0
+#define TRACE(spip, op, addr, len, start)		(void)(start)
+#endif /* SST25_USE_TRACE */
+
+/**
+ * @brief address field of command buffer (0 if none)
+ * @notapi
+ */
+static inline uint32_t sst25_ll_cmd_addr(const uint8_t *cmd, size_t len)
+{
+	return (len >= 4)? (cmd[1] << 16) | (cmd[2] << 8) | cmd[3] : 0;
+}
+
 /*
  * Low level flash interface
  */
 
+/**
+ * @brief acquire SPI bus, starts bus hold measurement
+ * @param[in] flp chip driver (not partition)
+ * @notapi
+ */
+static inline uint32_t sst25_ll_acquire(SST25Driver *flp)
+{
+	spiAcquireBus(flp->config->spip);
+#if defined(SST25_USE_HOLD_STATS)
+	return SST25_HOLD_TIMESTAMP();
+#else
+	return 0;
+#endif
+}
+
+/**
+ * @brief release SPI bus, records worst bus hold
+ * @notapi
+ */
+static inline void sst25_ll_release(SST25Driver *flp, uint32_t hold_start)
+{
+#if defined(SST25_USE_HOLD_STATS)
+	uint32_t hold = SST25_HOLD_TIMESTAMP() - hold_start;
+
+	if (hold > flp->max_hold)
+		flp->max_hold = hold;
+#else
+	(void)hold_start;
+#endif
+	spiReleaseBus(flp->config->spip);
+}
+
+/**
+ * @brief data bytes of next read transfer, limited by SST25Config.max_chunk
+ * @notapi
+ */
+static inline uint32_t sst25_ll_chunk(SST25Driver *flp, uint32_t nbytes)
+{
+	uint32_t max = flp->config->max_chunk;
+
+	return (max != 0 && nbytes > max)? max : nbytes;
+}
+
 /**
  * @brief SPI-Flash transfer function
+ * @param[in] flp chip driver (not partition)
  * @notapi
  */
-static void sst25_ll_transfer(const SST25Config *cfg,
+static void sst25_ll_transfer(SST25Driver *flp,
 		const uint8_t *txbuf, size_t txlen,
 		uint8_t *rxbuf, size_t rxlen)
 {
-	spiAcquireBus(cfg->spip);
+	const SST25Config *cfg = flp->config;
+	uint32_t hold, start;
+
+	hold = sst25_ll_acquire(flp);
+	start = TRACE_START();
 
 	spiStart(cfg->spip, cfg->spicfg);
 	spiSelect(cfg->spip);
@@ -127,38 +339,153 @@ static void sst25_ll_transfer(const SST25Config *cfg,
 		spiReceive(cfg->spip, rxlen, rxbuf);
 	spiUnselect(cfg->spip);
 
-	spiReleaseBus(cfg->spip);
+	TRACE(cfg->spip, txbuf[0], sst25_ll_cmd_addr(txbuf, txlen), txlen + rxlen, start);
+	sst25_ll_release(flp, hold);
 }
 
 /**
  * @brief checks busy flag
  * @notapi
  */
-static bool sst25_ll_is_busy(const SST25Config *cfg)
+static bool sst25_ll_is_busy(SST25Driver *flp)
 {
 	uint8_t cmd = CMD_RDSR;
 	uint8_t stat;
 
-	sst25_ll_transfer(cfg, &cmd, 1, &stat, 1);
+	sst25_ll_transfer(flp, &cmd, 1, &stat, 1);
 	return !!(stat & STAT_BUSY);
 }
 
 /**
- * @brief wait write completion
+ * @brief sleep or delay without holding the bus
+ * Rounds up to system ticks. Shorter delays use SST25_POLLED_DELAY_US()
+ * if defined, otherwise just yield: a tick is far longer than byte or
+ * word program time.
+ * @notapi
+ */
+static void sst25_ll_delay_us(uint32_t us)
+{
+	if (us == 0)
+		return;
+	if (us < SST25_TICK_US) {
+#if defined(SST25_POLLED_DELAY_US)
+		SST25_POLLED_DELAY_US(us);
+#else
+		chThdYield();
+#endif
+		return;
+	}
+	chThdSleep((us + SST25_TICK_US - 1) / SST25_TICK_US);
+}
+
+/**
+ * @brief microseconds since SST25_WAIT_TIMESTAMP() @p since
+ * @notapi
+ */
+static inline uint32_t sst25_ll_elapsed_us(uint32_t since)
+{
+	uint32_t d = SST25_WAIT_TIMESTAMP() - since;
+
+#if SST25_WAIT_CLOCK_HZ >= 1000000
+	return d / (SST25_WAIT_CLOCK_HZ / 1000000);
+#else
+	return d * (1000000 / SST25_WAIT_CLOCK_HZ);
+#endif
+}
+
+/**
+ * @brief microseconds to system ticks, rounded up
+ * US2ST() and MS2ST() multiply in 32 bits and overflow for erase times
+ * once CH_CFG_ST_FREQUENCY is above some kHz.
+ * @notapi
+ */
+static systime_t sst25_ll_us2st(uint32_t us)
+{
+	return (systime_t)(((uint64_t)us * CH_CFG_ST_FREQUENCY + 999999) / 1000000);
+}
+
+/**
+ * @brief wait operation completion
+ * Waits rest of expected time of @p op, then polls with exponential backoff.
+ * Expectation is refined from each completion: lowered when first poll
+ * after expected time finds chip ready, otherwise raised by half of
+ * measured overrun. Nothing is learned when caller came after expected
+ * time and chip was ready, or when erase was suspended.
+ *
+ * @param[in] flp chip driver (not partition)
+ * @param[in] since SST25_WAIT_TIMESTAMP() of command
  * @return HAL_FAILED if timeout occurs
  * @notapi
  */
-static bool sst25_ll_wait_complete(const SST25Config *cfg, systime_t timeout)
+static bool sst25_ll_wait_complete(SST25Driver *flp, enum sst25_op op,
+		uint32_t since)
 {
+	const struct sst25_ll_timing *tp = &flp->info->timing[op];
+	uint32_t est_us = flp->wait_est_us[op];
+	uint32_t elapsed_us = sst25_ll_elapsed_us(since);
+	uint32_t backoff_us = SST25_POLL_MIN_US;
+	bool learn = true;
+	bool first = true;
+	systime_t timeout = sst25_ll_us2st(tp->max_us * SST25_TIMEOUT_MARGIN) + 1;
 	systime_t start = osalOsGetSystemTimeX();
-	while (sst25_ll_is_busy(cfg)) {
-		systime_t now = osalOsGetSystemTimeX();
-		if (now - start >= timeout)
+	uint32_t gen = flp->suspend_gen;
+	uint32_t tstart = TRACE_START();
+
+	if (est_us > elapsed_us)
+		sst25_ll_delay_us(est_us - elapsed_us);
+	else
+		learn = false;
+
+	for (;;) {
+		uint32_t g = flp->suspend_gen;
+		systime_t now;
+
+		/* suspended erase is not busy, but not complete either */
+		if (!sst25_ll_is_busy(flp) && !flp->suspended && g == flp->suspend_gen)
+			break;
+
+		if (first) {
+			/* chip busy after expected time, overrun is measured */
+			first = false;
+			learn = true;
+		}
+
+		now = osalOsGetSystemTimeX();
+		if (g != gen) {
+			/* erase was suspended for a read, time does not count */
+			gen = g;
+			start = now;
+			learn = false;
+		}
+
+		if (now - start >= timeout) {
+			TRACE(flp->config->spip, SST25_TRACE_OP_WAIT, op, 0, tstart);
 			return HAL_FAILED; /* Timeout */
+		}
 
-		chThdYield();
+		sst25_ll_delay_us(backoff_us);
+		if (backoff_us < est_us / 8)
+			backoff_us *= 2;
 	}
 
+	if (!learn)
+		; /* nothing learned */
+	else if (first)
+		est_us -= est_us / 16;
+	else {
+		uint32_t taken_us = sst25_ll_elapsed_us(since);
+
+		/* below timestamp resolution: grow by minimal step */
+		est_us += ((taken_us > est_us)? taken_us - est_us : SST25_POLL_MIN_US) / 2;
+	}
+
+	if (est_us < tp->typ_us / 4)
+		est_us = tp->typ_us / 4;
+	else if (est_us > tp->max_us)
+		est_us = tp->max_us;
+
+	flp->wait_est_us[op] = est_us;
+	TRACE(flp->config->spip, SST25_TRACE_OP_WAIT, op, 0, tstart);
 	return HAL_SUCCESS;
 }
 
@@ -166,29 +493,29 @@ static bool sst25_ll_wait_complete(const SST25Config *cfg, systime_t timeout)
  * @brief write status register (disable block protection)
  * @notapi
  */
-static void sst25_ll_wrsr(const SST25Config *cfg, uint8_t sr)
+static void sst25_ll_wrsr(SST25Driver *flp, uint8_t sr)
 {
 	uint8_t cmd[2];
 
 	cmd[0] = CMD_EWSR;
-	sst25_ll_transfer(cfg, cmd, 1, NULL, 0);
+	sst25_ll_transfer(flp, cmd, 1, NULL, 0);
 
 	cmd[0] = CMD_WRSR;
 	cmd[1] = sr;
-	sst25_ll_transfer(cfg, cmd, 2, NULL, 0);
+	sst25_ll_transfer(flp, cmd, 2, NULL, 0);
 }
 
 /**
  * @brief read JDEC ID from device
  * @notapi
  */
-static uint32_t sst25_ll_get_jdec_id(const SST25Config *cfg)
+static uint32_t sst25_ll_get_jdec_id(SST25Driver *flp)
 {
 	uint8_t cmd = CMD_JDEC_ID;
 	uint8_t jdec[3];
 
 	/* JDEC: 3 bytes */
-	sst25_ll_transfer(cfg, &cmd, 1, jdec, sizeof(jdec));
+	sst25_ll_transfer(flp, &cmd, 1, jdec, sizeof(jdec));
 	return (jdec[0] << 16) | (jdec[1] << 8) | jdec[2];
 }
 
@@ -207,31 +534,47 @@ static void sst25_ll_prepare_cmd(uint8_t *buff, uint8_t cmd, uint32_t addr)
 #ifdef SST25_SLOW_READ
 /**
  * @brief Normal read (F_clk < 25 MHz)
+ * Split into SST25Config.max_chunk transfers, bus is released between them.
  * @notapi
  */
-static void sst25_ll_read(const SST25Config *cfg, uint32_t addr,
+static void sst25_ll_read(SST25Driver *flp, uint32_t addr,
 		uint8_t *buffer, uint32_t nbytes)
 {
 	uint8_t cmd[4];
 
-	sst25_ll_prepare_cmd(cmd, CMD_READ, addr);
-	sst25_ll_transfer(cfg, cmd, sizeof(cmd), buffer, nbytes);
+	while (nbytes > 0) {
+		uint32_t len = sst25_ll_chunk(flp, nbytes);
+
+		sst25_ll_prepare_cmd(cmd, CMD_READ, addr);
+		sst25_ll_transfer(flp, cmd, sizeof(cmd), buffer, len);
+		addr += len;
+		buffer += len;
+		nbytes -= len;
+	}
 }
 #endif /* SST25_SLOW_READ */
 
 #ifdef SST25_FAST_READ
 /**
  * @brief Fast read (F_clk < 80 MHz)
+ * Split into SST25Config.max_chunk transfers, bus is released between them.
  * @notapi
  */
-static void sst25_ll_fast_read(const SST25Config *cfg, uint32_t addr,
+static void sst25_ll_fast_read(SST25Driver *flp, uint32_t addr,
 		uint8_t *buffer, uint32_t nbytes)
 {
 	uint8_t cmd[5];
 
-	sst25_ll_prepare_cmd(cmd, CMD_FAST_READ, addr);
-	cmd[4] = 0xa5; /* dummy byte */
-	sst25_ll_transfer(cfg, cmd, sizeof(cmd), buffer, nbytes);
+	while (nbytes > 0) {
+		uint32_t len = sst25_ll_chunk(flp, nbytes);
+
+		sst25_ll_prepare_cmd(cmd, CMD_FAST_READ, addr);
+		cmd[4] = 0xa5; /* dummy byte */
+		sst25_ll_transfer(flp, cmd, sizeof(cmd), buffer, len);
+		addr += len;
+		buffer += len;
+		nbytes -= len;
+	}
 }
 #endif /* SST25_FAST_READ */
 
@@ -239,46 +582,300 @@ static void sst25_ll_fast_read(const SST25Config *cfg, uint32_t addr,
  * @brief Set/Reset write lock
  * @notapi
  */
-static void sst25_ll_wrlock(const SST25Config *cfg, bool lock)
+static void sst25_ll_wrlock(SST25Driver *flp, bool lock)
 {
 	uint8_t cmd = (lock)? CMD_WRDI : CMD_WREN;
-	sst25_ll_transfer(cfg, &cmd, 1, NULL, 0);
+	sst25_ll_transfer(flp, &cmd, 1, NULL, 0);
+}
+
+/**
+ * @brief finish program or erase command @p op
+ * With SST25_DEFERRED_COMPLETION only marks chip busy and returns,
+ * wait and WRDI are done by sst25_ll_settle() before next command.
+ *
+ * @param[in] flp chip driver (not partition)
+ * @return HAL_FAILED if timeout occurs
+ * @notapi
+ */
+static bool sst25_ll_complete(SST25Driver *flp, enum sst25_op op)
+{
+#ifdef SST25_DEFERRED_COMPLETION
+	flp->busy_op = op;
+	flp->busy_since = SST25_WAIT_TIMESTAMP();
+	return HAL_SUCCESS;
+#else
+	uint32_t since = SST25_WAIT_TIMESTAMP();
+	bool ret;
+
+	flp->busy_op = op;
+	ret = sst25_ll_wait_complete(flp, op, since);
+	sst25_ll_wrlock(flp, true);
+	flp->busy_op = SST25_OP_NR;
+	return ret;
+#endif
+}
+
+/**
+ * @brief sector erase in progress can be suspended for read
+ * Erase is in progress when deferred, or when other thread waits for it.
+ * @notapi
+ */
+static bool sst25_ll_can_suspend(SST25Driver *flp)
+{
+	return (flp->info->flags & LL_ERASE_SUSPEND) &&
+		flp->busy_op == SST25_OP_ERASE_SECTOR &&
+		sst25_ll_is_busy(flp);
+}
+
+/**
+ * @brief suspend sector erase
+ * Keeps resume_us of device table since last resume, so erase progresses,
+ * then waits suspend latency. Erase completed meanwhile is fine.
+ *
+ * @return HAL_FAILED if chip stays busy
+ * @notapi
+ */
+static bool sst25_ll_suspend(SST25Driver *flp)
+{
+	const struct sst25_ll_info *ip = flp->info;
+	systime_t gap = sst25_ll_us2st(ip->resume_us) + 1;
+	systime_t timeout = sst25_ll_us2st(ip->suspend_us * SST25_TIMEOUT_MARGIN) + 1;
+	systime_t start;
+	uint8_t cmd = CMD_ERASE_SUSPEND;
+
+	while (osalOsGetSystemTimeX() - flp->resumed_at < gap)
+		chThdSleep(1);
+
+	/* before command: erase waiter must not take suspended chip as idle */
+	flp->suspended = true;
+	flp->suspend_gen++;
+	sst25_ll_transfer(flp, &cmd, 1, NULL, 0);
+
+	start = osalOsGetSystemTimeX();
+	sst25_ll_delay_us(ip->suspend_us);
+	while (sst25_ll_is_busy(flp)) {
+		if (osalOsGetSystemTimeX() - start >= timeout) {
+			MTD_DEBUG("sst25: %s: suspend timeout", mtdGetName(flp));
+			return HAL_FAILED;
+		}
+		sst25_ll_delay_us(SST25_POLL_MIN_US);
+	}
+
+	return HAL_SUCCESS;
+}
+
+/**
+ * @brief resume suspended erase
+ * @notapi
+ */
+static void sst25_ll_resume(SST25Driver *flp)
+{
+	uint8_t cmd = CMD_ERASE_RESUME;
+
+	sst25_ll_transfer(flp, &cmd, 1, NULL, 0);
+	flp->resumed_at = osalOsGetSystemTimeX();
+	flp->suspended = false;
+}
+
+/**
+ * @brief wait for deferred program or erase of chip
+ * Called before any command on chip (including from sibling partitions).
+ *
+ * @param[in] flp chip driver (not partition)
+ * @return HAL_FAILED if deferred operation timed out
+ * @notapi
+ */
+static bool sst25_ll_settle(SST25Driver *flp)
+{
+#ifdef SST25_DEFERRED_COMPLETION
+	bool ret;
+
+	if (flp->busy_op == SST25_OP_NR)
+		return HAL_SUCCESS;
+
+	ret = sst25_ll_wait_complete(flp, flp->busy_op, flp->busy_since);
+	sst25_ll_wrlock(flp, true);
+	flp->busy_op = SST25_OP_NR;
+
+	if (ret == HAL_FAILED)
+		MTD_DEBUG("sst25: %s: deferred operation timeout", mtdGetName(flp));
+	return ret;
+#else
+	(void)flp;
+	return HAL_SUCCESS;
+#endif
+}
+
+/**
+ * @brief make chip readable
+ * Sector erase is suspended if chip can do it and reading thread has
+ * SST25Config.suspend_prio, readers which come meanwhile join the
+ * suspension, last of them resumes. Otherwise read waits for program
+ * or erase, deferred or waited for by other thread.
+ *
+ * @return HAL_FAILED if suspend or deferred operation failed
+ * @notapi
+ */
+static bool sst25_ll_read_begin(SST25Driver *flp)
+{
+	bool ret = HAL_SUCCESS;
+
+	osalMutexLock(&flp->suspend_lock);
+	if (flp->suspend_users > 0) {
+		flp->suspend_users++;
+		osalMutexUnlock(&flp->suspend_lock);
+		return HAL_SUCCESS;
+	}
+
+	if (chThdGetPriorityX() >= flp->config->suspend_prio && sst25_ll_can_suspend(flp)) {
+		ret = sst25_ll_suspend(flp);
+		if (ret == HAL_SUCCESS)
+			flp->suspend_users = 1;
+		else
+			sst25_ll_resume(flp);
+		osalMutexUnlock(&flp->suspend_lock);
+		return ret;
+	}
+	osalMutexUnlock(&flp->suspend_lock);
+
+#ifdef SST25_DEFERRED_COMPLETION
+	return sst25_ll_settle(flp);
+#else
+	/* other thread waits for its command to complete */
+	while (flp->busy_op != SST25_OP_NR)
+		chThdSleep(1);
+
+	return HAL_SUCCESS;
+#endif
+}
+
+/**
+ * @brief read done, last reader resumes suspended erase
+ * @notapi
+ */
+static void sst25_ll_read_end(SST25Driver *flp)
+{
+	osalMutexLock(&flp->suspend_lock);
+	if (flp->suspend_users > 0 && --flp->suspend_users == 0)
+		sst25_ll_resume(flp);
+	osalMutexUnlock(&flp->suspend_lock);
+}
+
+/**
+ * @brief word of [start, end) data window at even @p addr, 0xff outside
+ * @notapi
+ */
+static inline uint16_t sst25_ll_word_at(const uint8_t *data, uint32_t start,
+		uint32_t end, uint32_t addr)
+{
+	uint8_t lo = (addr >= start && addr < end)? data[addr - start] : 0xff;
+	uint8_t hi = (addr + 1 >= start && addr + 1 < end)? data[addr + 1 - start] : 0xff;
+
+	return lo | (hi << 8);
+}
+
+/**
+ * @brief program erased range with long AAI streams
+ * Stream continues over erased words unless SST25_AAI_MIN_GAP of them
+ * follow in a row. Odd head/tail are padded with 0xff (left unchanged).
+ *
+ * @return HAL_FAILED if timeout occurs
+ * @notapi
+ */
+static bool sst25_ll_program_erased(SST25Driver *flp, uint32_t start,
+		const uint8_t *data, uint32_t nbytes)
+{
+	uint32_t end = start + nbytes;
+	uint32_t addr = start & ~1UL;
+	uint8_t cmd[6];
+
+	while (addr < end) {
+		uint32_t gap;
+		uint16_t w;
+
+		w = sst25_ll_word_at(data, start, end, addr);
+		if (w == 0xffff) {
+			addr += 2;
+			continue;
+		}
+
+		if (sst25_ll_settle(flp) == HAL_FAILED)
+			return HAL_FAILED;
+
+		/* first word with address */
+		sst25_ll_prepare_cmd(cmd, CMD_AAI_WORD_PROG, addr);
+		cmd[4] = w & 0xff;
+		cmd[5] = w >> 8;
+		sst25_ll_wrlock(flp, false);
+		sst25_ll_transfer(flp, cmd, 6, NULL, 0);
+
+		for (;;) {
+			addr += 2;
+
+			/* look ahead: long erased run or end of data ends stream */
+			for (gap = 0; gap < SST25_AAI_MIN_GAP && addr + 2 * gap < end; gap++)
+				if (sst25_ll_word_at(data, start, end, addr + 2 * gap) != 0xffff)
+					break;
+			if (gap == SST25_AAI_MIN_GAP || addr + 2 * gap >= end)
+				break;
+
+			if (sst25_ll_wait_complete(flp, SST25_OP_PROGRAM,
+						SST25_WAIT_TIMESTAMP()) == HAL_FAILED) {
+				sst25_ll_wrlock(flp, true);
+				return HAL_FAILED;
+			}
+
+			w = sst25_ll_word_at(data, start, end, addr);
+			cmd[1] = w & 0xff;
+			cmd[2] = w >> 8;
+			sst25_ll_transfer(flp, cmd, 3, NULL, 0); /* CMD_AAI_WORD_PROG */
+		}
+
+		/* last word of stream */
+		if (sst25_ll_complete(flp, SST25_OP_PROGRAM) == HAL_FAILED)
+			return HAL_FAILED;
+	}
+
+	return HAL_SUCCESS;
 }
 
 /**
  * @brief Enables/Disables SO as hw busy pin
  * @notapi
  */
-static void sst25_ll_hw_busy(const SST25Config *cfg, bool enable)
+static void sst25_ll_hw_busy(SST25Driver *flp, bool enable)
 {
 	uint8_t cmd = (enable)? CMD_EBSY : CMD_DBSY;
-	sst25_ll_transfer(cfg, &cmd, 1, NULL, 0);
+	sst25_ll_transfer(flp, &cmd, 1, NULL, 0);
 }
 
-#ifdef SST25_SLOW_WRITE
 /**
  * @brief Slow write (one byte per cycle)
+ * Also used for parts without AAI.
  * @return HAL_FAILED if timeout occurs
  * @notapi
  */
-static bool sst25_ll_write_byte(const SST25Config *cfg, uint32_t addr,
+static bool sst25_ll_write_byte(SST25Driver *flp, uint32_t addr,
 		const uint8_t *buffer, uint32_t nbytes)
 {
 	uint8_t cmd[5];
-	bool ret;
+	bool ret = HAL_SUCCESS;
 
 	for (; nbytes > 0; nbytes--, buffer++, addr++) {
 		/* skip bytes equal to erased state */
 		if (*buffer == 0xff)
 			continue;
 
+		ret = sst25_ll_settle(flp);
+		if (ret == HAL_FAILED)
+			break;
+
 		sst25_ll_prepare_cmd(cmd, CMD_BYTE_PROG, addr);
 		cmd[4] = *buffer;
 
-		sst25_ll_wrlock(cfg, false);
-		sst25_ll_transfer(cfg, cmd, sizeof(cmd), NULL, 0);
-		ret = sst25_ll_wait_complete(cfg, FLASH_TIMEOUT);
-		sst25_ll_wrlock(cfg, true);
+		sst25_ll_wrlock(flp, false);
+		sst25_ll_transfer(flp, cmd, sizeof(cmd), NULL, 0);
+		ret = sst25_ll_complete(flp, SST25_OP_PROGRAM);
 
 		if (ret == HAL_FAILED)
 			break;
@@ -286,7 +883,6 @@ static bool sst25_ll_write_byte(const SST25Config *cfg, uint32_t addr,
 
 	return ret;
 }
-#endif /* SST25_SLOW_WRITE */
 
 #ifdef SST25_FAST_WRITE
 /**
@@ -296,10 +892,12 @@ static bool sst25_ll_write_byte(const SST25Config *cfg, uint32_t addr,
  * @return HAL_FAILED if timeout occurs
  * @notapi
  */
-static bool sst25_ll_write_word(const SST25Config *cfg, uint32_t addr,
+static bool sst25_ll_write_word(SST25Driver *flp, uint32_t addr,
 		const uint8_t *buff, uint32_t nbytes)
 {
+	const SST25Config *cfg = flp->config;
 	uint32_t nwords = (nbytes + 1) / 2;
+	uint32_t hold, start;
 	uint8_t cmd[4];
 
 	while (nwords > 0) {
@@ -313,10 +911,14 @@ static bool sst25_ll_write_word(const SST25Config *cfg, uint32_t addr,
 		if (nwords == 0)
 			return HAL_SUCCESS; /* all data written */
 
+		if (sst25_ll_settle(flp) == HAL_FAILED)
+			return HAL_FAILED;
+
 		sst25_ll_prepare_cmd(cmd, CMD_AAI_WORD_PROG, addr);
-		sst25_ll_wrlock(cfg, false);
+		sst25_ll_wrlock(flp, false);
 
-		spiAcquireBus(cfg->spip);
+		hold = sst25_ll_acquire(flp);
+		start = TRACE_START();
 
 		spiStart(cfg->spip, cfg->spicfg);
 		spiSelect(cfg->spip);
@@ -324,20 +926,23 @@ static bool sst25_ll_write_word(const SST25Config *cfg, uint32_t addr,
 		spiSend(cfg->spip, 2, buff);
 		spiUnselect(cfg->spip);
 
-		spiReleaseBus(cfg->spip);
-
-		if (sst25_ll_wait_complete(cfg, FLASH_TIMEOUT) == HAL_FAILED) {
-			sst25_ll_wrlock(cfg, true);
-			return HAL_FAILED;
-		}
+		TRACE(cfg->spip, CMD_AAI_WORD_PROG, addr, sizeof(cmd) + 2, start);
+		sst25_ll_release(flp, hold);
 
 		nwords--;
 		addr += 2;
 		buff += 2;
 
-		/* write 16-bit cunks */
+		/* write 16-bit cunks, bus is free while each one programs */
 		while (nwords > 0 && (buff[0] != 0xff && buff[1] != 0xff)) {
-			spiAcquireBus(cfg->spip);
+			if (sst25_ll_wait_complete(flp, SST25_OP_PROGRAM,
+						SST25_WAIT_TIMESTAMP()) == HAL_FAILED) {
+				sst25_ll_wrlock(flp, true);
+				return HAL_FAILED;
+			}
+
+			hold = sst25_ll_acquire(flp);
+			start = TRACE_START();
 
 			spiStart(cfg->spip, cfg->spicfg);
 			spiSelect(cfg->spip);
@@ -345,48 +950,55 @@ static bool sst25_ll_write_word(const SST25Config *cfg, uint32_t addr,
 			spiSend(cfg->spip, 2, buff);
 			spiUnselect(cfg->spip);
 
-			spiReleaseBus(cfg->spip);
-
-			if (sst25_ll_wait_complete(cfg, FLASH_TIMEOUT) == HAL_FAILED) {
-				sst25_ll_wrlock(cfg, true);
-				return HAL_FAILED;
-			}
+			TRACE(cfg->spip, CMD_AAI_WORD_PROG, addr, 1 + 2, start);
+			sst25_ll_release(flp, hold);
 
 			nwords--;
 			addr += 2;
 			buff += 2;
 		}
 
-		sst25_ll_wrlock(cfg, true);
+		/* last word of stream */
+		if (sst25_ll_complete(flp, SST25_OP_PROGRAM) == HAL_FAILED)
+			return HAL_FAILED;
 	}
 
 	return HAL_SUCCESS;
 }
 #endif /* SST25_FAST_WRITE */
 
-static bool sst25_ll_chip_erase(const SST25Config *cfg)
+static bool sst25_ll_chip_erase(SST25Driver *flp)
 {
 	uint8_t cmd = CMD_CHIP_ERASE;
-	bool ret;
 
-	sst25_ll_wrlock(cfg, false);
-	sst25_ll_transfer(cfg, &cmd, 1, NULL, 0);
-	ret = sst25_ll_wait_complete(cfg, ERASE_TIMEOUT);
-	sst25_ll_wrlock(cfg, true);
-	return ret;
+	if (sst25_ll_settle(flp) == HAL_FAILED)
+		return HAL_FAILED;
+
+	sst25_ll_wrlock(flp, false);
+	sst25_ll_transfer(flp, &cmd, 1, NULL, 0);
+	return sst25_ll_complete(flp, SST25_OP_ERASE_CHIP);
 }
 
-static bool sst25_ll_erase_block(const SST25Config *cfg, uint32_t addr)
+static bool sst25_ll_erase_block(SST25Driver *flp, uint32_t addr)
 {
 	uint8_t cmd[4];
-	bool ret;
+
+	if (sst25_ll_settle(flp) == HAL_FAILED)
+		return HAL_FAILED;
 
 	sst25_ll_prepare_cmd(cmd, CMD_ERASE_4K, addr);
-	sst25_ll_wrlock(cfg, false);
-	sst25_ll_transfer(cfg, cmd, sizeof(cmd), NULL, 0);
-	ret = sst25_ll_wait_complete(cfg, ERASE_TIMEOUT);
-	sst25_ll_wrlock(cfg, true);
-	return ret;
+	sst25_ll_wrlock(flp, false);
+	sst25_ll_transfer(flp, cmd, sizeof(cmd), NULL, 0);
+	return sst25_ll_complete(flp, SST25_OP_ERASE_SECTOR);
+}
+
+/**
+ * @brief get chip driver of partition
+ * @notapi
+ */
+static SST25Driver *sst25_ll_chip(SST25Driver *inst)
+{
+	return (inst->parent != NULL)? inst->parent : inst;
 }
 
 /*
@@ -412,21 +1024,26 @@ static bool sst25_connect(SST25Driver *inst)
 	const struct sst25_ll_info *ptbl;
 
 	inst->state = BLK_CONNECTING;
-	inst->jdec_id = sst25_ll_get_jdec_id(inst->config);
+	inst->jdec_id = sst25_ll_get_jdec_id(inst);
 
 	for (ptbl = sst25_ll_info_table;
 			ptbl < (sst25_ll_info_table + ARRAY_SIZE(sst25_ll_info_table));
 			ptbl++)
 		if (ptbl->jdec_id == inst->jdec_id) {
+			int op;
+
 			inst->state = BLK_ACTIVE;
+			inst->info = ptbl;
 			inst->name = ptbl->name;
 			inst->page_size = ptbl->page_size;
 			inst->erase_size = ptbl->erase_size;
 			inst->nr_pages = ptbl->nr_pages;
+			for (op = 0; op < SST25_OP_NR; op++)
+				inst->wait_est_us[op] = ptbl->timing[op].typ_us;
 
 			/* disable write protection BP[0..3] = 0 */
-			sst25_ll_hw_busy(inst->config, false);
-			sst25_ll_wrsr(inst->config, 0);
+			sst25_ll_hw_busy(inst, false);
+			sst25_ll_wrsr(inst, 0);
 
 			MTD_INFO("sst25: %s: %" PRIu16 " * %" PRIu32 " erase: %" PRIu16 ", total %lu kB",
 					mtdGetName(inst),
@@ -458,11 +1075,18 @@ static bool sst25_read(SST25Driver *inst, uint32_t startblk,
 		return HAL_FAILED;
 	}
 
+	SST25Driver *flp = sst25_ll_chip(inst);
+
+	if (sst25_ll_read_begin(flp) == HAL_FAILED)
+		return HAL_FAILED;
+
 #ifdef SST25_SLOW_READ
-	sst25_ll_read(inst->config, addr, buffer, nbytes);
+	sst25_ll_read(flp, addr, buffer, nbytes);
 #else /* SST25_FAST_READ */
-	sst25_ll_fast_read(inst->config, addr, buffer, nbytes);
+	sst25_ll_fast_read(flp, addr, buffer, nbytes);
 #endif
+
+	sst25_ll_read_end(flp);
 	return HAL_SUCCESS;
 }
 
@@ -484,11 +1108,21 @@ static bool sst25_write(SST25Driver *inst, uint32_t startblk,
 		return HAL_FAILED;
 	}
 
+	SST25Driver *flp = sst25_ll_chip(inst);
+	uint32_t start = TRACE_START();
+	bool ret;
+
 #ifdef SST25_SLOW_WRITE
-	return sst25_ll_write_byte(inst->config, addr, buffer, nbytes);
+	ret = sst25_ll_write_byte(flp, addr, buffer, nbytes);
 #else /* SST25_FAST_WRITE */
-	return sst25_ll_write_word(inst->config, addr, buffer, nbytes);
+	if (flp->info->flags & LL_AAI)
+		ret = sst25_ll_write_word(flp, addr, buffer, nbytes);
+	else
+		ret = sst25_ll_write_byte(flp, addr, buffer, nbytes);
 #endif
+
+	TRACE(flp->config->spip, SST25_TRACE_OP_WRITE, addr, nbytes, start);
+	return ret;
 }
 
 /**
@@ -501,6 +1135,8 @@ static bool sst25_write(SST25Driver *inst, uint32_t startblk,
  */
 static bool sst25_erase(SST25Driver *inst, uint32_t startblk, uint32_t n)
 {
+	SST25Driver *flp = sst25_ll_chip(inst);
+	uint32_t start = TRACE_START();
 	uint32_t addr;
 	uint32_t nblocks;
 	bool ret = HAL_FAILED;
@@ -510,7 +1146,9 @@ static bool sst25_erase(SST25Driver *inst, uint32_t startblk, uint32_t n)
 	startblk += inst->start_page;
 	if (startblk == 0 && n >= inst->nr_pages && inst->parent == NULL) {
 		MTD_DEBUG("sst25: %s: perform chip erase", mtdGetName(inst));
-		return sst25_ll_chip_erase(inst->config);
+		ret = sst25_ll_chip_erase(inst);
+		TRACE(flp->config->spip, SST25_TRACE_OP_ERASE, 0, inst->nr_pages * inst->page_size, start);
+		return ret;
 	}
 
 	/* for partition erase */
@@ -527,14 +1165,28 @@ static bool sst25_erase(SST25Driver *inst, uint32_t startblk, uint32_t n)
 	addr = startblk * inst->page_size;
 	nblocks = (n + 1) / (inst->erase_size / inst->page_size);
 	for (; nblocks > 0; nblocks--, addr += inst->erase_size) {
-		ret = sst25_ll_erase_block(inst->config, addr);
+		ret = sst25_ll_erase_block(flp, addr);
 		if (ret == HAL_FAILED)
 			break;
 	}
 
+	TRACE(flp->config->spip, SST25_TRACE_OP_ERASE, startblk * inst->page_size,
+			n * inst->page_size, start);
 	return ret;
 }
 
+/**
+ * @brief wait until chip is idle
+ * Completes program/erase left in progress by SST25_DEFERRED_COMPLETION.
+ * @api
+ */
+static bool sst25_sync(SST25Driver *inst)
+{
+	osalDbgCheck(inst->state == BLK_ACTIVE);
+
+	return sst25_ll_settle(sst25_ll_chip(inst));
+}
+
 /**
  * @brief Get block device info (page size and noumber of pages)
  * @api
@@ -556,7 +1208,7 @@ static const struct BaseMTDDriverVMT sst25_vmt = {
 	.disconnect = sst25_vmt_nop,
 	.read = (bool (*)(void*, uint32_t, uint8_t*, uint32_t)) sst25_read,
 	.write = (bool (*)(void*, uint32_t, const uint8_t*, uint32_t)) sst25_write,
-	.sync = sst25_vmt_nop,
+	.sync = (bool (*)(void*)) sst25_sync,
 	.get_info = (bool (*)(void*, BlockDeviceInfo*)) sst25_get_info,
 	.erase = (bool (*)(void*, uint32_t, uint32_t)) sst25_erase
 };
@@ -588,10 +1240,18 @@ void sst25ObjectInit(SST25Driver *flp)
 	flp->parent = NULL;
 	flp->state = BLK_STOP;
 	flp->jdec_id = 0;
+	flp->info = NULL;
 	flp->page_size = 0;
 	flp->erase_size = 0;
 	flp->nr_pages = 0;
 	flp->start_page = 0;
+	flp->busy_op = SST25_OP_NR;
+	flp->max_hold = 0;
+	flp->suspend_gen = 0;
+	flp->suspended = false;
+	flp->suspend_users = 0;
+	flp->resumed_at = 0;
+	osalMutexObjectInit(&flp->suspend_lock);
 }
 
 /**
@@ -618,6 +1278,9 @@ void sst25Stop(SST25Driver *flp)
 	osalDbgAssert((flp->state == BLK_STOP) || (flp->state == BLK_ACTIVE),
 			"invalid state");
 
+	if (flp->state == BLK_ACTIVE && flp->parent == NULL)
+		(void)sst25_ll_settle(flp);
+
 	spiStop(flp->config->spip);
 	flp->state = BLK_STOP;
 }
@@ -640,6 +1303,7 @@ void sst25InitPartition(SST25Driver *flp, SST25Driver *part_flp, const struct mt
 	FLP_COPY(page_size);
 	FLP_COPY(erase_size);
 	FLP_COPY(jdec_id);
+	FLP_COPY(info);
 
 	part_flp->name = part_def->name;
 	part_flp->parent = flp;
@@ -672,3 +1336,58 @@ void sst25InitPartitionTable(SST25Driver *flp, const struct sst25_partition *par
 		sst25InitPartition(flp, ptbl->partp, &(ptbl->definition));
 }
 
+/**
+ * @brief program erased flash with long AAI streams
+ * Production path for known-erased chip (e.g. image from tools/mkimage):
+ * data bytes are not checked against flash contents, only 0xff words are
+ * skipped. Verify result with mtdCalcCrc32().
+ *
+ * @param[in] offset byte offset in partition (any alignment)
+ * @api
+ */
+bool sst25ProgramErased(SST25Driver *flp, uint32_t offset, const uint8_t *buf, uint32_t n)
+{
+	uint32_t start = TRACE_START();
+	SST25Driver *chip;
+	uint32_t addr;
+	bool ret;
+
+	osalDbgCheck((flp != NULL) && (buf != NULL));
+	osalDbgCheck(flp->state == BLK_ACTIVE);
+	if (offset > flp->nr_pages * flp->page_size ||
+			n > flp->nr_pages * flp->page_size - offset) {
+		MTD_DEBUG("sst25: %s: program out of partition", mtdGetName(flp));
+		return HAL_FAILED;
+	}
+
+	chip = sst25_ll_chip(flp);
+	addr = flp->start_page * flp->page_size + offset;
+	if (chip->info->flags & LL_AAI)
+		ret = sst25_ll_program_erased(chip, addr, buf, n);
+	else
+		ret = sst25_ll_write_byte(chip, addr, buf, n);
+	TRACE(chip->config->spip, SST25_TRACE_OP_WRITE, addr, n, start);
+	return ret;
+}
+
+#if defined(SST25_USE_TRACE)
+/**
+ * @brief drop recorded trace entries
+ * @api
+ */
+void sst25TraceReset(void)
+{
+	__atomic_store_n(&sst25_trace.head, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief get trace ring for dump
+ * Entries are written in place, stop flash activity before copying.
+ * @api
+ */
+const struct sst25_trace_buffer *sst25TraceGetBuffer(void)
+{
+	return &sst25_trace;
+}
+#endif /* SST25_USE_TRACE */
+
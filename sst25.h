@@ -26,13 +26,36 @@
 
 #include "flash-mtd.h"
 
-#define _sst25_driver_data	\
-	_base_mtd_driver_data	\
-	uint32_t jdec_id;
+/** Internal operations with distinct busy time
+ */
+enum sst25_op {
+	SST25_OP_PROGRAM = 0,
+	SST25_OP_ERASE_SECTOR,
+	SST25_OP_ERASE_CHIP,
+	SST25_OP_NR
+};
+
+struct sst25_ll_info;
+
+#define _sst25_driver_data				\
+	_base_mtd_driver_data				\
+	uint32_t jdec_id;				\
+	const struct sst25_ll_info *info;		\
+	uint32_t wait_est_us[SST25_OP_NR];		\
+	enum sst25_op busy_op;				\
+	uint32_t busy_since;				\
+	uint32_t max_hold;				\
+	uint32_t suspend_gen;				\
+	bool suspended;					\
+	uint32_t suspend_users;				\
+	mutex_t suspend_lock;				\
+	systime_t resumed_at;
 
 typedef struct {
 	SPIDriver *spip;
 	const SPIConfig *spicfg;
+	uint32_t max_chunk;	/**< read bytes per bus hold, 0 - unlimited */
+	tprio_t suspend_prio;	/**< reads of lower priority threads do not suspend erase */
 } SST25Config;
 
 typedef struct {
@@ -48,6 +71,46 @@ struct sst25_partition {
 
 #define sst25GetJdecID(flp)	((flp)->jdec_id)
 
+/* worst SPI bus hold of chip in SST25_HOLD_TIMESTAMP() units (SST25_USE_HOLD_STATS) */
+#define sst25GetMaxHold(flp)	((((flp)->parent != NULL)? (SST25Driver *)(flp)->parent : (flp))->max_hold)
+#define sst25ResetMaxHold(flp)	((((flp)->parent != NULL)? (SST25Driver *)(flp)->parent : (flp))->max_hold = 0)
+
+#if defined(SST25_USE_TRACE)
+
+#if !defined(SST25_TRACE_SIZE)
+/* entries, power of two */
+#define SST25_TRACE_SIZE	256
+#endif
+
+#define SST25_TRACE_MAGIC	0x54353253UL	/* "S25T" */
+
+/* driver level spans, SPI transfers use command opcode */
+#define SST25_TRACE_OP_WRITE	0xf0
+#define SST25_TRACE_OP_ERASE	0xf1
+#define SST25_TRACE_OP_WAIT	0xf2
+
+struct sst25_trace_entry {
+	uint32_t start;		/**< SST25_TRACE_TIMESTAMP() */
+	uint32_t end;
+	uint32_t addr;		/**< address, enum sst25_op for WAIT */
+	uint32_t len;		/**< bytes on bus, or span size */
+	uint8_t op;
+	uint8_t dev;		/**< SPI bus index, order of first use */
+	uint16_t reserved;
+};
+
+/** Trace ring, dump it as is (little endian) for tools/trace2json
+ */
+struct sst25_trace_buffer {
+	uint32_t magic;
+	uint32_t clock_hz;	/**< SST25_TRACE_CLOCK_HZ */
+	uint32_t size;		/**< SST25_TRACE_SIZE */
+	uint32_t head;		/**< entries recorded, last at (head - 1) % size */
+	struct sst25_trace_entry entry[SST25_TRACE_SIZE];
+};
+
+#endif /* SST25_USE_TRACE */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -57,6 +120,11 @@ extern "C" {
 	void sst25Stop(SST25Driver *flp);
 	void sst25InitPartition(SST25Driver *flp, SST25Driver *part_flp, const struct mtd_partition *part_def);
 	void sst25InitPartitionTable(SST25Driver *flp, const struct sst25_partition *part_defs);
+	bool sst25ProgramErased(SST25Driver *flp, uint32_t offset, const uint8_t *buf, uint32_t n);
+#if defined(SST25_USE_TRACE)
+	void sst25TraceReset(void);
+	const struct sst25_trace_buffer *sst25TraceGetBuffer(void);
+#endif
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,509 @@
+/**
+ * @file       flashsim.c
+ * @brief      Endurance and write amplification simulator
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Runs sst25.c against an emulated chip, replays workload trace
+ * or synthetic usage profile on a partition and reports wear.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "flash-mtd.h"
+#include "mtdclog.h"
+#include "flashemu.h"
+
+#define SIM_MAX_PARTS		16
+#define HOURS_PER_YEAR		(24.0 * 365.0)
+
+struct sim_part {
+	SST25Driver drv;
+	struct mtd_partition def;
+};
+
+static struct flashemu emu;
+static SPIConfig spicfg = { .hz = 20000000 };
+static SPIDriver spid = { .emu = &emu };
+static SST25Config flash_cfg = {
+	.spip = &spid,
+	.spicfg = &spicfg
+};
+static SST25Driver flash;
+
+static struct sim_part parts[SIM_MAX_PARTS];
+static int nr_parts;
+
+static uint64_t user_bytes;
+static uint32_t nr_ops;
+static uint32_t nr_errors;
+static uint32_t rng_state = 2463534242UL;
+
+/* -*- helpers -*- */
+
+static uint32_t sim_rand(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void sim_fill(uint8_t *buf, size_t n)
+{
+	while (n--)
+		*buf++ = sim_rand();
+}
+
+static SST25Driver *sim_find_part(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr_parts; i++)
+		if (strcmp(parts[i].def.name, name) == 0)
+			return &parts[i].drv;
+
+	return NULL;
+}
+
+static void sim_check(bool ret, const char *what, uint32_t off)
+{
+	if (ret == HAL_FAILED) {
+		nr_errors++;
+		fprintf(stderr, "flashsim: %s failed at 0x%" PRIx32 "\n", what, off);
+	}
+}
+
+/**
+ * @brief write bytes, untouched parts of pages are left 0xff
+ */
+static void sim_write(SST25Driver *part, uint32_t off, const uint8_t *data, uint32_t len)
+{
+	uint32_t ps = mtdGetPageSize(part);
+	uint32_t first = off / ps;
+	uint32_t npages = (off % ps + len + ps - 1) / ps;
+	uint8_t *buf;
+
+	if (len == 0)
+		return;
+
+	buf = malloc(npages * ps);
+	memset(buf, 0xff, npages * ps);
+	memcpy(buf + off % ps, data, len);
+	sim_check(blkWrite(part, first, buf, npages), "write", off);
+	free(buf);
+
+	user_bytes += len;
+}
+
+static void sim_erase(SST25Driver *part, uint32_t off, uint32_t len)
+{
+	uint32_t ps = mtdGetPageSize(part);
+	uint32_t es = mtdGetEraseSize(part);
+
+	off -= off % es;
+	len = (len + es - 1) / es * es;
+	sim_check(mtdErase(part, off / ps, len / ps), "erase", off);
+}
+
+static void sim_read(SST25Driver *part, uint32_t off, uint32_t len)
+{
+	uint32_t ps = mtdGetPageSize(part);
+	uint32_t npages = (off % ps + len + ps - 1) / ps;
+	uint8_t *buf = malloc(npages * ps);
+
+	sim_check(blkRead(part, off / ps, buf, npages), "read", off);
+	free(buf);
+}
+
+/* -*- synthetic profiles -*- */
+
+/**
+ * @brief circular log: records packed back to back,
+ * next erase block erased when write position enters it
+ */
+static void profile_log(SST25Driver *part, uint32_t n, uint32_t rec, bool page_aligned)
+{
+	uint32_t size = mtdGetSize(part);
+	uint32_t es = mtdGetEraseSize(part);
+	uint32_t ps = mtdGetPageSize(part);
+	uint32_t slot = (page_aligned)? (rec + ps - 1) / ps * ps : rec;
+	uint32_t pos = 0;
+	uint8_t *data = malloc(rec);
+
+	for (; n > 0; n--, nr_ops++) {
+		uint32_t end;
+
+		if (pos + slot > size)
+			pos = 0;
+
+		end = pos + slot;
+		if (pos % es == 0)
+			sim_erase(part, pos, es);
+		if ((end - 1) / es != pos / es)
+			sim_erase(part, (end - 1) / es * es, es);
+
+		sim_fill(data, rec);
+		sim_write(part, pos, data, rec);
+		pos = end;
+	}
+
+	free(data);
+}
+
+/**
+ * @brief record rewritten in place: erase and program every update
+ */
+static void profile_config(SST25Driver *part, uint32_t n, uint32_t rec)
+{
+	uint8_t *data = malloc(rec);
+
+	for (; n > 0; n--, nr_ops++) {
+		sim_erase(part, 0, rec);
+		sim_fill(data, rec);
+		sim_write(part, 0, data, rec);
+	}
+
+	free(data);
+}
+
+/**
+ * @brief random updates: read-modify-write of containing erase block
+ */
+static void profile_random(SST25Driver *part, uint32_t n, uint32_t rec)
+{
+	uint32_t es = mtdGetEraseSize(part);
+	uint32_t ps = mtdGetPageSize(part);
+	uint32_t nr_blocks = mtdGetSize(part) / es;
+	uint8_t *block = malloc(es);
+
+	if (rec > es)
+		rec = es;
+
+	for (; n > 0; n--, nr_ops++) {
+		uint32_t blk = sim_rand() % nr_blocks;
+		uint32_t off = (sim_rand() % (es - rec + 1)) & ~(ps - 1);
+		uint64_t saved = user_bytes;
+
+		sim_check(blkRead(part, blk * es / ps, block, es / ps), "read", blk * es);
+		sim_erase(part, blk * es, es);
+		sim_fill(block + off, rec);
+		sim_write(part, blk * es, block, es);
+		user_bytes = saved + rec;
+	}
+
+	free(block);
+}
+
+/* -*- trace replay -*- */
+
+/**
+ * @brief replay trace: "W|R|E <partition> <offset> <length>" per line
+ */
+static int replay_trace(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[256];
+	char name[64];
+	char op;
+	uint32_t off, len;
+	uint8_t *data;
+	int lineno = 0;
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		SST25Driver *part;
+
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, " %c %63s %" SCNi32 " %" SCNi32, &op, name, &off, &len) != 4 ||
+				(part = sim_find_part(name)) == NULL ||
+				off + len > mtdGetSize(part)) {
+			fprintf(stderr, "%s:%d: bad trace line\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+
+		switch (op) {
+		case 'W':
+		case 'w':
+			data = malloc(len);
+			sim_fill(data, len);
+			sim_write(part, off, data, len);
+			free(data);
+			break;
+		case 'E':
+		case 'e':
+			sim_erase(part, off, len);
+			break;
+		case 'R':
+		case 'r':
+			sim_read(part, off, len);
+			break;
+		default:
+			fprintf(stderr, "%s:%d: unknown op '%c'\n", path, lineno, op);
+			fclose(fp);
+			return -1;
+		}
+		nr_ops++;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/* -*- report -*- */
+
+static void report(SST25Driver *part, double rate, bool per_block)
+{
+	const struct flashemu_stats *st = &emu.stats;
+	uint32_t ss = emu.model->sector_size;
+	uint32_t first = part->start_page * part->page_size / ss;
+	uint32_t last = first + mtdGetSize(part) / ss;
+	uint32_t s, min = UINT32_MAX, max = 0, used = 0;
+	uint64_t sum = 0;
+	uint64_t busy_ns = 0;
+	double hours, life_h;
+	int op;
+
+	for (s = first; s < last; s++) {
+		uint32_t c = emu.erase_count[s];
+
+		sum += c;
+		used += (c > 0);
+		if (c < min)
+			min = c;
+		if (c > max)
+			max = c;
+	}
+
+	for (op = 0; op < FLASHEMU_OP_NR; op++)
+		busy_ns += st->busy_ns[op];
+
+	printf("device:              %s, %" PRIu32 " kB\n", mtdGetName(&flash), mtdGetSize(&flash) / 1024);
+	printf("partition:           %s [%" PRIu32 "..%" PRIu32 "] pages, %" PRIu32 " erase blocks\n",
+			mtdGetName(part), part->start_page,
+			part->start_page + part->nr_pages, last - first);
+	printf("operations:          %" PRIu32 " (%" PRIu32 " failed)\n", nr_ops, nr_errors);
+	printf("user bytes:          %" PRIu64 "\n", user_bytes);
+	printf("programmed bytes:    %" PRIu64 " in %" PRIu32 " program cycles\n",
+			st->programmed_bytes, st->program_ops);
+	printf("write amplification: %.2f\n",
+			user_bytes? (double)st->programmed_bytes / user_bytes : 0.0);
+	printf("erases:              %" PRIu32 "\n", st->erase_ops);
+	printf("erases per block:    min %" PRIu32 ", avg %.2f, max %" PRIu32 ", %" PRIu32 " blocks touched\n",
+			min, (double)sum / (last - first), max, used);
+	printf("busy time:           %.3f s (program %.3f s, erase %.3f s, chip erase %.3f s)\n",
+			busy_ns / 1e9,
+			st->busy_ns[FLASHEMU_PROGRAM] / 1e9,
+			st->busy_ns[FLASHEMU_ERASE_SECTOR] / 1e9,
+			st->busy_ns[FLASHEMU_ERASE_CHIP] / 1e9);
+	printf("elapsed time:        %.3f s, %" PRIu32 " commands, %" PRIu32 " status polls\n",
+			host_time_ns() / 1e9, st->commands, st->status_polls);
+	printf("max bus hold:        %.2f us (%" PRIu32 " bytes per read)\n",
+			sst25GetMaxHold(part) / 100.0, flash_cfg.max_chunk);
+
+	hours = nr_ops / rate;
+	if (max == 0) {
+		printf("lifetime:            unlimited (no erases)\n");
+	}
+	else {
+		life_h = (double)emu.model->endurance / max * hours;
+		printf("lifetime:            %.1f years at %.1f ops/hour (%" PRIu32 " cycles endurance)\n",
+				life_h / HOURS_PER_YEAR, rate, emu.model->endurance);
+	}
+
+	if (per_block)
+		for (s = first; s < last; s++)
+			printf("block %5" PRIu32 ": %" PRIu32 "\n", s - first, emu.erase_count[s]);
+}
+
+/**
+ * @brief write trace ring as is, last SST25_TRACE_SIZE transfers are kept
+ */
+static int dump_trace(const char *path)
+{
+	const struct sst25_trace_buffer *tbp = sst25TraceGetBuffer();
+	FILE *fp = fopen(path, "wb");
+
+	if (fp == NULL || fwrite(tbp, sizeof(*tbp), 1, fp) != 1) {
+		fprintf(stderr, "flashsim: %s: %s\n", path, strerror(errno));
+		if (fp != NULL)
+			fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: flashsim [options] <log|log-pages|config|random|trace-file>\n"
+		"  -d model         chip model (sst25vf016b, sst25vf032b, w25q32,\n"
+		"                   w25q64, mx25l3233f)\n"
+		"  -p name:start:n  partition, start page and page count (repeatable)\n"
+		"  -t name          target partition for synthetic profile and report\n"
+		"  -n count         synthetic profile operations (10000)\n"
+		"  -r bytes         synthetic record size (32)\n"
+		"  -s seed          data and placement seed\n"
+		"  -u rate          operations per hour in the field (60)\n"
+		"  -f hz            SPI clock (20000000)\n"
+		"  -c bytes         max read bytes per bus hold (unlimited)\n"
+		"  -b               print erase count of every block\n"
+		"  -T file          dump SPI trace (see trace2json)\n"
+		"  -v               driver log\n");
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct flashemu_model *model = flashemu_find_model("sst25vf032b");
+	const char *target = NULL;
+	const char *trace_path = NULL;
+	const char *workload;
+	uint32_t n = 10000, rec = 32;
+	double rate = 60.0;
+	bool per_block = false;
+	SST25Driver *part;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:p:t:n:r:s:u:f:c:bT:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			model = flashemu_find_model(optarg);
+			if (model == NULL) {
+				fprintf(stderr, "flashsim: unknown model %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'p': {
+			struct mtd_partition *def = &parts[nr_parts].def;
+			char *name = strdup(optarg);
+			char *p = strchr(name, ':');
+
+			if (nr_parts == SIM_MAX_PARTS || p == NULL ||
+					sscanf(p + 1, "%" SCNi32 ":%" SCNi32, &def->start_page, &def->nr_pages) != 2)
+				usage();
+			*p = '\0';
+			def->name = name;
+			nr_parts++;
+			break;
+		}
+		case 't':
+			target = optarg;
+			break;
+		case 'n':
+			n = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rec = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			rng_state = strtoul(optarg, NULL, 0) | 1;
+			break;
+		case 'u':
+			rate = strtod(optarg, NULL);
+			break;
+		case 'f':
+			spicfg.hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			flash_cfg.max_chunk = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			per_block = true;
+			break;
+		case 'T':
+			trace_path = optarg;
+			break;
+		case 'v':
+			host_verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc - 1 || rec == 0 || rate <= 0.0)
+		usage();
+	workload = argv[optind];
+
+	if (flashemu_init(&emu, model) != 0) {
+		fprintf(stderr, "flashsim: out of memory\n");
+		return 1;
+	}
+
+	sst25ObjectInit(&flash);
+	sst25Start(&flash, &flash_cfg);
+	if (blkConnect(&flash) == HAL_FAILED) {
+		fprintf(stderr, "flashsim: connect failed\n");
+		return 1;
+	}
+
+	if (nr_parts == 0) {
+		parts[0].def.name = "all";
+		parts[0].def.start_page = 0;
+		parts[0].def.nr_pages = flash.nr_pages;
+		nr_parts = 1;
+	}
+
+	for (i = 0; i < nr_parts; i++) {
+		if (parts[i].def.start_page >= flash.nr_pages) {
+			fprintf(stderr, "flashsim: partition %s out of chip\n", parts[i].def.name);
+			return 2;
+		}
+		sst25InitPartition(&flash, &parts[i].drv, &parts[i].def);
+	}
+
+	part = (target != NULL)? sim_find_part(target) : &parts[0].drv;
+	if (part == NULL) {
+		fprintf(stderr, "flashsim: unknown partition %s\n", target);
+		return 2;
+	}
+
+	if (strcmp(workload, "log") == 0)
+		profile_log(part, n, rec, false);
+	else if (strcmp(workload, "log-pages") == 0)
+		profile_log(part, n, rec, true);
+	else if (strcmp(workload, "config") == 0)
+		profile_config(part, n, rec);
+	else if (strcmp(workload, "random") == 0)
+		profile_random(part, n, rec);
+	else if (replay_trace(workload) != 0)
+		return 1;
+
+	report(part, rate, per_block);
+	if (trace_path != NULL && dump_trace(trace_path) != 0)
+		return 1;
+
+	flashemu_free(&emu);
+	return (nr_errors > 0);
+}
@@ -0,0 +1,403 @@
+/**
+ * @file       flashemu.c
+ * @brief      Emulated 25xx SPI flash chip for host tools
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Models the SST25 command set: status/busy, WEL, block protection,
+ * byte and AAI programming (bits only go 1 -> 0), sector/block/chip erase,
+ * sector erase suspend/resume (0x75/0x7a) of Winbond/Macronix models.
+ * Operation time is taken from the model and runs on virtual time.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdlib.h>
+#include "flashemu.h"
+
+#define CMD_READ		0x03
+#define CMD_FAST_READ		0x0b
+#define CMD_ERASE_4K		0x20
+#define CMD_ERASE_32K		0x52
+#define CMD_ERASE_64K		0xd8
+#define CMD_CHIP_ERASE		0x60
+#define CMD_CHIP_ERASE2		0xc7
+#define CMD_BYTE_PROG		0x02
+#define CMD_AAI_WORD_PROG	0xad
+#define CMD_RDSR		0x05
+#define CMD_EWSR		0x50
+#define CMD_WRSR		0x01
+#define CMD_WREN		0x06
+#define CMD_WRDI		0x04
+#define CMD_JDEC_ID		0x9f
+#define CMD_EBSY		0x70
+#define CMD_DBSY		0x80
+#define CMD_ERASE_SUSPEND	0x75
+#define CMD_ERASE_RESUME	0x7a
+
+#define STAT_BUSY		(1<<0)
+#define STAT_WEL		(1<<1)
+#define STAT_BP_MASK		(0x0f<<2)
+#define STAT_AAI		(1<<6)
+
+#define MB(n)			((n) * 1024 * 1024 / 8)
+
+static const struct flashemu_model flashemu_models[] = {
+	{ "sst25vf016b", 0xbf2541, MB(16), 4096, 100000, { 7, 18000, 35000 }, true, 0, 0 },
+	{ "sst25vf032b", 0xbf254a, MB(32), 4096, 100000, { 7, 18000, 35000 }, true, 0, 0 },
+	{ "w25q32", 0xef4016, MB(32), 4096, 100000, { 30, 45000, 10000000 }, false, 20, 100 },
+	{ "w25q64", 0xef4017, MB(64), 4096, 100000, { 30, 45000, 20000000 }, false, 20, 100 },
+	{ "mx25l3233f", 0xc22016, MB(32), 4096, 100000, { 12, 40000, 25000000 }, false, 20, 100 },
+};
+
+const struct flashemu_model *flashemu_find_model(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(flashemu_models) / sizeof(flashemu_models[0]); i++)
+		if (strcmp(flashemu_models[i].name, name) == 0)
+			return &flashemu_models[i];
+
+	return NULL;
+}
+
+int flashemu_init(struct flashemu *fe, const struct flashemu_model *model)
+{
+	memset(fe, 0, sizeof(*fe));
+	fe->model = model;
+	fe->mem = malloc(model->size);
+	fe->erase_count = calloc(model->size / model->sector_size, sizeof(uint32_t));
+	if (fe->mem == NULL || fe->erase_count == NULL) {
+		flashemu_free(fe);
+		return -1;
+	}
+
+	memset(fe->mem, 0xff, model->size);
+	fe->sr = STAT_BP_MASK & ~(1<<5); /* power-up: BP0..BP2 set */
+	return 0;
+}
+
+void flashemu_free(struct flashemu *fe)
+{
+	free(fe->mem);
+	free(fe->erase_count);
+	fe->mem = NULL;
+	fe->erase_count = NULL;
+}
+
+bool flashemu_is_busy(struct flashemu *fe)
+{
+	return host_time_ns() < fe->busy_until_ns;
+}
+
+static uint32_t flashemu_addr(struct flashemu *fe)
+{
+	return ((fe->cmd[1] << 16) | (fe->cmd[2] << 8) | fe->cmd[3]) % fe->model->size;
+}
+
+static void flashemu_start_op(struct flashemu *fe, enum flashemu_op op)
+{
+	uint64_t ns = (uint64_t)fe->model->busy_us[op] * 1000;
+
+	fe->busy_until_ns = host_time_ns() + ns;
+	fe->busy_op = op;
+	fe->stats.busy_ns[op] += ns;
+	if (op == FLASHEMU_PROGRAM)
+		fe->stats.program_ops++;
+	else
+		fe->stats.erase_ops++;
+}
+
+static void flashemu_program(struct flashemu *fe, uint32_t addr, const uint8_t *data, size_t n)
+{
+	for (; n > 0; n--, data++, addr++) {
+		addr %= fe->model->size;
+		if (*data != 0xff)
+			fe->stats.programmed_bytes++;
+		fe->mem[addr] &= *data;
+	}
+}
+
+static void flashemu_erase(struct flashemu *fe, uint32_t addr, uint32_t size)
+{
+	uint32_t sector;
+
+	addr -= addr % size;
+	memset(fe->mem + addr, 0xff, size);
+	for (sector = addr / fe->model->sector_size;
+			sector < (addr + size) / fe->model->sector_size;
+			sector++)
+		fe->erase_count[sector]++;
+}
+
+/**
+ * @brief power cut before @p after -th program or erase command from now
+ * That command is torn: program does nothing, erase leaves sector half
+ * erased. Later program and erase commands are dropped until
+ * flashemu_power_on(). Zero cancels pending cut.
+ */
+void flashemu_power_cut(struct flashemu *fe, uint32_t after)
+{
+	fe->cut_countdown = after;
+}
+
+/**
+ * @brief power up after cut, chip state is reset, memory kept
+ */
+void flashemu_power_on(struct flashemu *fe)
+{
+	fe->cut_countdown = 0;
+	fe->power_off = false;
+	fe->sr = STAT_BP_MASK & ~(1<<5);
+	fe->sr_write_enabled = false;
+	fe->aai = false;
+	fe->busy_until_ns = 0;
+	fe->suspended = false;
+	fe->resumed_ns = 0;
+	fe->selected = false;
+}
+
+/**
+ * @brief count program/erase command toward power cut
+ * @param[out] tornp set if power fails during this command
+ * @return false if command has no (full) effect
+ */
+static bool flashemu_powered(struct flashemu *fe, bool *tornp)
+{
+	*tornp = false;
+	if (fe->power_off)
+		return false;
+
+	if (fe->cut_countdown > 0 && --fe->cut_countdown == 0) {
+		fe->power_off = true;
+		fe->stats.power_cuts++;
+		*tornp = true;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @brief check program/erase preconditions, clears WEL
+ */
+static bool flashemu_write_allowed(struct flashemu *fe)
+{
+	bool ok = (fe->sr & STAT_WEL) && !(fe->sr & STAT_BP_MASK) && !fe->suspended;
+
+	if (!ok)
+		fe->stats.ignored++;
+
+	fe->sr &= ~STAT_WEL;
+	return ok;
+}
+
+/**
+ * @brief execute command collected between select and unselect
+ */
+static void flashemu_execute(struct flashemu *fe)
+{
+	uint8_t op = fe->cmd[0];
+	uint32_t size;
+	bool torn;
+
+	switch (op) {
+	case CMD_WREN:
+		fe->sr |= STAT_WEL;
+		break;
+
+	case CMD_WRDI:
+		fe->sr &= ~(STAT_WEL | STAT_AAI);
+		fe->aai = false;
+		break;
+
+	case CMD_EWSR:
+		fe->sr_write_enabled = true;
+		break;
+
+	case CMD_WRSR:
+		if (fe->cmd_len >= 2 && (fe->sr_write_enabled || (fe->sr & STAT_WEL)))
+			fe->sr = (fe->sr & (STAT_BUSY | STAT_AAI)) | (fe->cmd[1] & STAT_BP_MASK);
+		else
+			fe->stats.ignored++;
+		fe->sr_write_enabled = false;
+		break;
+
+	case CMD_BYTE_PROG:
+		if (fe->cmd_len < 5 || !flashemu_write_allowed(fe) ||
+				!flashemu_powered(fe, &torn))
+			break;
+		flashemu_program(fe, flashemu_addr(fe), fe->cmd + 4, 1);
+		flashemu_start_op(fe, FLASHEMU_PROGRAM);
+		break;
+
+	case CMD_AAI_WORD_PROG:
+		if (!fe->model->aai) {
+			fe->stats.ignored++;
+			break;
+		}
+		if (!fe->aai) {
+			if (fe->cmd_len < 6 || !flashemu_write_allowed(fe) ||
+					!flashemu_powered(fe, &torn))
+				break;
+			fe->aai = true;
+			fe->sr |= STAT_AAI | STAT_WEL;
+			fe->aai_addr = flashemu_addr(fe) & ~1;
+			flashemu_program(fe, fe->aai_addr, fe->cmd + 4, 2);
+		}
+		else {
+			if (fe->cmd_len < 3)
+				break;
+			if (!flashemu_powered(fe, &torn)) {
+				fe->aai = false;
+				fe->sr &= ~(STAT_AAI | STAT_WEL);
+				break;
+			}
+			flashemu_program(fe, fe->aai_addr, fe->cmd + 1, 2);
+		}
+		fe->aai_addr += 2;
+		flashemu_start_op(fe, FLASHEMU_PROGRAM);
+		break;
+
+	case CMD_ERASE_4K:
+	case CMD_ERASE_32K:
+	case CMD_ERASE_64K:
+		if (fe->cmd_len < 4 || !flashemu_write_allowed(fe))
+			break;
+		size = (op == CMD_ERASE_4K)? 4096 : (op == CMD_ERASE_32K)? 32768 : 65536;
+		if (!flashemu_powered(fe, &torn)) {
+			if (torn)
+				memset(fe->mem + flashemu_addr(fe) - flashemu_addr(fe) % size, 0xff, size / 2);
+			break;
+		}
+		flashemu_erase(fe, flashemu_addr(fe), size);
+		flashemu_start_op(fe, FLASHEMU_ERASE_SECTOR);
+		break;
+
+	case CMD_CHIP_ERASE:
+	case CMD_CHIP_ERASE2:
+		if (!flashemu_write_allowed(fe) || !flashemu_powered(fe, &torn))
+			break;
+		flashemu_erase(fe, 0, fe->model->size);
+		flashemu_start_op(fe, FLASHEMU_ERASE_CHIP);
+		break;
+
+	case CMD_ERASE_RESUME:
+		if (!fe->suspended)
+			break;
+		fe->suspended = false;
+		fe->busy_until_ns = host_time_ns() + fe->suspend_left_ns;
+		fe->busy_op = FLASHEMU_ERASE_SECTOR;
+		fe->resumed_ns = host_time_ns();
+		break;
+
+	default:
+		/* read commands are served by flashemu_receive() */
+		break;
+	}
+}
+
+/**
+ * @brief erase suspend, accepted while sector erase is running
+ * Too early after resume (model resume_us) is counted as ignored.
+ */
+static void flashemu_suspend(struct flashemu *fe)
+{
+	uint64_t now = host_time_ns();
+
+	if (fe->model->suspend_us == 0 || fe->suspended) {
+		fe->stats.ignored++;
+		return;
+	}
+
+	/* erase already done: nothing to suspend */
+	if (!flashemu_is_busy(fe) || fe->busy_op != FLASHEMU_ERASE_SECTOR)
+		return;
+
+	if (fe->resumed_ns != 0 && now - fe->resumed_ns < (uint64_t)fe->model->resume_us * 1000) {
+		fe->stats.ignored++;
+		return;
+	}
+
+	fe->suspended = true;
+	fe->suspend_left_ns = fe->busy_until_ns - now;
+	fe->busy_until_ns = now + (uint64_t)fe->model->suspend_us * 1000;
+	fe->busy_op = FLASHEMU_PROGRAM;	/* latency, can not be suspended */
+	fe->stats.suspends++;
+}
+
+void flashemu_select(struct flashemu *fe)
+{
+	fe->selected = true;
+	fe->cmd_len = 0;
+	fe->rx_pos = 0;
+}
+
+void flashemu_unselect(struct flashemu *fe)
+{
+	if (fe->selected && fe->cmd_len > 0) {
+		fe->stats.commands++;
+		if (fe->cmd[0] == CMD_RDSR)
+			fe->stats.status_polls++;
+		else if (fe->cmd[0] == CMD_ERASE_SUSPEND)
+			flashemu_suspend(fe);
+		else if (flashemu_is_busy(fe))
+			fe->stats.ignored++;
+		else
+			flashemu_execute(fe);
+	}
+
+	fe->selected = false;
+}
+
+void flashemu_send(struct flashemu *fe, const uint8_t *buf, size_t n)
+{
+	for (; n > 0 && fe->cmd_len < sizeof(fe->cmd); n--)
+		fe->cmd[fe->cmd_len++] = *buf++;
+}
+
+void flashemu_receive(struct flashemu *fe, uint8_t *buf, size_t n)
+{
+	uint32_t addr;
+
+	switch ((fe->cmd_len > 0)? fe->cmd[0] : 0) {
+	case CMD_RDSR:
+		memset(buf, fe->sr | (flashemu_is_busy(fe)? STAT_BUSY : 0), n);
+		break;
+
+	case CMD_JDEC_ID:
+		for (; n > 0; n--, fe->rx_pos++)
+			*buf++ = (fe->rx_pos < 3)? fe->model->jdec_id >> (16 - 8 * fe->rx_pos) : 0;
+		break;
+
+	case CMD_READ:
+	case CMD_FAST_READ:
+		if (flashemu_is_busy(fe)) {
+			fe->stats.ignored++;
+			memset(buf, 0, n);
+			break;
+		}
+		addr = flashemu_addr(fe) + fe->rx_pos;
+		for (; n > 0; n--, fe->rx_pos++)
+			*buf++ = fe->mem[addr++ % fe->model->size];
+		break;
+
+	default:
+		memset(buf, 0xff, n);
+		break;
+	}
+}
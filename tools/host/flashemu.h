@@ -0,0 +1,102 @@
+/**
+ * @file       flashemu.h
+ * @brief      Emulated 25xx SPI flash chip for host tools
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef FLASHEMU_H
+#define FLASHEMU_H
+
+#include "hal.h"
+
+enum flashemu_op {
+	FLASHEMU_PROGRAM = 0,
+	FLASHEMU_ERASE_SECTOR,
+	FLASHEMU_ERASE_CHIP,
+	FLASHEMU_OP_NR
+};
+
+struct flashemu_model {
+	const char *name;
+	uint32_t jdec_id;
+	uint32_t size;
+	uint32_t sector_size;
+	uint32_t endurance;			/* erase cycles per sector */
+	uint32_t busy_us[FLASHEMU_OP_NR];	/* typical operation time */
+	bool aai;				/* SST AAI word program */
+	uint32_t suspend_us;			/* erase suspend latency, 0 - not supported */
+	uint32_t resume_us;			/* resume to next suspend (min) */
+};
+
+struct flashemu_stats {
+	uint64_t programmed_bytes;	/* bytes really programmed (not 0xff) */
+	uint32_t program_ops;
+	uint32_t erase_ops;
+	uint32_t commands;
+	uint32_t status_polls;
+	uint32_t ignored;		/* commands dropped: busy, no WEL, protected */
+	uint32_t suspends;
+	uint32_t power_cuts;
+	uint64_t busy_ns[FLASHEMU_OP_NR];
+};
+
+struct flashemu {
+	const struct flashemu_model *model;
+	uint8_t *mem;
+	uint32_t *erase_count;		/* per sector */
+
+	uint8_t sr;
+	bool sr_write_enabled;		/* EWSR received */
+	bool aai;
+	uint32_t aai_addr;
+	uint64_t busy_until_ns;
+	enum flashemu_op busy_op;
+	bool suspended;
+	uint64_t suspend_left_ns;	/* erase time left at suspend */
+	uint64_t resumed_ns;
+	uint32_t cut_countdown;		/* program/erase commands until power cut, 0 - none */
+	bool power_off;			/* after cut program and erase do nothing */
+
+	bool selected;
+	uint8_t cmd[4 + 256 + 4];
+	size_t cmd_len;
+	uint32_t rx_pos;
+
+	struct flashemu_stats stats;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+	const struct flashemu_model *flashemu_find_model(const char *name);
+	int flashemu_init(struct flashemu *fe, const struct flashemu_model *model);
+	void flashemu_free(struct flashemu *fe);
+	void flashemu_select(struct flashemu *fe);
+	void flashemu_unselect(struct flashemu *fe);
+	void flashemu_send(struct flashemu *fe, const uint8_t *buf, size_t n);
+	void flashemu_receive(struct flashemu *fe, uint8_t *buf, size_t n);
+	bool flashemu_is_busy(struct flashemu *fe);
+	void flashemu_power_cut(struct flashemu *fe, uint32_t after);
+	void flashemu_power_on(struct flashemu *fe);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FLASHEMU_H */
@@ -0,0 +1,237 @@
+/**
+ * @file       hal.h
+ * @brief      Host (Linux) stand-in for ChibiOS/RT 3 HAL used by tools
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Only the subset used by the driver sources is provided. Time is virtual:
+ * sleeps and SPI transfers advance it, see hal_host.c.
+ * SPI drivers are bound to emulated flash chips, see flashemu.h.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#define TRUE			1
+#define FALSE			0
+
+#define HAL_SUCCESS		false
+#define HAL_FAILED		true
+#define CH_SUCCESS		false
+#define CH_FAILED		true
+
+#define SPI_USE_MUTUAL_EXCLUSION	TRUE
+
+/* -*- OSAL -*- */
+
+typedef uint32_t systime_t;
+typedef int32_t msg_t;
+typedef uint32_t tprio_t;
+typedef uint32_t syssts_t;
+typedef uint64_t stkalign_t;
+
+#define CH_CFG_ST_FREQUENCY	10000
+#define NORMALPRIO		128
+
+#define S2ST(sec)	((systime_t)((uint32_t)(sec) * CH_CFG_ST_FREQUENCY))
+#define MS2ST(msec)	((systime_t)((((uint32_t)(msec) * CH_CFG_ST_FREQUENCY) + 999UL) / 1000UL))
+#define US2ST(usec)	((systime_t)((((uint32_t)(usec) * CH_CFG_ST_FREQUENCY) + 999999UL) / 1000000UL))
+#define ST2MS(n)	(((uint32_t)(n) * 1000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+#define ST2US(n)	(((uint32_t)(n) * 1000000UL + CH_CFG_ST_FREQUENCY - 1UL) / CH_CFG_ST_FREQUENCY)
+
+#define osalDbgCheck(c)		assert(c)
+#define osalDbgAssert(c, r)	assert((c) && (r))
+
+systime_t osalOsGetSystemTimeX(void);
+void chThdSleep(systime_t time);
+void chThdYield(void);
+#define chThdSleepMilliseconds(ms)	chThdSleep(MS2ST(ms))
+#define chThdSleepMicroseconds(us)	chThdSleep(US2ST(us))
+
+#define TIME_IMMEDIATE		((systime_t)0)
+#define TIME_INFINITE		((systime_t)-1)
+#define MSG_OK			0
+#define MSG_TIMEOUT		-1
+
+/* threads and synchronization: cooperative host threads, see hal_host.c */
+typedef struct host_thread thread_t;
+typedef struct { int cnt; } binary_semaphore_t;
+typedef struct { int cnt; } semaphore_t;
+typedef struct { thread_t *owner; } mutex_t;
+
+#define THD_WORKING_AREA_SIZE(n)	(n)
+#define THD_WORKING_AREA(s, n)		stkalign_t s[THD_WORKING_AREA_SIZE(n) / sizeof(stkalign_t)]
+#define THD_FUNCTION(tname, arg)	void tname(void *arg)
+typedef void (*tfunc_t)(void *arg);
+
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken);
+msg_t chBSemWait(binary_semaphore_t *bsp);
+msg_t chBSemWaitTimeout(binary_semaphore_t *bsp, systime_t time);
+void chBSemSignal(binary_semaphore_t *bsp);
+void chBSemSignalI(binary_semaphore_t *bsp);
+thread_t *chThdCreateStatic(void *wsp, size_t size, tprio_t prio, tfunc_t pf, void *arg);
+msg_t chThdWait(thread_t *tp);
+#define chRegSetThreadName(name)
+#define chThdGetPriorityX()		NORMALPRIO
+#define chSysGetStatusAndLockX()	((syssts_t)0)
+#define chSysRestoreStatusX(sts)	((void)(sts))
+void osalMutexObjectInit(mutex_t *mp);
+void osalMutexLock(mutex_t *mp);
+void osalMutexUnlock(mutex_t *mp);
+
+/* -*- SPI -*- */
+
+struct flashemu;
+
+typedef struct {
+	uint32_t hz;		/* bus clock, used for transfer time */
+} SPIConfig;
+
+typedef struct {
+	struct flashemu *emu;	/* chip attached to this bus */
+	const SPIConfig *config;
+	mutex_t mutex;
+} SPIDriver;
+
+void spiAcquireBus(SPIDriver *spip);
+void spiReleaseBus(SPIDriver *spip);
+void spiStart(SPIDriver *spip, const SPIConfig *config);
+void spiStop(SPIDriver *spip);
+void spiSelect(SPIDriver *spip);
+void spiUnselect(SPIDriver *spip);
+void spiSend(SPIDriver *spip, size_t n, const void *txbuf);
+void spiReceive(SPIDriver *spip, size_t n, void *rxbuf);
+
+/* -*- block device -*- */
+
+typedef enum {
+	BLK_UNINIT = 0,
+	BLK_STOP,
+	BLK_ACTIVE,
+	BLK_CONNECTING,
+	BLK_DISCONNECTING,
+	BLK_READY,
+	BLK_READING,
+	BLK_WRITING,
+	BLK_SYNCING
+} blkstate_t;
+
+typedef struct {
+	uint32_t blk_size;
+	uint32_t blk_num;
+} BlockDeviceInfo;
+
+#define _base_block_device_methods					\
+	bool (*is_inserted)(void *instance);				\
+	bool (*is_protected)(void *instance);				\
+	bool (*connect)(void *instance);				\
+	bool (*disconnect)(void *instance);				\
+	bool (*read)(void *instance, uint32_t startblk,			\
+			uint8_t *buffer, uint32_t n);			\
+	bool (*write)(void *instance, uint32_t startblk,		\
+			const uint8_t *buffer, uint32_t n);		\
+	bool (*sync)(void *instance);					\
+	bool (*get_info)(void *instance, BlockDeviceInfo *bdip);
+
+#define _base_block_device_data						\
+	blkstate_t state;
+
+#define blkConnect(ip)			((ip)->vmt->connect(ip))
+#define blkDisconnect(ip)		((ip)->vmt->disconnect(ip))
+#define blkRead(ip, blk, buf, n)	((ip)->vmt->read(ip, blk, buf, n))
+#define blkWrite(ip, blk, buf, n)	((ip)->vmt->write(ip, blk, buf, n))
+#define blkSync(ip)			((ip)->vmt->sync(ip))
+#define blkGetInfo(ip, bdip)		((ip)->vmt->get_info(ip, bdip))
+
+/* -*- streams and files -*- */
+
+#define STM_OK			0
+#define STM_TIMEOUT		-1
+#define STM_RESET		-2
+
+#define _base_sequential_stream_methods					\
+	size_t (*write)(void *instance, const uint8_t *bp, size_t n);	\
+	size_t (*read)(void *instance, uint8_t *bp, size_t n);		\
+	msg_t (*put)(void *instance, uint8_t b);			\
+	msg_t (*get)(void *instance);
+
+#define _base_sequential_stream_data
+
+struct BaseSequentialStreamVMT {
+	_base_sequential_stream_methods
+};
+
+typedef struct {
+	const struct BaseSequentialStreamVMT *vmt;
+	_base_sequential_stream_data
+} BaseSequentialStream;
+
+#define streamWrite(ip, bp, n)		((ip)->vmt->write(ip, bp, n))
+#define streamRead(ip, bp, n)		((ip)->vmt->read(ip, bp, n))
+#define streamPut(ip, b)		((ip)->vmt->put(ip, b))
+#define streamGet(ip)			((ip)->vmt->get(ip))
+
+typedef uint32_t fileoffset_t;
+
+#define FILE_OK			STM_OK
+#define FILE_ERROR		STM_TIMEOUT
+#define FILE_EOF		STM_RESET
+
+#define _file_stream_methods						\
+	_base_sequential_stream_methods					\
+	uint32_t (*close)(void *instance);				\
+	int (*geterror)(void *instance);				\
+	fileoffset_t (*getsize)(void *instance);			\
+	fileoffset_t (*getposition)(void *instance);			\
+	uint32_t (*lseek)(void *instance, fileoffset_t offset);
+
+#define _file_stream_data						\
+	_base_sequential_stream_data
+
+struct BaseFileStreamVMT {
+	_file_stream_methods
+};
+
+typedef struct {
+	const struct BaseFileStreamVMT *vmt;
+	_file_stream_data
+} BaseFileStream;
+
+#define fileStreamClose(ip)		((ip)->vmt->close(ip))
+#define fileStreamGetError(ip)		((ip)->vmt->geterror(ip))
+#define fileStreamGetSize(ip)		((ip)->vmt->getsize(ip))
+#define fileStreamGetPosition(ip)	((ip)->vmt->getposition(ip))
+#define fileStreamSeek(ip, offset)	((ip)->vmt->lseek(ip, offset))
+
+/* -*- host extensions -*- */
+
+extern bool host_verbose;
+
+uint64_t host_time_ns(void);
+void host_delay_us(uint32_t us);
+/* no format check: driver messages use target (newlib) integer sizes */
+void host_log(const char *fmt, ...);
+
+#endif /* HAL_H */
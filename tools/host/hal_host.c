@@ -0,0 +1,360 @@
+/**
+ * @file       hal_host.c
+ * @brief      Host (Linux) stand-in for ChibiOS/RT 3 HAL used by tools
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ucontext.h>
+#include "hal.h"
+#include "flashemu.h"
+
+/* cost of context switch on yield */
+#define HOST_YIELD_NS		1000
+/* cost of chip select toggle and command setup */
+#define HOST_SELECT_NS		200
+#define HOST_DEFAULT_SPI_HZ	20000000
+/* target working areas are too small for host libc, threads get their own */
+#define HOST_STACK_SIZE		(256 * 1024)
+
+#define TICK_NS			(1000000000ULL / CH_CFG_ST_FREQUENCY)
+
+bool host_verbose;
+static uint64_t host_now_ns;
+
+uint64_t host_time_ns(void)
+{
+	return host_now_ns;
+}
+
+void host_delay_us(uint32_t us)
+{
+	host_now_ns += (uint64_t)us * 1000;
+}
+
+void host_log(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!host_verbose)
+		return;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+}
+
+systime_t osalOsGetSystemTimeX(void)
+{
+	return (systime_t)(host_now_ns / TICK_NS);
+}
+
+/*
+ * Cooperative threads
+ *
+ * Threads switch only when they sleep, yield or block on a semaphore,
+ * mutex or thread exit, as ChibiOS threads of equal priority do.
+ * Priorities are ignored. When no thread is ready virtual time jumps to
+ * the earliest wakeup; with the main thread alone sleeps behave as plain
+ * time advance.
+ */
+
+enum host_wait {
+	HOST_READY = 0,
+	HOST_SLEEP,
+	HOST_SEM,
+	HOST_MUTEX,
+	HOST_JOIN,
+	HOST_FINAL
+};
+
+struct host_thread {
+	ucontext_t ctx;
+	void *stack;
+	tfunc_t pf;
+	void *arg;
+	enum host_wait wait;
+	void *obj;		/* semaphore, mutex or thread waited for */
+	uint64_t wake_ns;	/* sleep end or timeout, UINT64_MAX - none */
+	msg_t msg;
+	struct host_thread *next;
+};
+
+static struct host_thread host_main = { .wake_ns = UINT64_MAX };
+static struct host_thread *host_current = &host_main;
+
+/**
+ * @brief check wait condition, takes semaphore or mutex when it is met
+ */
+static bool host_thread_runnable(struct host_thread *tp)
+{
+	binary_semaphore_t *bsp;
+	mutex_t *mp;
+
+	switch (tp->wait) {
+	case HOST_READY:
+		return true;
+
+	case HOST_SLEEP:
+		return host_now_ns >= tp->wake_ns;
+
+	case HOST_SEM:
+		bsp = tp->obj;
+		if (bsp->cnt > 0) {
+			bsp->cnt = 0;
+			tp->msg = MSG_OK;
+			return true;
+		}
+		if (host_now_ns >= tp->wake_ns) {
+			tp->msg = MSG_TIMEOUT;
+			return true;
+		}
+		return false;
+
+	case HOST_MUTEX:
+		mp = tp->obj;
+		if (mp->owner == NULL) {
+			mp->owner = tp;
+			return true;
+		}
+		return false;
+
+	case HOST_JOIN:
+		return ((struct host_thread *)tp->obj)->wait == HOST_FINAL;
+
+	default:
+		return false;
+	}
+}
+
+/**
+ * @brief switch to next runnable thread, round robin from current one
+ */
+static void host_reschedule(void)
+{
+	struct host_thread *prev = host_current;
+	struct host_thread *tp;
+
+	for (;;) {
+		uint64_t next = UINT64_MAX;
+
+		tp = prev;
+		do {
+			tp = (tp->next != NULL)? tp->next : &host_main;
+			if (host_thread_runnable(tp))
+				goto found;
+			if (tp->wake_ns < next)
+				next = tp->wake_ns;
+		} while (tp != prev);
+
+		if (next == UINT64_MAX) {
+			fprintf(stderr, "host: all threads blocked\n");
+			abort();
+		}
+		host_now_ns = next;
+	}
+
+found:
+	tp->wait = HOST_READY;
+	tp->wake_ns = UINT64_MAX;
+	if (tp != prev) {
+		host_current = tp;
+		swapcontext(&prev->ctx, &tp->ctx);
+	}
+}
+
+static void host_block(enum host_wait wait, void *obj, uint64_t wake_ns)
+{
+	host_current->wait = wait;
+	host_current->obj = obj;
+	host_current->wake_ns = wake_ns;
+	host_reschedule();
+}
+
+static void host_thread_start(void)
+{
+	host_current->pf(host_current->arg);
+	host_block(HOST_FINAL, NULL, UINT64_MAX);
+}
+
+thread_t *chThdCreateStatic(void *wsp __attribute__((unused)),
+		size_t size __attribute__((unused)),
+		tprio_t prio __attribute__((unused)), tfunc_t pf, void *arg)
+{
+	struct host_thread *tp = calloc(1, sizeof(*tp));
+	struct host_thread *last = &host_main;
+
+	assert(tp != NULL);
+	tp->stack = malloc(HOST_STACK_SIZE);
+	assert(tp->stack != NULL);
+	tp->pf = pf;
+	tp->arg = arg;
+	tp->wake_ns = UINT64_MAX;
+
+	getcontext(&tp->ctx);
+	tp->ctx.uc_stack.ss_sp = tp->stack;
+	tp->ctx.uc_stack.ss_size = HOST_STACK_SIZE;
+	tp->ctx.uc_link = NULL;
+	makecontext(&tp->ctx, host_thread_start, 0);
+
+	while (last->next != NULL)
+		last = last->next;
+	last->next = tp;
+	return tp;
+}
+
+msg_t chThdWait(thread_t *tp)
+{
+	struct host_thread *prev = &host_main;
+
+	assert(tp != host_current && tp != &host_main);
+	if (tp->wait != HOST_FINAL)
+		host_block(HOST_JOIN, tp, UINT64_MAX);
+
+	while (prev->next != tp)
+		prev = prev->next;
+	prev->next = tp->next;
+	free(tp->stack);
+	free(tp);
+	return MSG_OK;
+}
+
+void chThdSleep(systime_t time)
+{
+	/* sleep ends on tick boundary */
+	host_block(HOST_SLEEP, NULL, (host_now_ns / TICK_NS + time) * TICK_NS);
+}
+
+void chThdYield(void)
+{
+	host_now_ns += HOST_YIELD_NS;
+	host_block(HOST_READY, NULL, UINT64_MAX);
+}
+
+void chBSemObjectInit(binary_semaphore_t *bsp, bool taken)
+{
+	bsp->cnt = taken? 0 : 1;
+}
+
+msg_t chBSemWaitTimeout(binary_semaphore_t *bsp, systime_t time)
+{
+	if (bsp->cnt > 0) {
+		bsp->cnt = 0;
+		return MSG_OK;
+	}
+	if (time == TIME_IMMEDIATE)
+		return MSG_TIMEOUT;
+
+	host_block(HOST_SEM, bsp, (time == TIME_INFINITE)? UINT64_MAX :
+			(host_now_ns / TICK_NS + time) * TICK_NS);
+	return host_current->msg;
+}
+
+msg_t chBSemWait(binary_semaphore_t *bsp)
+{
+	return chBSemWaitTimeout(bsp, TIME_INFINITE);
+}
+
+void chBSemSignal(binary_semaphore_t *bsp)
+{
+	bsp->cnt = 1;
+}
+
+void chBSemSignalI(binary_semaphore_t *bsp)
+{
+	bsp->cnt = 1;
+}
+
+void osalMutexObjectInit(mutex_t *mp)
+{
+	mp->owner = NULL;
+}
+
+void osalMutexLock(mutex_t *mp)
+{
+	assert(mp->owner != host_current);
+	if (mp->owner == NULL)
+		mp->owner = host_current;
+	else
+		host_block(HOST_MUTEX, mp, UINT64_MAX);
+}
+
+void osalMutexUnlock(mutex_t *mp)
+{
+	assert(mp->owner == host_current);
+	mp->owner = NULL;
+}
+
+/*
+ * SPI bound to emulated chip
+ */
+
+static void host_spi_clock(SPIDriver *spip, size_t n)
+{
+	uint32_t hz = (spip->config != NULL && spip->config->hz)?
+		spip->config->hz : HOST_DEFAULT_SPI_HZ;
+
+	host_now_ns += (uint64_t)n * 8 * 1000000000ULL / hz;
+}
+
+void spiAcquireBus(SPIDriver *spip)
+{
+	osalMutexLock(&spip->mutex);
+}
+
+void spiReleaseBus(SPIDriver *spip)
+{
+	osalMutexUnlock(&spip->mutex);
+}
+
+void spiStart(SPIDriver *spip, const SPIConfig *config)
+{
+	spip->config = config;
+}
+
+void spiStop(SPIDriver *spip)
+{
+	spip->config = NULL;
+}
+
+void spiSelect(SPIDriver *spip)
+{
+	host_now_ns += HOST_SELECT_NS;
+	flashemu_select(spip->emu);
+}
+
+void spiUnselect(SPIDriver *spip)
+{
+	flashemu_unselect(spip->emu);
+}
+
+void spiSend(SPIDriver *spip, size_t n, const void *txbuf)
+{
+	host_spi_clock(spip, n);
+	flashemu_send(spip->emu, txbuf, n);
+}
+
+void spiReceive(SPIDriver *spip, size_t n, void *rxbuf)
+{
+	host_spi_clock(spip, n);
+	flashemu_receive(spip->emu, rxbuf, n);
+}
@@ -0,0 +1,32 @@
+/**
+ * @file       mtd_config.h
+ * @brief      FLASH25 configuration for host tools
+ */
+
+#ifndef MTD_CONFIG_H
+#define MTD_CONFIG_H
+
+#define MTD_DEBUG(fmt, arg...)	host_log(fmt "\n", ##arg)
+#define MTD_INFO(fmt, arg...)	host_log(fmt "\n", ##arg)
+
+/* virtual time has no tick granularity problem; targets usually lack
+ * the hook, HOST_NO_POLLED_DELAY builds the same way */
+#if !defined(HOST_NO_POLLED_DELAY)
+#define SST25_POLLED_DELAY_US(us)	host_delay_us(us)
+#endif
+
+/* SPI transaction trace on virtual time, 10 ns resolution */
+#define SST25_USE_TRACE
+#define SST25_TRACE_SIZE		65536
+#define SST25_TRACE_CLOCK_HZ		100000000
+#define SST25_TRACE_TIMESTAMP()		((uint32_t)(host_time_ns() / 10))
+
+/* worst SPI bus hold, same 10 ns units */
+#define SST25_USE_HOLD_STATS
+#define SST25_HOLD_TIMESTAMP()		SST25_TRACE_TIMESTAMP()
+
+/* busy wait measurement, same 10 ns units */
+#define SST25_WAIT_TIMESTAMP()		SST25_TRACE_TIMESTAMP()
+#define SST25_WAIT_CLOCK_HZ		SST25_TRACE_CLOCK_HZ
+
+#endif /* MTD_CONFIG_H */
@@ -0,0 +1,933 @@
+/**
+ * @file       hosttest.c
+ * @brief      Host test of FLASH25 modules on emulated chips
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Runs mtdfatfs, mtdconcat, mtdcapture, mtdfile, mtdkv and mtdCopy()
+ * against emulated chips with cooperative host threads and checks
+ * data, statistics and pool balance. mtdkv is also remounted after power
+ * cuts injected into the emulated chip. Exit status is nonzero on failure.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "flash-mtd.h"
+#include "mtdconcat.h"
+#include "mtdclog.h"
+#include "mtdcapture.h"
+#include "mtdfatfs.h"
+#include "mtdkv.h"
+#include "mtdfile.h"
+#include "flashemu.h"
+
+#define SECTOR		MTDFATFS_SECTOR_SIZE
+
+struct test_chip {
+	struct flashemu emu;
+	SPIDriver spid;
+	SST25Config cfg;
+	SST25Driver drv;
+};
+
+static const SPIConfig spicfg = { .hz = 20000000 };
+
+static struct test_chip chip_a, chip_b, chip_c, chip_d;
+
+/* chip_a partitions, chip_b copy destination; chip_c, chip_d concat */
+static SST25Driver fat_part, file_part, kv_part, cap_part, src_part, dst_part, far_part;
+static const struct mtd_partition part_defs[] = {
+	{ "fat", 0, 1024 },
+	{ "file", 1024, 256 },
+	{ "kv", 1280, 256 },
+	{ "cap", 1536, 256 },
+	{ "src", 1792, 256 },
+	{ "dst", 2048, 256 },
+};
+static const struct mtd_partition far_def = { "far", 0, 256 };
+
+static int nr_checks;
+static int nr_failed;
+static uint32_t rng_state = 2463534242UL;
+
+/* -*- helpers -*- */
+
+#define CHECK(c)	test_check((c), #c, __func__, __LINE__)
+
+static bool test_check(bool ok, const char *expr, const char *func, int line)
+{
+	nr_checks++;
+	if (!ok) {
+		nr_failed++;
+		fprintf(stderr, "hosttest: %s:%d: %s failed\n", func, line, expr);
+	}
+	return ok;
+}
+
+static uint32_t test_rand(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void test_fill(uint8_t *buf, size_t n)
+{
+	while (n--)
+		*buf++ = test_rand();
+}
+
+static bool test_is_erased(const uint8_t *buf, size_t n)
+{
+	while (n--)
+		if (*buf++ != 0xff)
+			return false;
+	return true;
+}
+
+static void chip_start(struct test_chip *cp, const char *model)
+{
+	if (flashemu_init(&cp->emu, flashemu_find_model(model)) < 0) {
+		fprintf(stderr, "hosttest: can't emulate %s\n", model);
+		exit(2);
+	}
+
+	cp->spid.emu = &cp->emu;
+	cp->cfg.spip = &cp->spid;
+	cp->cfg.spicfg = &spicfg;
+	sst25ObjectInit(&cp->drv);
+	sst25Start(&cp->drv, &cp->cfg);
+	if (blkConnect(&cp->drv) == HAL_FAILED) {
+		fprintf(stderr, "hosttest: %s not detected\n", model);
+		exit(2);
+	}
+}
+
+static uint32_t chip_erase_count(struct test_chip *cp, BaseMTDDriver *mtdp, uint32_t blk)
+{
+	uint32_t addr = (mtdp->start_page + blk * (mtdGetEraseSize(mtdp) / mtdGetPageSize(mtdp))) *
+		mtdGetPageSize(mtdp);
+
+	return cp->emu.erase_count[addr / cp->emu.model->sector_size];
+}
+
+/**
+ * @brief every module must return what it borrowed
+ */
+static void pool_check(void)
+{
+	struct mtd_pool_stats st;
+
+	mtdPoolGetStats(&st);
+	CHECK(st.pages_free == MTD_POOL_NR_PAGES);
+	CHECK(st.blocks_free == MTD_POOL_NR_BLOCKS);
+}
+
+/* -*- mtdfatfs -*- */
+
+static bool fat_sectors_equal(MTDFatFS *fsp, uint32_t sector, const uint8_t *data, uint32_t n)
+{
+	static uint8_t buf[8 * SECTOR];
+
+	return mtdfatfsRead(fsp, sector, buf, n) == HAL_SUCCESS &&
+		memcmp(buf, data, n * SECTOR) == 0;
+}
+
+static bool fat_sectors_erased(MTDFatFS *fsp, uint32_t sector, uint32_t n)
+{
+	static uint8_t buf[8 * SECTOR];
+
+	return mtdfatfsRead(fsp, sector, buf, n) == HAL_SUCCESS &&
+		test_is_erased(buf, n * SECTOR);
+}
+
+static void test_fatfs(void)
+{
+	static uint8_t data[8 * SECTOR], other[SECTOR];
+	BaseMTDDriver *mtdp = (BaseMTDDriver *)&fat_part;
+	const MTDFatFSConfig cfg = { .mtdp = mtdp };
+	MTDFatFS fs;
+	uint32_t bps, erases, i;
+
+	CHECK(mtdErase(mtdp, 0, mtdp->nr_pages) == HAL_SUCCESS);
+	mtdfatfsObjectInit(&fs);
+	CHECK(mtdfatfsStart(&fs, &cfg) == HAL_SUCCESS);
+	bps = mtdfatfsGetBlockSize(&fs);
+	CHECK(bps == 8);
+
+	/* erased block is programmed without erase */
+	test_fill(data, sizeof(data));
+	CHECK(mtdfatfsWrite(&fs, 0, data, bps) == HAL_SUCCESS);
+	CHECK(fat_sectors_equal(&fs, 0, data, bps));
+	CHECK(mtdfatfsSync(&fs) == HAL_SUCCESS);
+	CHECK(fs.stats.erases == 0 && fs.stats.erases_avoided == 1);
+	CHECK(chip_erase_count(&chip_a, mtdp, 0) == 1);
+
+	/* clearing bits only: still no erase */
+	for (i = 0; i < SECTOR; i++)
+		data[i] &= test_rand();
+	CHECK(mtdfatfsWrite(&fs, 0, data, 1) == HAL_SUCCESS);
+	CHECK(mtdfatfsSync(&fs) == HAL_SUCCESS);
+	CHECK(fs.stats.erases == 0 && fs.stats.erases_avoided == 2);
+
+	/* setting bits: erase, other sectors of block kept */
+	for (i = 0; i < SECTOR; i++)
+		data[SECTOR + i] = ~data[SECTOR + i];
+	CHECK(mtdfatfsWrite(&fs, 1, data + SECTOR, 1) == HAL_SUCCESS);
+	CHECK(mtdfatfsSync(&fs) == HAL_SUCCESS);
+	CHECK(fs.stats.erases == 1 && fs.stats.erases_avoided == 2);
+	CHECK(chip_erase_count(&chip_a, mtdp, 0) == 2);
+	CHECK(fat_sectors_equal(&fs, 0, data, bps));
+
+	/* trim only remembers whole blocks, erase comes later */
+	mtdfatfsTrim(&fs, 0, 2 * bps + 3);
+	CHECK(fs.stats.trimmed == 2);
+	CHECK(fat_sectors_equal(&fs, 0, data, bps));
+	CHECK(mtdfatfsEraseTrimmed(&fs, 1) == 1);
+	CHECK(mtdfatfsEraseTrimmed(&fs, 10) == 1);
+	CHECK(mtdfatfsEraseTrimmed(&fs, 10) == 0);
+	CHECK(fs.stats.erases == 3);
+	CHECK(fat_sectors_erased(&fs, 0, bps));
+
+	/* write into trimmed block: flush erases, unwritten sectors read blank */
+	CHECK(mtdfatfsWrite(&fs, 2 * bps, data, bps) == HAL_SUCCESS);
+	CHECK(mtdfatfsSync(&fs) == HAL_SUCCESS);
+	erases = fs.stats.erases;
+	mtdfatfsTrim(&fs, 2 * bps, 3 * bps - 1);
+	test_fill(other, sizeof(other));
+	CHECK(mtdfatfsWrite(&fs, 2 * bps + 1, other, 1) == HAL_SUCCESS);
+	CHECK(mtdfatfsSync(&fs) == HAL_SUCCESS);
+	CHECK(fs.stats.erases == erases + 1);
+	CHECK(fat_sectors_erased(&fs, 2 * bps, 1));
+	CHECK(fat_sectors_equal(&fs, 2 * bps + 1, other, 1));
+	CHECK(fat_sectors_erased(&fs, 2 * bps + 2, bps - 2));
+	/* flush cleared trim mark, data survives EraseTrimmed */
+	CHECK(mtdfatfsEraseTrimmed(&fs, 10) == 0);
+	CHECK(fat_sectors_equal(&fs, 2 * bps + 1, other, 1));
+
+	/* trim of cached block drops unwritten data */
+	erases = fs.stats.erases;
+	CHECK(mtdfatfsWrite(&fs, 3 * bps, data, 2) == HAL_SUCCESS);
+	mtdfatfsTrim(&fs, 3 * bps, 4 * bps - 1);
+	CHECK(mtdfatfsSync(&fs) == HAL_SUCCESS);
+	CHECK(fat_sectors_erased(&fs, 3 * bps, bps));
+	CHECK(mtdfatfsEraseTrimmed(&fs, 10) == 1);
+	CHECK(fs.stats.erases == erases + 1);
+
+	CHECK(mtdfatfsWrite(&fs, mtdfatfsGetSectorCount(&fs) - 1, data, 2) == HAL_FAILED);
+	mtdfatfsStop(&fs);
+	pool_check();
+}
+
+/* -*- mtdconcat -*- */
+
+static void test_concat(void)
+{
+	static BaseMTDDriver * const devices[] = {
+		(BaseMTDDriver *)&chip_c.drv,
+		(BaseMTDDriver *)&chip_d.drv
+	};
+	static const MTDConcatConfig linear_cfg = { devices, 2, MTDCONCAT_LINEAR };
+	static const MTDConcatConfig stripe_cfg = { devices, 2, MTDCONCAT_STRIPE };
+	static const struct mtd_partition part_def = { "catpart", 32, 64 };
+	static uint8_t wbuf[8192], rbuf[8192];
+	MTDConcatDriver cat;
+	BaseMTDDriver part;
+	uint32_t c_pages = chip_c.drv.nr_pages;
+	uint32_t ppb = chip_c.drv.erase_size / chip_c.drv.page_size;
+	uint64_t t0, one, two;
+
+	/* linear: request over device boundary */
+	mtdconcatObjectInit(&cat);
+	mtdconcatStart(&cat, &linear_cfg);
+	CHECK(blkConnect(&cat) == HAL_SUCCESS);
+	CHECK(cat.nr_pages == c_pages + chip_d.drv.nr_pages);
+
+	CHECK(mtdErase(&cat, c_pages - ppb, 2 * ppb) == HAL_SUCCESS);
+	test_fill(wbuf, sizeof(wbuf));
+	CHECK(blkWrite(&cat, c_pages - 16, wbuf, 32) == HAL_SUCCESS);
+	CHECK(blkSync(&cat) == HAL_SUCCESS);
+	CHECK(blkRead(&cat, c_pages - 16, rbuf, 32) == HAL_SUCCESS);
+	CHECK(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+	CHECK(memcmp(chip_c.emu.mem + chip_c.emu.model->size - 4096, wbuf, 4096) == 0);
+	CHECK(memcmp(chip_d.emu.mem, wbuf + 4096, 4096) == 0);
+	CHECK(blkRead(&cat, cat.nr_pages - 1, rbuf, 2) == HAL_FAILED);
+	mtdconcatStop(&cat);
+
+	/* stripe: erase blocks on both chips in parallel workers */
+	mtdconcatObjectInit(&cat);
+	mtdconcatStart(&cat, &stripe_cfg);
+	CHECK(blkConnect(&cat) == HAL_SUCCESS);
+	CHECK(cat.nr_pages == 2 * c_pages);
+
+	t0 = host_time_ns();
+	CHECK(mtdErase(&cat, 0, ppb) == HAL_SUCCESS);
+	CHECK(blkSync(&cat) == HAL_SUCCESS);
+	one = host_time_ns() - t0;
+	t0 = host_time_ns();
+	CHECK(mtdErase(&cat, 0, 2 * ppb) == HAL_SUCCESS);
+	CHECK(blkSync(&cat) == HAL_SUCCESS);
+	two = host_time_ns() - t0;
+	CHECK(two < one * 3 / 2);
+
+	CHECK(blkWrite(&cat, 0, wbuf, 32) == HAL_SUCCESS);
+	CHECK(blkSync(&cat) == HAL_SUCCESS);
+	CHECK(memcmp(chip_c.emu.mem, wbuf, 4096) == 0);
+	CHECK(memcmp(chip_d.emu.mem, wbuf + 4096, 4096) == 0);
+
+	/* partition of composite device */
+	mtdconcatInitPartition(&cat, &part, &part_def);
+	CHECK(blkConnect(&part) == HAL_SUCCESS);
+	CHECK(part.nr_pages == 64);
+	CHECK(mtdErase(&part, 0, 2 * ppb) == HAL_SUCCESS);
+	CHECK(blkWrite(&part, 0, wbuf, 32) == HAL_SUCCESS);
+	CHECK(blkRead(&cat, 32, rbuf, 32) == HAL_SUCCESS);
+	CHECK(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+	CHECK(blkRead(&part, 60, rbuf, 8) == HAL_FAILED);
+	mtdconcatStop(&cat);
+	pool_check();
+}
+
+/* -*- mtdcapture -*- */
+
+struct cap_record {
+	uint32_t seq;
+	uint32_t time;
+};
+
+static void test_capture(void)
+{
+	BaseMTDDriver *mtdp = (BaseMTDDriver *)&cap_part;
+	/* long poll period: only the half ring wakeup keeps up */
+	const MTDCaptureConfig cfg = { mtdp, S2ST(10), NORMALPRIO + 1 };
+	const uint32_t nr = 2000;
+	static MTDCapture cap;
+	uint8_t buf[MTDCAPTURE_RECORD_SIZE];
+	struct cap_record rec;
+	uint32_t i, bad = 0;
+
+	mtdcaptureObjectInit(&cap);
+	CHECK(mtdcaptureStart(&cap, &cfg) == HAL_SUCCESS);
+
+	for (i = 0; i < nr; i++) {
+		rec.seq = i;
+		rec.time = osalOsGetSystemTimeX();
+		CHECK(mtdcapturePush(&cap, &rec, sizeof(rec)));
+		chThdSleep(5);
+	}
+	mtdcaptureSync(&cap);
+
+	CHECK(cap.stats.pushed == nr);
+	CHECK(cap.stats.dropped == 0);
+	CHECK(cap.stats.written == nr);
+	CHECK(cap.stats.lost == 0);
+	CHECK(cap.stats.max_fill < MTDCAPTURE_RING_SIZE);
+	CHECK(mtdcaptureGetFill(&cap) == 0);
+
+	for (i = 0; i < nr; i++) {
+		if (mtdReadBytes(mtdp, i * sizeof(buf), buf, sizeof(buf)) == HAL_FAILED)
+			bad++;
+		memcpy(&rec, buf, sizeof(rec));
+		if (rec.seq != i)
+			bad++;
+	}
+	CHECK(bad == 0);
+	CHECK(mtdReadBytes(mtdp, nr * sizeof(buf), buf, sizeof(buf)) == HAL_SUCCESS &&
+			test_is_erased(buf, sizeof(buf)));
+
+	/* records pushed before stop are written by it */
+	rec.seq = nr;
+	CHECK(mtdcapturePush(&cap, &rec, sizeof(rec)));
+	mtdcaptureStop(&cap);
+	CHECK(cap.stats.written == nr + 1);
+	pool_check();
+}
+
+/* -*- mtdfile -*- */
+
+static void file_open(MTDFileStream *fsp, const MTDFileConfig *cfg)
+{
+	mtdfileObjectInit(fsp);
+	CHECK(mtdfileStart(fsp, cfg) == HAL_SUCCESS);
+}
+
+static void test_file(void)
+{
+	BaseMTDDriver *mtdp = (BaseMTDDriver *)&file_part;
+	const MTDFileConfig cfg = { mtdp };
+	static uint8_t ref[12000], buf[12000];
+	static MTDFileStream fs;
+	BaseFileStream *fp = (BaseFileStream *)&fs;
+	BaseSequentialStream *sp = (BaseSequentialStream *)&fs;
+	uint32_t len = 0, i;
+
+	CHECK(mtdErase(mtdp, 0, mtdp->nr_pages) == HAL_SUCCESS);
+	file_open(&fs, &cfg);
+	CHECK(fileStreamGetSize(fp) == 0);
+
+	/* text, then binary data with 0xff runs and 0xff tail */
+	for (i = 0; i < 200; i++)
+		len += sprintf((char *)ref + len, "line %" PRIu32 " value %" PRIu32 "\n", i, i * 7);
+	for (i = 0; i < len; i++)
+		CHECK(streamPut(sp, ref[i]) == STM_OK);
+	test_fill(ref + len, 3000);
+	memset(ref + len + 500, 0xff, 600);
+	memset(ref + len + 2990, 0xff, 10);
+	CHECK(streamWrite(sp, ref + len, 3000) == 3000);
+	len += 3000;
+	CHECK(mtdfileSync(&fs) == HAL_SUCCESS);
+	CHECK(fileStreamClose(fp) == FILE_OK);
+
+	file_open(&fs, &cfg);
+	CHECK(fileStreamGetSize(fp) == len);
+	CHECK(streamRead(sp, buf, sizeof(buf)) == len);
+	CHECK(memcmp(buf, ref, len) == 0);
+	CHECK(streamGet(sp) == STM_RESET);
+
+	/* programmed bytes can not be set back */
+	CHECK(fileStreamSeek(fp, 0) == FILE_OK);
+	buf[0] = ref[0] | 0x80;
+	CHECK(streamWrite(sp, buf, 1) == 0);
+	CHECK(fileStreamGetError(fp) != FILE_OK);
+	fileStreamClose(fp);
+
+	/* unsynced tail is lost on reset, synced one is kept */
+	file_open(&fs, &cfg);
+	CHECK(fileStreamSeek(fp, len) == FILE_OK);
+	CHECK(streamWrite(sp, (const uint8_t *)"lost", 4) == 4);
+	mtdPoolFreePage(fs.page);	/* reset, pool starts empty again */
+	file_open(&fs, &cfg);
+	CHECK(fileStreamGetSize(fp) == len);
+	CHECK(fileStreamSeek(fp, len + 100) == FILE_OK);
+	CHECK(streamWrite(sp, (const uint8_t *)"kept", 4) == 4);
+	CHECK(mtdfileSync(&fs) == HAL_SUCCESS);
+	mtdPoolFreePage(fs.page);
+	file_open(&fs, &cfg);
+	CHECK(fileStreamGetSize(fp) == len + 104);
+
+	/* size journal wraps */
+	for (i = 0; i < 600; i++) {
+		CHECK(fileStreamSeek(fp, len + 104 + i) == FILE_OK);
+		CHECK(streamPut(sp, 'a') == STM_OK);
+		if (!CHECK(mtdfileSync(&fs) == HAL_SUCCESS))
+			break;
+	}
+	CHECK(fs.stats.size_commits >= 600);
+	CHECK(fileStreamClose(fp) == FILE_OK);
+	file_open(&fs, &cfg);
+	CHECK(fileStreamGetSize(fp) == len + 704);
+	CHECK(fileStreamClose(fp) == FILE_OK);
+	pool_check();
+}
+
+/* -*- mtdkv -*- */
+
+#define KV_KEYS		40
+#define KV_SIZE		(256 * 256)
+#define KV_CP_PAGES	(2 * 16)	/* two checkpoint slots */
+
+static const MTDKVConfig kv_cfg = { (BaseMTDDriver *)&kv_part };
+static MTDKV kv;
+
+/* expected store content, length -1 if key is absent */
+static uint8_t kv_vals[KV_KEYS][MTDKV_MAX_VALUE];
+static int kv_lens[KV_KEYS];
+
+/* flash image with its expected content */
+static struct {
+	uint8_t flash[KV_SIZE];
+	uint8_t vals[KV_KEYS][MTDKV_MAX_VALUE];
+	int lens[KV_KEYS];
+} kv_image;
+
+static uint8_t *kv_flash(void)
+{
+	return chip_a.emu.mem + kv_part.start_page * kv_part.page_size;
+}
+
+static uint32_t kv_flash_ops(void)
+{
+	return chip_a.emu.stats.program_ops + chip_a.emu.stats.erase_ops;
+}
+
+static void kv_save(void)
+{
+	memcpy(kv_image.flash, kv_flash(), KV_SIZE);
+	memcpy(kv_image.vals, kv_vals, sizeof(kv_vals));
+	memcpy(kv_image.lens, kv_lens, sizeof(kv_lens));
+}
+
+static void kv_restore(void)
+{
+	memcpy(kv_flash(), kv_image.flash, KV_SIZE);
+	memcpy(kv_vals, kv_image.vals, sizeof(kv_vals));
+	memcpy(kv_lens, kv_image.lens, sizeof(kv_lens));
+}
+
+/**
+ * @brief power cycle chip, remount store, RAM state is lost
+ */
+static void kv_reboot(void)
+{
+	flashemu_power_on(&chip_a.emu);
+	sst25ObjectInit(&chip_a.drv);
+	sst25Start(&chip_a.drv, &chip_a.cfg);
+	CHECK(blkConnect(&chip_a.drv) == HAL_SUCCESS);
+	sst25InitPartition(&chip_a.drv, &kv_part, &part_defs[2]);
+
+	mtdkvObjectInit(&kv);
+	CHECK(mtdkvStart(&kv, &kv_cfg) == HAL_SUCCESS);
+}
+
+/**
+ * @brief set key, delete it if @p vlen < 0
+ */
+static bool kv_store(int k, const uint8_t *val, int vlen)
+{
+	char key[16];
+
+	sprintf(key, "key.%d", k);
+	if (vlen < 0)
+		return mtdkvDelete(&kv, key);
+	return mtdkvSet(&kv, key, val, vlen);
+}
+
+/**
+ * @brief kv_store() which also updates expected content
+ */
+static bool kv_update(int k, const uint8_t *val, int vlen)
+{
+	if (kv_store(k, val, vlen) == HAL_FAILED)
+		return HAL_FAILED;
+
+	if (vlen > 0)
+		memcpy(kv_vals[k], val, vlen);
+	kv_lens[k] = vlen;
+	return HAL_SUCCESS;
+}
+
+static bool kv_matches(int k, const uint8_t *val, int vlen)
+{
+	uint8_t buf[MTDKV_MAX_VALUE];
+	size_t len = sizeof(buf);
+	char key[16];
+	bool ret;
+
+	sprintf(key, "key.%d", k);
+	ret = mtdkvGet(&kv, key, buf, &len);
+	if (vlen < 0)
+		return ret == HAL_FAILED;
+	return ret == HAL_SUCCESS && (int)len == vlen && memcmp(buf, val, len) == 0;
+}
+
+/**
+ * @brief compare store with expected content
+ * Key @p k may hold @p val instead (interrupted update), expected content
+ * then follows the store.
+ * @return number of wrong keys
+ */
+static uint32_t kv_verify(int k, const uint8_t *val, int vlen)
+{
+	uint32_t bad = 0;
+	int i;
+
+	for (i = 0; i < KV_KEYS; i++) {
+		if (kv_matches(i, kv_vals[i], kv_lens[i]))
+			continue;
+		if (i == k && kv_matches(i, val, vlen)) {
+			if (vlen > 0)
+				memcpy(kv_vals[i], val, vlen);
+			kv_lens[i] = vlen;
+			continue;
+		}
+		bad++;
+	}
+
+	return bad;
+}
+
+static void kv_random_update(int *kp, uint8_t *val, int *vlenp)
+{
+	int k = test_rand() % KV_KEYS;
+
+	*vlenp = (test_rand() % 8 == 0 && kv_lens[k] >= 0)? -1 : (int)(test_rand() % 60);
+	test_fill(val, (*vlenp > 0)? *vlenp : 0);
+	*kp = k;
+}
+
+static void kv_random_ops(uint32_t nr)
+{
+	uint8_t val[MTDKV_MAX_VALUE];
+	int k, vlen;
+
+	while (nr--) {
+		kv_random_update(&k, val, &vlen);
+		CHECK(kv_update(k, val, vlen) == HAL_SUCCESS);
+	}
+}
+
+/**
+ * @brief cut power at every @p step -th flash command of update
+ * Each run starts from the same image. After reboot the updated key must
+ * hold old or new value, other keys intact, and the store must take and
+ * keep next update. Last run completes the update and reboots at once.
+ * @return flash commands of the update
+ */
+static uint32_t kv_cut_sweep(int k, const uint8_t *val, int vlen, uint32_t step)
+{
+	uint8_t other[8];
+	uint32_t ops, cut;
+
+	kv_save();
+	kv_reboot();
+	ops = kv_flash_ops();
+	CHECK(kv_store(k, val, vlen) == HAL_SUCCESS);
+	ops = kv_flash_ops() - ops;
+
+	for (cut = 1; cut <= ops + 1; cut += (cut + step + 4 < ops)? step : 1) {
+		kv_restore();
+		kv_reboot();
+
+		flashemu_power_cut(&chip_a.emu, cut);
+		kv_store(k, val, vlen);
+		kv_reboot();
+		if (!CHECK(kv_verify(k, val, vlen) == 0)) {
+			fprintf(stderr, "hosttest: power cut at %" PRIu32 " of %" PRIu32 "\n", cut, ops);
+			break;
+		}
+
+		test_fill(other, sizeof(other));
+		CHECK(kv_update((k + 1) % KV_KEYS, other, sizeof(other)) == HAL_SUCCESS);
+		kv_reboot();
+		CHECK(kv_verify(-1, NULL, 0) == 0);
+	}
+
+	return ops;
+}
+
+/**
+ * @brief format store and fill it with @p nr random updates
+ */
+static void kv_setup(uint32_t nr)
+{
+	int k;
+
+	CHECK(mtdErase(&kv_part, 0, kv_part.nr_pages) == HAL_SUCCESS);
+	mtdkvObjectInit(&kv);
+	CHECK(mtdkvStart(&kv, &kv_cfg) == HAL_SUCCESS);
+	CHECK(mtdkvFormat(&kv) == HAL_SUCCESS);
+	for (k = 0; k < KV_KEYS; k++)
+		kv_lens[k] = -1;
+
+	kv_random_ops(nr);
+}
+
+static void test_kv(void)
+{
+	int i, compacted = 0;
+
+	/* compaction */
+	kv_setup(3000);
+	CHECK(kv.stats.compactions > 0);
+	CHECK(kv_verify(-1, NULL, 0) == 0);
+
+	/* mount from checkpoint scans only records after it */
+	CHECK(mtdkvCheckpoint(&kv) == HAL_SUCCESS);
+	kv_random_ops(5);
+	kv_reboot();
+	CHECK(kv.stats.mount_checkpoint);
+	CHECK(kv.stats.mount_records == 5);
+	CHECK(kv_verify(-1, NULL, 0) == 0);
+
+	/* no checkpoint: full scan, checkpoints resume */
+	CHECK(mtdErase(&kv_part, 0, KV_CP_PAGES) == HAL_SUCCESS);
+	kv_reboot();
+	CHECK(!kv.stats.mount_checkpoint);
+	CHECK(kv.stats.mount_records > 5);
+	CHECK(kv_verify(-1, NULL, 0) == 0);
+	kv_random_ops(300);
+	kv_reboot();
+	CHECK(kv.stats.mount_checkpoint);
+	CHECK(kv_verify(-1, NULL, 0) == 0);
+
+	/* steady state: compaction between checkpoints keeps them usable */
+	for (i = 0; i < 40; i++) {
+		kv_random_ops(37 + test_rand() % 90);
+		compacted += (kv.stats.compactions > 0);
+		kv_reboot();
+		CHECK(kv.stats.mount_checkpoint);
+		CHECK(kv_verify(-1, NULL, 0) == 0);
+	}
+	CHECK(compacted > 10);
+	pool_check();
+}
+
+static void test_kv_power(void)
+{
+	uint8_t val[MTDKV_MAX_VALUE];
+	uint32_t compactions, ops, i;
+	int k, vlen;
+
+	kv_setup(200);
+
+	/* torn record: update, new key, delete */
+	test_fill(val, 60);
+	for (k = 0; kv_lens[k] < 0; k++)
+		;
+	kv_cut_sweep(k, val, 60, 1);
+	for (k = 0; kv_lens[k] >= 0; k++)
+		;
+	kv_cut_sweep(k, val, 30, 1);
+	kv_cut_sweep(k, NULL, -1, 1);
+
+	/* power lost during compaction or before next checkpoint */
+	for (i = 0; i < 2000; i++) {
+		kv_random_update(&k, val, &vlen);
+		kv_save();
+		compactions = kv.stats.compactions;
+		CHECK(kv_update(k, val, vlen) == HAL_SUCCESS);
+		if (kv.stats.compactions != compactions)
+			break;
+	}
+	if (CHECK(i < 2000)) {
+		kv_restore();
+		ops = kv_cut_sweep(k, val, vlen, 7);
+		CHECK(ops > 16);
+	}
+	pool_check();
+}
+
+/* -*- mtdclog -*- */
+
+static void test_clog(void)
+{
+	const MTDCLogConfig cfg = { (BaseMTDDriver *)&dst_part, MTDCLOG_CODEC_LZ };
+	static MTDCLog clog;
+	static uint8_t wbuf[800], rbuf[800];
+	uint8_t *pages[MTD_POOL_NR_PAGES];
+	size_t done;
+	uint32_t i;
+
+	for (i = 0; i < sizeof(wbuf); i++)
+		wbuf[i] = (i / 16) ^ (test_rand() % 4);
+	mtdclogObjectInit(&clog);
+	CHECK(mtdclogStart(&clog, &cfg) == HAL_SUCCESS);
+	CHECK(mtdclogFormat(&clog) == HAL_SUCCESS);
+	CHECK(mtdclogWrite(&clog, wbuf, 100) == 100);
+
+	/* flush fails: nothing of the call is accepted, retry stores it once */
+	for (i = 0; i < MTD_POOL_NR_PAGES; i++)
+		pages[i] = mtdPoolAllocPage();
+	CHECK(mtdclogWrite(&clog, wbuf + 100, 700) == 0);
+	CHECK(mtdclogGetEnd(&clog) == 100);
+	for (i = 0; i < MTD_POOL_NR_PAGES; i++)
+		mtdPoolFreePage(pages[i]);
+
+	for (done = 100; done < sizeof(wbuf); ) {
+		size_t n = mtdclogWrite(&clog, wbuf + done, sizeof(wbuf) - done);
+
+		if (!CHECK(n > 0))
+			break;
+		done += n;
+	}
+	CHECK(mtdclogFlush(&clog) == HAL_SUCCESS);
+	CHECK(mtdclogGetEnd(&clog) == sizeof(wbuf));
+	CHECK(mtdclogRead(&clog, 0, rbuf, sizeof(rbuf)) == sizeof(rbuf));
+	CHECK(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+
+	/* remount finds the same stream */
+	mtdclogObjectInit(&clog);
+	CHECK(mtdclogStart(&clog, &cfg) == HAL_SUCCESS);
+	CHECK(mtdclogGetEnd(&clog) == sizeof(wbuf));
+	CHECK(mtdclogRead(&clog, 0, rbuf, sizeof(rbuf)) == sizeof(rbuf));
+	CHECK(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+	pool_check();
+}
+
+/* -*- mtdCopy -*- */
+
+static void test_copy(void)
+{
+	BaseMTDDriver *src = (BaseMTDDriver *)&src_part;
+	BaseMTDDriver *dst = (BaseMTDDriver *)&dst_part;
+	BaseMTDDriver *far = (BaseMTDDriver *)&far_part;
+	const uint32_t n = 16 * 4096;
+	static uint8_t wbuf[16 * 4096], rbuf[16 * 4096];
+	uint8_t *pages[MTD_POOL_NR_PAGES];
+	uint32_t dirty, blank, i;
+
+	test_fill(wbuf, n);
+	memset(wbuf + 2 * 4096, 0xff, 2 * 4096);
+	CHECK(mtdErase(src, 0, src->nr_pages) == HAL_SUCCESS);
+	CHECK(mtdWriteBytes(src, 0, wbuf, n) == HAL_SUCCESS);
+
+	/* one dirty destination block, rest blank */
+	CHECK(mtdErase(dst, 0, dst->nr_pages) == HAL_SUCCESS);
+	CHECK(mtdWriteBytes(dst, 5 * 4096, (const uint8_t *)"dirty", 5) == HAL_SUCCESS);
+	CHECK(blkSync(dst) == HAL_SUCCESS);
+	dirty = chip_erase_count(&chip_a, dst, 5);
+	blank = chip_erase_count(&chip_a, dst, 6);
+
+	CHECK(mtdCopy(src, 0, dst, 0, n, true) == HAL_SUCCESS);
+	CHECK(chip_erase_count(&chip_a, dst, 5) == dirty + 1);
+	CHECK(chip_erase_count(&chip_a, dst, 6) == blank);
+	CHECK(mtdReadBytes(dst, 0, rbuf, n) == HAL_SUCCESS);
+	CHECK(memcmp(rbuf, wbuf, n) == 0);
+
+	/* other chip, unaligned */
+	CHECK(mtdErase(far, 0, far->nr_pages) == HAL_SUCCESS);
+	CHECK(mtdCopy(src, 13, far, 100, n - 200, true) == HAL_SUCCESS);
+	CHECK(mtdReadBytes(far, 100, rbuf, n - 200) == HAL_SUCCESS);
+	CHECK(memcmp(rbuf, wbuf + 13, n - 200) == 0);
+
+	/* bad ranges */
+	CHECK(mtdCopy(src, 0, src, 100, 200, false) == HAL_FAILED);
+	CHECK(mtdCopy(src, 0, far, 0, mtdGetSize(src) + 1, false) == HAL_FAILED);
+
+	/* partial block not erased by caller: fails before programming */
+	CHECK(mtdErase(far, 0, 16) == HAL_SUCCESS);
+	CHECK(mtdWriteBytes(far, 5, (const uint8_t *)"", 1) == HAL_SUCCESS);
+	CHECK(mtdCopy(src, 0, far, 0, 100, true) == HAL_FAILED);
+	CHECK(mtdReadBytes(far, 0, rbuf, 5) == HAL_SUCCESS && test_is_erased(rbuf, 5));
+
+	/* one pool page for aligned copy, two when alignment differs */
+	for (i = 0; i < MTD_POOL_NR_PAGES - 1; i++)
+		pages[i] = mtdPoolAllocPage();
+	CHECK(mtdCopy(src, 0, far, 2 * 4096, 4096, true) == HAL_SUCCESS);
+	CHECK(mtdCopy(src, 13, far, 3 * 4096, 4096, false) == HAL_FAILED);
+	pages[i] = mtdPoolAllocPage();
+	CHECK(mtdCopy(src, 0, far, 2 * 4096, 4096, false) == HAL_FAILED);
+	for (i = 0; i < MTD_POOL_NR_PAGES; i++)
+		mtdPoolFreePage(pages[i]);
+	pool_check();
+}
+
+/* -*- program time -*- */
+
+static void test_program(void)
+{
+	BaseMTDDriver *mtdp = (BaseMTDDriver *)&src_part;
+	uint64_t limit_ns = 4096ULL * chip_a.emu.model->busy_us[FLASHEMU_PROGRAM] * 2 * 1000;
+	static uint8_t wbuf[4096], rbuf[4096];
+	uint64_t t;
+
+	/* byte (or AAI word) program waits must not sleep a tick each */
+	test_fill(wbuf, sizeof(wbuf));
+	CHECK(mtdErase(mtdp, 0, 16) == HAL_SUCCESS);
+	CHECK(blkSync(mtdp) == HAL_SUCCESS);
+	t = host_time_ns();
+	CHECK(blkWrite(mtdp, 0, wbuf, 16) == HAL_SUCCESS);
+	CHECK(blkSync(mtdp) == HAL_SUCCESS);
+	t = host_time_ns() - t;
+	printf("program    blkWrite 4 KiB %.1f ms\n", t / 1e6);
+	CHECK(t < limit_ns);
+	CHECK(blkRead(mtdp, 0, rbuf, 16) == HAL_SUCCESS);
+	CHECK(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+
+	/* AAI stream: one word per program time */
+	CHECK(mtdErase(mtdp, 0, 16) == HAL_SUCCESS);
+	CHECK(blkSync(mtdp) == HAL_SUCCESS);
+	t = host_time_ns();
+	CHECK(sst25ProgramErased(&src_part, 0, wbuf, sizeof(wbuf)) == HAL_SUCCESS);
+	CHECK(blkSync(mtdp) == HAL_SUCCESS);
+	t = host_time_ns() - t;
+	printf("program    sst25ProgramErased 4 KiB %.1f ms\n", t / 1e6);
+	CHECK(t < limit_ns / 2);
+	CHECK(blkRead(mtdp, 0, rbuf, 16) == HAL_SUCCESS);
+	CHECK(memcmp(rbuf, wbuf, sizeof(wbuf)) == 0);
+	pool_check();
+}
+
+/* -*- main -*- */
+
+static const struct {
+	const char *name;
+	void (*run)(void);
+} tests[] = {
+	{ "fatfs", test_fatfs },
+	{ "concat", test_concat },
+	{ "capture", test_capture },
+	{ "file", test_file },
+	{ "kv", test_kv },
+	{ "kvpower", test_kv_power },
+	{ "clog", test_clog },
+	{ "copy", test_copy },
+	{ "program", test_program },
+};
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: hosttest [options] [test...]\n"
+		"  -v               driver debug messages\n"
+		"tests: fatfs concat capture file kv kvpower clog copy program (default all)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	int opt, arg;
+
+	while ((opt = getopt(argc, argv, "vh")) != -1) {
+		switch (opt) {
+		case 'v':
+			host_verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	chip_start(&chip_a, "sst25vf032b");
+	chip_start(&chip_b, "w25q32");
+	chip_start(&chip_c, "sst25vf016b");
+	chip_start(&chip_d, "sst25vf016b");
+
+	sst25InitPartition(&chip_a.drv, &fat_part, &part_defs[0]);
+	sst25InitPartition(&chip_a.drv, &file_part, &part_defs[1]);
+	sst25InitPartition(&chip_a.drv, &kv_part, &part_defs[2]);
+	sst25InitPartition(&chip_a.drv, &cap_part, &part_defs[3]);
+	sst25InitPartition(&chip_a.drv, &src_part, &part_defs[4]);
+	sst25InitPartition(&chip_a.drv, &dst_part, &part_defs[5]);
+	sst25InitPartition(&chip_b.drv, &far_part, &far_def);
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		int failed = nr_failed;
+
+		if (optind < argc) {
+			for (arg = optind; arg < argc; arg++)
+				if (strcmp(argv[arg], tests[i].name) == 0)
+					break;
+			if (arg == argc)
+				continue;
+		}
+
+		tests[i].run();
+		printf("%-10s %s\n", tests[i].name, (nr_failed == failed)? "ok" : "FAILED");
+	}
+
+	printf("%d checks, %d failed, %.3f s virtual time\n",
+			nr_checks, nr_failed, host_time_ns() / 1e9);
+	return nr_failed != 0;
+}
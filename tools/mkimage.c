@@ -0,0 +1,464 @@
+/**
+ * @file       mkimage.c
+ * @brief      Raw chip image builder for production programming
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Runs sst25.c and partition formats (mtdclog) against an emulated
+ * erased chip, fills partitions and saves chip contents, so the image
+ * is exactly what the firmware would have written on device.
+ * Output image is meant for sst25ProgramErased() (or a programmer),
+ * manifest lists CRC-32 of each partition for mtdCalcCrc32() check.
+ *
+ * Partitions come from -p options or from the firmware table:
+ *   make mkimage PARTS=board_flash.h TABLE=board_partitions
+ * where header defines const struct sst25_partition TABLE[].
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "flash-mtd.h"
+#include "mtdclog.h"
+#include "flashemu.h"
+
+#if defined(MKIMAGE_PARTS)
+#include MKIMAGE_PARTS
+#endif
+
+#define IMG_MAX_PARTS		16
+#define IMG_MAX_OPS		64
+
+struct img_part {
+	SST25Driver drv;
+	struct mtd_partition def;
+};
+
+enum img_op_type {
+	IMG_OP_BLOB,
+	IMG_OP_CLOG
+};
+
+struct img_op {
+	enum img_op_type type;
+	const char *part;
+	const char *path;
+	uint32_t offset;
+	mtdclog_codec_t codec;
+};
+
+static struct flashemu emu;
+static SPIConfig spicfg = { .hz = 20000000 };
+static SPIDriver spid = { .emu = &emu };
+static const SST25Config flash_cfg = {
+	.spip = &spid,
+	.spicfg = &spicfg
+};
+static SST25Driver flash;
+
+static struct img_part parts[IMG_MAX_PARTS];
+static int nr_parts;
+static struct img_op ops[IMG_MAX_OPS];
+static int nr_ops;
+
+static const char *codec_names[] = { "raw", "lz", "delta16", "delta32" };
+
+/* -*- helpers -*- */
+
+static SST25Driver *img_find_part(const char *name)
+{
+	int i;
+
+#if defined(MKIMAGE_TABLE)
+	const struct sst25_partition *ptbl;
+
+	for (ptbl = MKIMAGE_TABLE; ptbl->partp != NULL; ptbl++)
+		if (strcmp(ptbl->definition.name, name) == 0)
+			return ptbl->partp;
+#endif
+
+	for (i = 0; i < nr_parts; i++)
+		if (strcmp(parts[i].def.name, name) == 0)
+			return &parts[i].drv;
+
+	return NULL;
+}
+
+static uint8_t *img_load(const char *path, size_t *lenp)
+{
+	FILE *fp = fopen(path, "rb");
+	uint8_t *data = NULL;
+	long len = 0;
+
+	if (fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 ||
+			fseek(fp, 0, SEEK_SET) != 0 ||
+			(data = malloc(len + 1)) == NULL ||
+			fread(data, 1, len, fp) != (size_t)len) {
+		fprintf(stderr, "mkimage: %s: %s\n", path, strerror(errno));
+		free(data);
+		data = NULL;
+	}
+
+	if (fp != NULL)
+		fclose(fp);
+	*lenp = len;
+	return data;
+}
+
+static int img_save(const char *path, const uint8_t *data, size_t len)
+{
+	FILE *fp = fopen(path, "wb");
+
+	if (fp == NULL || fwrite(data, 1, len, fp) != len) {
+		fprintf(stderr, "mkimage: %s: %s\n", path, strerror(errno));
+		if (fp != NULL)
+			fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * @brief (re)start driver on erased emulated chip
+ */
+static int img_chip_init(const struct flashemu_model *model)
+{
+	flashemu_free(&emu);
+	if (flashemu_init(&emu, model) != 0) {
+		fprintf(stderr, "mkimage: out of memory\n");
+		return -1;
+	}
+
+	sst25ObjectInit(&flash);
+	sst25Start(&flash, &flash_cfg);
+	if (blkConnect(&flash) == HAL_FAILED) {
+		fprintf(stderr, "mkimage: connect failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* -*- content -*- */
+
+static int img_blob(SST25Driver *part, const struct img_op *op)
+{
+	size_t len;
+	uint8_t *data = img_load(op->path, &len);
+	int ret = 0;
+
+	if (data == NULL)
+		return -1;
+
+	if (op->offset > mtdGetSize(part) || len > mtdGetSize(part) - op->offset) {
+		fprintf(stderr, "mkimage: %s: does not fit in %s\n", op->path, op->part);
+		ret = -1;
+	}
+	else if (mtdWriteBytes((BaseMTDDriver *)part, op->offset, data, len) == HAL_FAILED) {
+		fprintf(stderr, "mkimage: %s: write failed\n", op->part);
+		ret = -1;
+	}
+
+	free(data);
+	return ret;
+}
+
+static int img_clog(SST25Driver *part, const struct img_op *op)
+{
+	MTDCLogConfig cfg = { .mtdp = (BaseMTDDriver *)part, .codec = op->codec };
+	MTDCLog clog;
+	size_t len, done = 0;
+	uint8_t *data = img_load(op->path, &len);
+	int ret = 0;
+
+	if (data == NULL)
+		return -1;
+
+	mtdclogObjectInit(&clog);
+	mtdclogStart(&clog, &cfg);
+	if (mtdclogFormat(&clog) == HAL_FAILED) {
+		ret = -1;
+		goto out;
+	}
+
+	while (done < len) {
+		size_t n = mtdclogWrite(&clog, data + done, len - done);
+
+		if (n == 0) {
+			ret = -1;
+			goto out;
+		}
+		done += n;
+	}
+
+	if (mtdclogFlush(&clog) == HAL_FAILED)
+		ret = -1;
+	else if (mtdclogGetStart(&clog) != 0)
+		fprintf(stderr, "mkimage: %s: log wrapped, first %" PRIu32 " bytes dropped\n",
+				op->part, mtdclogGetStart(&clog));
+
+out:
+	if (ret != 0)
+		fprintf(stderr, "mkimage: %s: log write failed\n", op->part);
+	free(data);
+	return ret;
+}
+
+/* -*- output -*- */
+
+static void manifest_line(FILE *fp, const char *name, uint32_t offset, uint32_t len)
+{
+	fprintf(fp, "%-12s 0x%08" PRIx32 " 0x%08" PRIx32 " 0x%08" PRIx32 "\n",
+			name, offset, len, mtdCrc32(0, emu.mem + offset, len));
+}
+
+static int write_manifest(const char *path)
+{
+	FILE *fp = (strcmp(path, "-") == 0)? stdout : fopen(path, "w");
+	int i;
+
+	if (fp == NULL) {
+		fprintf(stderr, "mkimage: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	fprintf(fp, "# name        offset     length     crc32\n");
+#if defined(MKIMAGE_TABLE)
+	const struct sst25_partition *ptbl;
+
+	for (ptbl = MKIMAGE_TABLE; ptbl->partp != NULL; ptbl++)
+		manifest_line(fp, ptbl->definition.name,
+				ptbl->partp->start_page * flash.page_size,
+				ptbl->partp->nr_pages * flash.page_size);
+#endif
+	for (i = 0; i < nr_parts; i++)
+		manifest_line(fp, parts[i].def.name,
+				parts[i].drv.start_page * flash.page_size,
+				parts[i].drv.nr_pages * flash.page_size);
+	manifest_line(fp, "chip", 0, emu.model->size);
+
+	if (fp != stdout)
+		fclose(fp);
+	return 0;
+}
+
+/**
+ * @brief program image into erased chip both ways, report time and verify
+ */
+static int simulate_production(const struct flashemu_model *model, const uint8_t *image)
+{
+	uint32_t size = model->size;
+	uint32_t crc = mtdCrc32(0, image, size);
+	uint32_t flash_crc;
+	uint64_t t0;
+	double t_write, t_fast;
+
+	if (img_chip_init(model) != 0)
+		return -1;
+	t0 = host_time_ns();
+	if (blkWrite(&flash, 0, image, flash.nr_pages) == HAL_FAILED) {
+		fprintf(stderr, "mkimage: blkWrite failed\n");
+		return -1;
+	}
+	t_write = (host_time_ns() - t0) / 1e9;
+
+	if (img_chip_init(model) != 0)
+		return -1;
+	t0 = host_time_ns();
+	if (sst25ProgramErased(&flash, 0, image, size) == HAL_FAILED) {
+		fprintf(stderr, "mkimage: sst25ProgramErased failed\n");
+		return -1;
+	}
+	t_fast = (host_time_ns() - t0) / 1e9;
+
+	if (mtdCalcCrc32((BaseMTDDriver *)&flash, 0, size, &flash_crc) == HAL_FAILED ||
+			flash_crc != crc) {
+		fprintf(stderr, "mkimage: verify failed: crc 0x%08" PRIx32 ", expected 0x%08" PRIx32 "\n",
+				flash_crc, crc);
+		return -1;
+	}
+
+	printf("program time   blkWrite %.2f s, sst25ProgramErased %.2f s (%.1fx)\n",
+			t_write, t_fast, (t_fast > 0.0)? t_write / t_fast : 0.0);
+	printf("verify         crc32 0x%08" PRIx32 " ok\n", crc);
+	return 0;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: mkimage [options] -o image\n"
+		"  -d model                chip model (sst25vf016b, sst25vf032b, w25q32,\n"
+		"                          w25q64, mx25l3233f)\n"
+		"  -p name:start:n         partition, start page and page count (repeatable)\n"
+		"  -w name:offset:file     program file at byte offset of partition\n"
+		"  -l name:codec:file      format partition as compressed log\n"
+		"                          (raw, lz, delta16, delta32) and append file\n"
+		"  -o file                 raw chip image\n"
+		"  -m file                 manifest: offset, length, crc32 per partition (- stdout)\n"
+		"  -P                      simulate production programming and verify\n"
+		"  -f hz                   SPI clock for -P (20000000)\n"
+		"  -v                      driver log\n");
+	exit(2);
+}
+
+/**
+ * @brief split "name:arg:file"
+ */
+static void parse_op(struct img_op *op, char *arg)
+{
+	char *p1 = strchr(arg, ':');
+	char *p2 = (p1 != NULL)? strchr(p1 + 1, ':') : NULL;
+
+	if (p2 == NULL || nr_ops == IMG_MAX_OPS)
+		usage();
+
+	*p1++ = '\0';
+	*p2++ = '\0';
+	op->part = arg;
+	op->path = p2;
+
+	if (op->type == IMG_OP_BLOB) {
+		op->offset = strtoul(p1, NULL, 0);
+	}
+	else {
+		size_t i;
+
+		for (i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++)
+			if (strcmp(codec_names[i], p1) == 0)
+				break;
+		if (i == sizeof(codec_names) / sizeof(codec_names[0]))
+			usage();
+		op->codec = i;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	const struct flashemu_model *model = flashemu_find_model("sst25vf032b");
+	const char *out_path = NULL;
+	const char *manifest_path = NULL;
+	bool production = false;
+	uint8_t *image;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "d:p:w:l:o:m:Pf:v")) != -1) {
+		switch (opt) {
+		case 'd':
+			model = flashemu_find_model(optarg);
+			if (model == NULL) {
+				fprintf(stderr, "mkimage: unknown model %s\n", optarg);
+				return 2;
+			}
+			break;
+		case 'p': {
+			struct mtd_partition *def = &parts[nr_parts].def;
+			char *name = strdup(optarg);
+			char *p = strchr(name, ':');
+
+			if (nr_parts == IMG_MAX_PARTS || p == NULL ||
+					sscanf(p + 1, "%" SCNi32 ":%" SCNi32, &def->start_page, &def->nr_pages) != 2)
+				usage();
+			*p = '\0';
+			def->name = name;
+			nr_parts++;
+			break;
+		}
+		case 'w':
+		case 'l':
+			ops[nr_ops].type = (opt == 'w')? IMG_OP_BLOB : IMG_OP_CLOG;
+			parse_op(&ops[nr_ops], optarg);
+			nr_ops++;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'm':
+			manifest_path = optarg;
+			break;
+		case 'P':
+			production = true;
+			break;
+		case 'f':
+			spicfg.hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			host_verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (optind != argc || out_path == NULL)
+		usage();
+
+	if (img_chip_init(model) != 0)
+		return 1;
+
+#if defined(MKIMAGE_TABLE)
+	sst25InitPartitionTable(&flash, MKIMAGE_TABLE);
+#endif
+	for (i = 0; i < nr_parts; i++) {
+		if (parts[i].def.start_page >= flash.nr_pages) {
+			fprintf(stderr, "mkimage: partition %s out of chip\n", parts[i].def.name);
+			return 2;
+		}
+		sst25InitPartition(&flash, &parts[i].drv, &parts[i].def);
+	}
+
+	for (i = 0; i < nr_ops; i++) {
+		SST25Driver *part = img_find_part(ops[i].part);
+		int ret;
+
+		if (part == NULL) {
+			fprintf(stderr, "mkimage: unknown partition %s\n", ops[i].part);
+			return 2;
+		}
+
+		ret = (ops[i].type == IMG_OP_BLOB)? img_blob(part, &ops[i]) : img_clog(part, &ops[i]);
+		if (ret != 0)
+			return 1;
+	}
+
+	if (img_save(out_path, emu.mem, model->size) != 0)
+		return 1;
+	if (manifest_path != NULL && write_manifest(manifest_path) != 0)
+		return 1;
+
+	if (production) {
+		image = malloc(model->size);
+		if (image == NULL) {
+			fprintf(stderr, "mkimage: out of memory\n");
+			return 1;
+		}
+		memcpy(image, emu.mem, model->size);
+		if (simulate_production(model, image) != 0)
+			return 1;
+		free(image);
+	}
+
+	flashemu_free(&emu);
+	return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * @file       trace2json.c
+ * @brief      Convert SST25 SPI trace dump to Chrome trace event JSON
+ * @author     Vladimir Ermakov Copyright (C) 2014.
+ *
+ * Input is struct sst25_trace_buffer copied from target memory
+ * (or written by flashsim -T). Output opens in Perfetto UI or
+ * chrome://tracing: one process per SPI bus, threads for bus
+ * transfers, driver operations and busy waits.
+ *
+ * Timestamps are 32-bit and unwrapped assuming no gap between
+ * consecutive entries is longer than half of the counter period.
+ */
+/*
+ * chibios-flash
+ * Copyright (c) 2014, Vlidimir Ermakov, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+/* dump layout, see sst25.h (little endian) */
+#define TRACE_MAGIC		0x54353253UL
+#define TRACE_HDR_SIZE		16
+#define TRACE_ENTRY_SIZE	20
+
+#define OP_WRITE		0xf0
+#define OP_ERASE		0xf1
+#define OP_WAIT			0xf2
+
+enum trace_tid {
+	TID_BUS = 1,
+	TID_OPS,
+	TID_WAIT
+};
+
+static const struct {
+	uint8_t op;
+	const char *name;
+} op_names[] = {
+	{ 0x03, "READ" },
+	{ 0x0b, "FAST_READ" },
+	{ 0x20, "ERASE_4K" },
+	{ 0x52, "ERASE_32K" },
+	{ 0xd8, "ERASE_64K" },
+	{ 0x60, "CHIP_ERASE" },
+	{ 0xc7, "CHIP_ERASE" },
+	{ 0x02, "BYTE_PROG" },
+	{ 0xad, "AAI_WORD_PROG" },
+	{ 0x05, "RDSR" },
+	{ 0x50, "EWSR" },
+	{ 0x01, "WRSR" },
+	{ 0x06, "WREN" },
+	{ 0x04, "WRDI" },
+	{ 0x9f, "JDEC_ID" },
+	{ 0x70, "EBSY" },
+	{ 0x80, "DBSY" },
+	{ OP_WRITE, "write" },
+	{ OP_ERASE, "erase" },
+};
+
+static const char *wait_names[] = { "wait program", "wait erase", "wait chip erase" };
+
+static uint32_t le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char *op_name(uint8_t op, uint32_t addr)
+{
+	static char buf[16];
+	size_t i;
+
+	if (op == OP_WAIT)
+		return (addr < 3)? wait_names[addr] : "wait";
+
+	for (i = 0; i < sizeof(op_names) / sizeof(op_names[0]); i++)
+		if (op_names[i].op == op)
+			return op_names[i].name;
+
+	snprintf(buf, sizeof(buf), "cmd 0x%02x", op);
+	return buf;
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *in, *out = stdout;
+	uint8_t hdr[TRACE_HDR_SIZE];
+	uint8_t *entries;
+	uint32_t clock_hz, size, head, count, first, i;
+	uint32_t prev_end = 0;
+	uint64_t end64 = 0;
+	uint8_t devs_seen[256] = { 0 };
+	int first_event = 1;
+
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: trace2json <dump> [out.json]\n");
+		return 2;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		fprintf(stderr, "trace2json: %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, in) != 1 || le32(hdr) != TRACE_MAGIC) {
+		fprintf(stderr, "trace2json: %s: not a trace dump\n", argv[1]);
+		return 1;
+	}
+
+	clock_hz = le32(hdr + 4);
+	size = le32(hdr + 8);
+	head = le32(hdr + 12);
+	if (clock_hz == 0 || size == 0 || (size & (size - 1)) != 0) {
+		fprintf(stderr, "trace2json: %s: bad header\n", argv[1]);
+		return 1;
+	}
+
+	entries = malloc((size_t)size * TRACE_ENTRY_SIZE);
+	if (entries == NULL || fread(entries, TRACE_ENTRY_SIZE, size, in) != size) {
+		fprintf(stderr, "trace2json: %s: truncated\n", argv[1]);
+		return 1;
+	}
+	fclose(in);
+
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (out == NULL) {
+			fprintf(stderr, "trace2json: %s: %s\n", argv[2], strerror(errno));
+			return 1;
+		}
+	}
+
+	/* oldest entry first */
+	count = (head < size)? head : size;
+	first = head - count;
+	if (head > size)
+		fprintf(stderr, "trace2json: ring wrapped, %u oldest entries lost\n", head - size);
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = 0; i < count; i++) {
+		const uint8_t *ep = entries + ((first + i) & (size - 1)) * TRACE_ENTRY_SIZE;
+		uint32_t start = le32(ep), end = le32(ep + 4);
+		uint32_t addr = le32(ep + 8), len = le32(ep + 12);
+		uint8_t op = ep[16], dev = ep[17];
+		enum trace_tid tid;
+		uint64_t start64;
+
+		/* entries are stored in completion order */
+		end64 = (i == 0)? end : end64 + (int32_t)(end - prev_end);
+		prev_end = end;
+		start64 = end64 - (uint32_t)(end - start);
+
+		tid = (op == OP_WAIT)? TID_WAIT :
+			(op == OP_WRITE || op == OP_ERASE)? TID_OPS : TID_BUS;
+
+		if (!devs_seen[dev]) {
+			devs_seen[dev] = 1;
+			fprintf(out, "%s{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%u,"
+					"\"args\":{\"name\":\"spi%u\"}},\n"
+					"{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,"
+					"\"args\":{\"name\":\"bus\"}},\n"
+					"{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,"
+					"\"args\":{\"name\":\"ops\"}},\n"
+					"{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%u,\"tid\":%u,"
+					"\"args\":{\"name\":\"wait\"}}",
+					first_event? "" : ",\n", dev, dev,
+					dev, TID_BUS, dev, TID_OPS, dev, TID_WAIT);
+			first_event = 0;
+		}
+
+		fprintf(out, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"addr\":\"0x%06x\",\"len\":%u}}",
+				first_event? "" : ",\n", op_name(op, addr), dev, tid,
+				start64 * 1e6 / clock_hz, (end64 - start64) * 1e6 / clock_hz,
+				(op == OP_WAIT)? 0 : addr, len);
+		first_event = 0;
+	}
+	fprintf(out, "\n]}\n");
+
+	free(entries);
+	if (out != stdout)
+		fclose(out);
+	return 0;
+}